@@ -3,45 +3,601 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #define MAX_LEVEL 16
 #define MAX_GENRES 10
 #define MAX_TITLE_LENGTH 100
 #define MAX_AUTHOR_LENGTH 100
 #define DECAY_RATE 0.9
+#define DECAY_PERIOD (30 * 24 * 60 * 60) // Seconds over which popularity shrinks by DECAY_RATE
+#define DECAY_REBASE_LIMIT 1e150          // Largest borrow weight before scores are rescaled
 #define RECOMMENDATION_COUNT 5
+#define RECOMMENDATION_CACHE_SIZE (4 * RECOMMENDATION_COUNT) // Room for ties with the last recommendation
 #define MAX_USER_NAME 100
 #define MAX_PASSWORD 100
+#define PREFIX_SEARCH_LIMIT 20
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define BULK_MAX_THREADS 16
+#define BULK_MIN_CHUNK_BYTES (1 << 20)  // Smaller files are parsed on fewer threads
+#define STRESS_MAX_THREADS 64
+#define BATCH_OUTPUT_BUFFER (1 << 20)
+#define BENCH_QUERIES 100000 // Timed lookups per benchmarked library size
+#define BENCH_TITLE_LENGTH 40
+#define BENCH_MAX_SIZES 16
+#define USER_SALT_LENGTH 16
+#define USER_HASH_LENGTH 32    // SHA-256 digest
+#define USER_HASH_ROUNDS 1000  // Hash iterations per password check
+#define USER_STORE_MIN_CAPACITY 64
+#define USER_FILE_MAGIC "LIBUSERS"
+#define USER_FILE_VERSION 1
+#define SNAPSHOT_MAGIC "LIBSNAP"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_FILE "library.snap" // Loaded at startup when present
+#define JOURNAL_FILE "library.journal" // Replayed on top of the snapshot at startup
+#define JOURNAL_ADD 1
+#define JOURNAL_BORROW 2
+#define JOURNAL_RETURN 3
+#define JOURNAL_DECAY 4
+#define JOURNAL_REMOVE 5
+#define JOURNAL_RECORD_HEADER 25 // Size, checksum, sequence, time and type
+#define JOURNAL_MAX_PAYLOAD (MAX_TITLE_LENGTH + MAX_AUTHOR_LENGTH + MAX_GENRES * MAX_TITLE_LENGTH + 16)
+#define JOURNAL_GROUP_BYTES (64 << 10) // Buffered bytes that trigger a group commit when desks do not wait
+#define JOURNAL_GROUP_SECONDS 0.01     // Longest a record stays buffered when desks do not wait
+#define JOURNAL_COMPACT_BYTES (64 << 20)
+#define TRIGRAM_MAX_PER_BOOK 512
+#define TRIGRAM_MIN_CAPACITY 4096
+#define FUZZY_MIN_SCORE 0.3 // Smallest trigram overlap (Dice coefficient) worth suggesting
+#define FUZZY_SEARCH_LIMIT 10
+#define AUTHOR_MIN_CAPACITY 1024
+#define AUTHOR_SEARCH_LIMIT 50
+#define BULK_AUTHOR_SLOTS 4096 // Authors one bulk-load thread shares between its books
+#define BULK_GENRE_SLOTS 256   // First size of a bulk-load thread's genre table, which grows
+#define BOOK_ID_PAGE_SIZE (1 << 14)
+#define BOOK_ID_PAGES (1 << 14) // Room for 2^28 book ids
+#define TITLE_INDEX_MIN_CAPACITY 1024
+#define GENRE_MASK_BITS 62 // Genres with a bit in book masks, the first shelves created
+#define BOOK_MASK_AVAILABLE (1ULL << 62)
+#define BOOK_MASK_LISTED (1ULL << 63) // Set for every id that names a book
+#define GENRE_QUERY_LIMIT 50
+#define BENCH_SCANS 200 // Timed whole-catalogue genre scans per benchmarked library size
+#define BENCH_LISTINGS 3
+#define POPULARITY_BLOCK 1024 // Books scanned between raises of the top-K threshold
+#define POPULARITY_LIMIT 50
+#define SCAN_MAX_THREADS 16
+#define SCAN_MIN_ITEMS_PER_THREAD (1 << 16) // Smaller scans run on fewer threads
+#define SCAN_CUTS_PER_PART 64               // Upper-level books per title range, to even out range sizes
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+#define USER_HISTORY_LENGTH 32  // Latest borrows kept per patron
+#define CO_BORROW_WINDOW 8      // Latest borrows of a patron paired with each new one
+#define CO_BORROW_NEIGHBOURS 10 // Most co-borrowed books kept per book
+#define CO_BORROW_LOCKS 64      // Stripes of the locks guarding co-borrow lists
+#define PERSONAL_RECOMMENDATION_COUNT 10
+#define RECOMMEND_TABLE_SIZE 1024 // Power of two, over twice USER_HISTORY_LENGTH * (CO_BORROW_NEIGHBOURS + 1)
+#define BENCH_PATRONS 1000
+#define BENCH_PATRON_BORROWS 20
+#define LOAN_PERIOD (14 * 24 * 60 * 60)       // Seconds a book may be kept
+#define LOAN_REMINDER_LEAD (2 * 24 * 60 * 60) // Seconds before the due date a reminder is sent
+#define LOAN_TICK 60                          // Seconds per slot of the lowest wheel level
+#define LOAN_WHEEL_BITS 6
+#define LOAN_WHEEL_SLOTS (1 << LOAN_WHEEL_BITS) // Slots per level, one bit each in a 64-bit word
+#define LOAN_WHEEL_LEVELS 4                     // Reaches 2^24 ticks ahead, about 31 years
+#define LOAN_OUT 0
+#define LOAN_DUE_SOON 1 // Reminder sent
+#define LOAN_OVERDUE 2
+#define EXPORT_CSV 0
+#define EXPORT_JSONL 1
+#define EXPORT_BUFFER (1 << 20) // Bytes of rows gathered per write
+#define EXPORT_PAGE 1024        // Books fetched from a cursor at a time
+#define PAGE_MAX_BOOKS 1000     // Largest page the page command prints
+#define SHARD_MAX 16
+#define SHARD_ROW_LENGTH 1024 // Longest catalogue row a sharded load reads
+#define TITLE_UNIT 16                                                 // Titles of new books take whole units, so freed ones fit later titles
+#define TITLE_CLASSES ((MAX_TITLE_LENGTH + TITLE_UNIT - 1) / TITLE_UNIT + 1) // Free lists of titles, by units
+#ifndef LIBRARY_METRICS
+#define LIBRARY_METRICS 1 // Build with -DLIBRARY_METRICS=0 to leave operation metrics out
+#endif
+#define METRIC_SUB_BUCKETS 8                           // Latency buckets per power of two
+#define METRIC_BUCKETS (16 + 60 * METRIC_SUB_BUCKETS)  // Exact below 16 ns, then up to 2^64 ns
+#define METRIC_ADD_BOOK 0
+#define METRIC_SEARCH 1
+#define METRIC_FIND_BY_ID 2
+#define METRIC_FIND_BY_TITLE 3
+#define METRIC_BORROW 4
+#define METRIC_RETURN 5
+#define METRIC_RECOMMEND 6
+#define METRIC_GENRE_POSITION 7
+#define METRIC_FUZZY_SEARCH 8
+#define METRIC_BY_AUTHOR 9
+#define METRIC_GENRE_QUERY 10
+#define METRIC_TOP_BOOKS 11
+#define METRIC_DECAY 12
+#define METRIC_PRINT_BOOKS 13
+#define METRIC_RECOMMEND_USER 14
+#define METRIC_EXPORT 15
+#define METRIC_REMOVE 16
+#define METRIC_OPERATIONS 17
+#define WALK_LIBRARY_SEEK 0
+#define WALK_ADD_BOOK 1
+#define WALK_SHELF_SEEK 2
+#define WALK_SHELF_INSERT 3
+#define WALK_SHELF_RANK 4
+#define WALK_BOOK_RANK 5
+#define WALK_KINDS 6
+
+#if LIBRARY_METRICS
+#define METRIC_START(timer) uint64_t timer = metrics_clock()
+#define METRIC_STOP(operation, timer) metrics_latency(operation, metrics_clock() - (timer))
+#define METRIC_WALK(kind, walk) metrics_walk(kind, walk)
+#define METRIC_LEVEL(level) metrics_level(level)
+#else
+#define METRIC_START(timer)
+#define METRIC_STOP(operation, timer)
+#define METRIC_WALK(kind, walk)
+#define METRIC_LEVEL(level)
+#endif
+
+// Header of one block of arena memory
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator for books, shelf entries and their strings, released in one go
+typedef struct Arena
+{
+    ArenaBlock *blocks;
+    size_t allocated; // Bytes reserved from malloc
+} Arena;
+
+// Book status values, compared by pointer
+const char STATUS_AVAILABLE[] = "available";
+const char STATUS_BORROWED[] = "borrowed";
+const char STATUS_REMOVED[] = "removed"; // Left on a removed book, so desks still holding it cannot borrow it
+const char STATUS_MOVED[] = "moved";     // Left on the old node of a book rebuild_levels moved, desks follow it to the new one
+
+// Names of the timed operations and skip list walks, by METRIC_ and WALK_ number
+const char *const METRIC_NAMES[METRIC_OPERATIONS] = {
+    "add_book", "search", "find_book_by_id", "find_book_by_title", "borrow", "return", "recommend",
+    "genre_position", "fuzzy_search", "books_by_author", "genre_query", "top_books", "decay", "print_books",
+    "recommend_for_user", "export_books", "remove_book"};
+const char *const WALK_NAMES[WALK_KINDS] = {"library_seek", "add_book", "shelf_seek", "shelf_insert", "shelf_rank", "book_rank"};
 
 // Structure to represent a user
 typedef struct User {
-    char username[MAX_USER_NAME];
-    char password[MAX_PASSWORD];
+    char *username;  // Lives in the user store arena
+    unsigned char salt[USER_SALT_LENGTH];
+    unsigned char password_hash[USER_HASH_LENGTH];  // Iterated SHA-256 of salt and password
     int user_type;  // 1 for Visitor, 2 for Staff
-    struct User *next;  // Linked list for multiple users
+    _Atomic int *_Atomic history;  // Ids of the latest USER_HISTORY_LENGTH borrows, a ring allocated on the first one
+    _Atomic int history_count;     // Borrows recorded, the latest is at (history_count - 1) % USER_HISTORY_LENGTH
 } User;
 
+// Open-addressing hash table of users keyed by username
+typedef struct UserStore
+{
+    User **slots;  // Linear probing, NULL marks a free slot
+    int capacity;  // Power of two, grown before it is half full
+    int count;
+    Arena arena;   // Memory of every user and username
+} UserStore;
+
+// Running SHA-256 computation
+typedef struct Sha256
+{
+    uint32_t state[8];
+    uint64_t length;  // Bytes hashed so far
+    unsigned char block[64];
+    size_t block_used;
+} Sha256;
+
 typedef struct Book
 {
-    char title[MAX_TITLE_LENGTH];
-    char author[MAX_AUTHOR_LENGTH];
-    char genre[MAX_GENRES][MAX_TITLE_LENGTH];
+    char *title;  // Strings live in the library arena
+    char *author; // Interned, shared by every book of the author
+    char **genre; // gen_count names, shared with the genre shelves
     int gen_count;
-    int borrow_count;
+    int author_id;
+    int id;                   // Stable book id, handed out by add_book and never reused
+    uint64_t genre_mask;      // Bit of each genre shelf with an id below GENRE_MASK_BITS
+    _Atomic int borrow_count; // Borrows ever recorded, never decayed
+    _Atomic double score;     // Decayed popularity, scaled to the library's decay epoch
     time_t last_borrowed;
-    char status[MAX_TITLE_LENGTH];
-    struct Book *forward[MAX_LEVEL];
+    const char *_Atomic status; // STATUS_AVAILABLE or STATUS_BORROWED, changed by compare-and-swap
+    unsigned char level;        // forward holds level + 1 links
+    unsigned short gram_count;  // Distinct trigrams of title and author, set when indexed
+    unsigned char title_units;  // TITLE_UNIT-byte units held by the title, 0 when it was sized to fit
+    struct CoBorrowList *co_borrows; // Books borrowed by the same patrons, NULL until there are any
+    struct Loan *loan;               // Current loan while borrowed, guarded by the loan wheel lock
+    struct BookLink
+    {
+        struct Book *_Atomic next; // Published only once the book is fully built
+        _Atomic int span;          // Books skipped by next, counting the one it points to
+    } forward[];
 } Book;
 
-// Structure to represent the library containing the skip graph
+// A book borrowed by the same patrons as another, with the number of such borrows
+typedef struct CoBorrow
+{
+    int id;
+    int count;
+} CoBorrow;
+
+// Books most often borrowed by the same patrons as one book, guarded by a stripe of the
+// library's co_borrow_locks. Kept unsorted, as it is short.
+typedef struct CoBorrowList
+{
+    int count;
+    CoBorrow entries[CO_BORROW_NEIGHBOURS];
+} CoBorrowList;
+
+// Loan of a borrowed book, waiting in the loan wheel for its reminder or due date
+typedef struct Loan
+{
+    Book *book;
+    User *user;         // Borrower, NULL for a borrow outside any patron account
+    time_t due;
+    uint64_t fire;      // Tick at which the loan next needs attention
+    int stage;          // LOAN_OUT, LOAN_DUE_SOON or LOAN_OVERDUE
+    signed char level;  // Wheel level holding the loan, -1 once on the overdue list
+    unsigned char slot;
+    struct Loan *next;
+    struct Loan *prev;
+} Loan;
+
+// Hierarchical timing wheel of loans. Level l has a slot per 64^l ticks, so a loan waits in a
+// coarse slot until the wheel nears it, then cascades down to level 0 where it fires. Advancing
+// costs the loans that fire plus the slots that cascade, whatever the number of loans out.
+typedef struct LoanWheel
+{
+    Loan *slots[LOAN_WHEEL_LEVELS][LOAN_WHEEL_SLOTS];
+    uint64_t occupied[LOAN_WHEEL_LEVELS]; // Bit of each non-empty slot
+    uint64_t tick;                        // Last tick handled, in LOAN_TICK seconds since the epoch
+    Loan *overdue;                        // Overdue loans, in the order they fell due
+    Loan *overdue_tail;
+    long count;                           // Loans out, overdue ones included
+    long overdue_count;
+    Loan *free_loans;                     // Nodes of ended loans, reused by the next ones
+    pthread_mutex_t lock;
+} LoanWheel;
+
+// Node of a genre shelf, one per (book, genre) pair
+typedef struct ShelfEntry
+{
+    Book *_Atomic book; // Moved over to the new node by rebuild_levels while searches read it
+    unsigned char level; // forward holds level + 1 links
+    struct ShelfLink
+    {
+        struct ShelfEntry *_Atomic next;
+        _Atomic int span; // Entries skipped by next, counting the one it points to
+    } forward[];
+} ShelfEntry;
+
+// Structure to represent a genre shelf (title-ordered skip list of books)
+typedef struct GenreShelf
+{
+    char *genre;                  // Genre name, interned: books point at this copy
+    int id;                       // Shelves are numbered from 0 in the order they were created
+    ShelfEntry *head;             // Header of the skip list for this genre
+    _Atomic int level;            // Highest level in use on this shelf
+    _Atomic int count;            // Number of books on this shelf
+    pthread_mutex_t top_lock;     // Guards top and top_count
+    Book *top[RECOMMENDATION_CACHE_SIZE]; // Most borrowed books, highest borrow count first
+    int top_count;                // Number of books in top, all of the shelf while below the cache size
+    struct GenreShelf *next;      // Link to the next genre shelf
+} GenreShelf;
+
+// One interned author and the books by them
+typedef struct Author
+{
+    char *name;
+    int id;
+    int count;
+    int capacity;
+    Book **books; // In the order they were added
+} Author;
+
+// Dictionary of authors, looked up by name or id
+typedef struct AuthorIndex
+{
+    Author **slots;        // Open addressing on the name
+    int capacity;          // Power of two, kept at most half full
+    Author **by_id;
+    int count;
+    pthread_rwlock_t lock; // Shared by lookups, exclusive while books are added
+} AuthorIndex;
+
+// One title of the title index, the hash saves following book pointers that cannot match
+typedef struct TitleSlot
+{
+    unsigned int hash;
+    Book *book;
+} TitleSlot;
+
+// One page of the side table that mirrors what whole-catalogue scans read, as contiguous columns.
+// Entry i describes the book with id page * BOOK_ID_PAGE_SIZE + i.
+typedef struct BookColumns
+{
+    _Atomic uint64_t mask[BOOK_ID_PAGE_SIZE]; // Genre bits, BOOK_MASK_AVAILABLE and BOOK_MASK_LISTED
+    _Atomic double score[BOOK_ID_PAGE_SIZE];  // Copy of the book's score, written by whoever writes the score.
+                                              // Scans read it without a lock, so loads and stores are relaxed.
+} BookColumns;
+
+// Exact-title hash index, each title maps to the first book with that title
+typedef struct TitleIndex
+{
+    TitleSlot *slots;      // Open addressing on the title
+    int capacity;          // Power of two, kept at most half full
+    int count;
+    pthread_rwlock_t lock; // Shared by lookups, exclusive while titles are added
+} TitleIndex;
+
+// Books containing one trigram
+typedef struct TrigramPosting
+{
+    uint32_t gram; // Three lowercase characters, 0 marks a free slot
+    int count;
+    int capacity;
+    Book **books;  // In the order they were indexed
+} TrigramPosting;
+
+// Inverted index from the trigrams of titles and authors to books.
+// It is built by the first fuzzy search and kept up to date by every insert after that.
+typedef struct TrigramIndex
+{
+    TrigramPosting *slots; // Open addressing on the trigram
+    int capacity;          // Power of two, kept at most half full
+    int count;             // Distinct trigrams
+    int built;
+    pthread_rwlock_t lock; // Shared by searches, exclusive while books are indexed
+} TrigramIndex;
+
+// Append-only log of the changes made since the base snapshot.
+// Records are buffered, then written and synced in groups by whichever desk needs one first.
+typedef struct Journal
+{
+    int fd;
+    char *path;
+    char *base_path;           // Snapshot the journal is compacted into
+    pthread_mutex_t lock;      // Guards everything below
+    pthread_cond_t synced;     // Signalled whenever a group has been written
+    char *buffer;              // Records appended but not yet handed to the file
+    size_t used;
+    size_t capacity;
+    char *spare;               // Buffer being written by the group leader
+    size_t spare_capacity;
+    uint64_t next_sequence;    // Sequence number of the next record
+    uint64_t durable_sequence; // Last record known to be on disk
+    uint64_t appended_bytes;   // Bytes of every record appended to this journal, on disk or not
+    uint64_t file_start;       // appended_bytes at the first byte of the current file
+    int syncing;               // A group is being written
+    int wait_for_sync;         // Desks wait until their record is on disk
+    int failed;                // A write or sync failed, so nothing more goes after what it left
+    double last_sync;
+    long records;
+    long group_commits;        // fsync calls made for the records
+} Journal;
+
+// A node unlinked from a library, with the reader epoch it was unlinked in
+typedef struct RetiredNode
+{
+    void *node;
+    uint64_t epoch;
+} RetiredNode;
+
+// Nodes unlinked from a library that searches already under way may still be reading
+typedef struct RetiredNodes
+{
+    RetiredNode *nodes;
+    int count;
+    int capacity;
+} RetiredNodes;
+
+// Read section of one thread. A thread inside one holds the epoch it started in, and nodes retired
+// in that epoch or later are not reused until it leaves. Slots are kept after their thread ends.
+typedef struct ReaderSlot
+{
+    _Atomic uint64_t epoch; // 0 outside a read section
+    int depth;              // Read sections the thread has entered and not left, only it touches this
+    int in_use;
+    struct ReaderSlot *next;
+} ReaderSlot;
+
+// Structure to represent the library containing the skip graph.
+// Writers that change its shape hold write_lock; searches and listings take no lock and
+// follow forward pointers, which are only published once the node behind them is complete.
 typedef struct Library
 {
     Book *header;
-    int level;
-    int total_books;
+    _Atomic int level;
+    _Atomic int total_books;
     Book *recommendations[MAX_LEVEL];
+    GenreShelf *_Atomic shelves; // Per-genre index kept up to date by add_book
+    Arena arena;                 // Memory of every book, shelf and string
+    time_t decay_epoch;          // Time at which a score equals the popularity it stands for
+    pthread_mutex_t write_lock;  // Serialises inserts, bulk loads and decay rebasing
+    pthread_rwlock_t decay_lock; // Held shared by borrows, exclusively while scores are rescaled
+    unsigned char *snapshot;     // Mapped snapshot the library was loaded from, holds book strings
+    size_t snapshot_size;
+    uint64_t journal_sequence;   // Last journal record already held by the loaded snapshot
+    Journal *journal;            // Log of every change, NULL when changes are not logged
+    time_t replay_time;          // Time of the journal record being replayed, 0 otherwise
+    TrigramIndex trigrams;       // Fuzzy search over titles and authors
+    AuthorIndex authors;         // Interned authors with their books
+    int genre_count;             // Shelves created, the next shelf's id
+    Book *_Atomic *_Atomic id_pages[BOOK_ID_PAGES]; // Books by id, pages allocated as ids are handed out
+    _Atomic int next_book_id;    // Ids start at 1, scans read it without the write lock
+    TitleIndex titles;
+    struct BookColumns *_Atomic column_pages[BOOK_ID_PAGES]; // Side table by id, laid out like id_pages
+    GenreShelf *mask_shelves[GENRE_MASK_BITS];               // Shelf of each genre bit
+    pthread_mutex_t co_borrow_locks[CO_BORROW_LOCKS];        // Striped by book id
+    _Atomic long co_borrow_lists;                            // Books with a co-borrow list
+    LoanWheel loans;
+    time_t clock_offset;                                     // Seconds the batch clock command moved time on
+    RetiredNodes retired_books;                              // Removed books, recycled by library_reclaim
+    RetiredNodes moved_books;                                // Old nodes of books moved by rebuild_levels, their strings live on
+    RetiredNodes retired_entries;                            // Shelf entries of both
+    Book *free_books[MAX_LEVEL];                             // Nodes ready for reuse by level, linked through forward[0]
+    ShelfEntry *free_entries[MAX_LEVEL];
+    char *free_titles[TITLE_CLASSES];                        // Titles by units, each holding the next in its first bytes
+    char **free_genres[MAX_GENRES + 1];                      // Genre arrays by length, linked through their first slot
+    size_t recycled_bytes;                                   // Bytes waiting on the free lists
+    long removed_books;                                      // Books removed so far,
+    long removed_borrows;                                    // the borrows they had
+    long removed_loans;                                      // and the loans their removal ended
 } Library;
 
+// Conditions of a multi-genre query, tested against book masks
+typedef struct GenreQuery
+{
+    uint64_t all;   // Bits every match has, BOOK_MASK_LISTED included
+    uint64_t none;  // Bits no match has
+    uint64_t any;   // Bits of which a match has at least one, 0 when there is no such condition
+    int any_named;  // Genres named for any, a query whose any genres have no books matches nothing
+    int impossible; // A required genre has no books
+} GenreQuery;
+
+// Kernel that tests count masks against a query and writes the indexes of matches, returns their number
+typedef int (*GenreScan)(const uint64_t *masks, int count, const GenreQuery *query, int *matches);
+
+// Kernel that also requires a score above threshold
+typedef int (*PopularityScan)(const uint64_t *masks, const double *scores, int count, const GenreQuery *query, double threshold, int *matches);
+
+// Kernel that multiplies count scores by one factor
+typedef void (*ScoreScale)(double *scores, int count, double factor);
+
+// One range of a parallel scan, with what the thread that scans it found
+typedef struct ScanPart
+{
+    Library *library;
+    void (*task)(struct ScanPart *part);
+    const void *context;  // Arguments shared by every part
+    Book *first;          // Title ranges: the first book of the range
+    Book *end;            // and the first book after it, NULL for the last range
+    int first_page;       // Id ranges: side table pages [first_page, end_page)
+    int end_page;
+    Book **books;         // Books the part kept, in the order the task defines
+    double *scores;
+    int found;            // Books kept
+    long matched;         // Books that matched, kept or not
+    char *output;         // Formatted output, printed in part order
+    size_t output_size;
+} ScanPart;
+
+// Arguments of a scan over the side table
+typedef struct ColumnScan
+{
+    const GenreQuery *query;
+    GenreScan genre_scan;
+    PopularityScan popularity_scan;
+    ScoreScale scale;
+    double factor;
+    int limit;    // Books each part keeps
+    int id_count; // Ids below this are scanned
+} ColumnScan;
+
+// Position of a walk through the library in title order
+typedef struct BookCursor
+{
+    Library *library;
+    Book *next;              // Next book to look at, NULL past the last one
+    Book *last;              // Last book returned, whose title and id resume the walk
+    const GenreQuery *query; // Books must match it, NULL for every book
+} BookCursor;
+
+// Rows of an export waiting to be written
+typedef struct ExportBuffer
+{
+    FILE *file;
+    char *data; // EXPORT_BUFFER bytes
+    size_t used;
+    int failed;
+} ExportBuffer;
+
+// Books spread over several libraries by a hash of their titles. Every shard has its own locks,
+// indexes and ids, so inserts into different shards never wait for each other, and whole-catalogue
+// queries run on every shard at once and merge what they find. Sharded ids interleave the shards:
+// id i of shard s is known as (i - 1) * count + s + 1.
+typedef struct ShardedLibrary
+{
+    int count;
+    Library *shards[SHARD_MAX];
+} ShardedLibrary;
+
+// One shard's part of an operation run on every shard, with what the shard found
+typedef struct ShardTask
+{
+    Library *library;
+    int shard;
+    void (*run)(struct ShardTask *task);
+    const void *context; // Arguments shared by every shard
+    Book **books;        // Books found, in the order the operation defines
+    int found;           // Books kept
+    long matched;        // Books that matched, kept or not
+    const char *data;    // Loads: the mapped catalogue file
+    size_t data_size;
+    size_t *rows;        // Offsets of the rows whose titles belong to this shard
+    int row_count;
+} ShardTask;
+
+// Genre query of a sharded operation, parsed once per shard as each numbers its genres itself
+typedef struct ShardQuery
+{
+    GenreQuery queries[SHARD_MAX];
+    int limit; // Books each shard keeps
+} ShardQuery;
+
+// Latencies of one operation, as recorded by one thread
+typedef struct OperationMetrics
+{
+    _Atomic uint64_t count;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t buckets[METRIC_BUCKETS]; // Log-linear histogram, see metrics_bucket
+} OperationMetrics;
+
+// Totals of one kind of skip list walk, as recorded by one thread
+typedef struct WalkMetrics
+{
+    _Atomic uint64_t count;
+    _Atomic uint64_t hops;     // Forward pointers followed
+    _Atomic uint64_t compares; // Titles compared, hops plus the comparison that stops each level
+    _Atomic uint64_t max_hops;
+} WalkMetrics;
+
+// Counters one thread writes without sharing cache lines or locks, summed when printed
+typedef struct MetricsBlock
+{
+    OperationMetrics operations[METRIC_OPERATIONS];
+    WalkMetrics walks[WALK_KINDS];
+    _Atomic uint64_t levels[MAX_LEVEL]; // Levels drawn for new books
+    int in_use;                         // Owned by a running thread
+    struct MetricsBlock *next;
+} MetricsBlock;
+
+// Work done by one skip list walk
+typedef struct SkipWalk
+{
+    int hops;
+    int compares;
+} SkipWalk;
+
 // Structure to represent a max-heap for recommendations
 typedef struct MaxHeap
 {
@@ -50,6 +606,12 @@ typedef struct MaxHeap
     int capacity;
 } MaxHeap;
 
+// Arena functions
+void *arena_alloc_aligned(Arena *arena, size_t size, size_t align);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strdup(Arena *arena, const char *text);
+void arena_free(Arena *arena);
+
 // Heap functions for recommendations
 MaxHeap *create_heap(int capacity);
 void insert_heap(MaxHeap *heap, Book *book);
@@ -61,10 +623,247 @@ void heapify_up(MaxHeap *heap, int index);
 Library *create_library();
 void add_book(Library *library, const char *title, const char *author, const char genres[MAX_GENRES][MAX_TITLE_LENGTH], const int genre_count, const int borrow_count);
 Book *search_book_by_genre_then_title(Library *library, const char *title, const char *genre);
+Book *library_seek(Library *library, const char *title);
+int search_books_by_prefix(Library *library, const char *prefix, const char *genre, int available_only, Book **results, int limit);
 void decay_borrow_counts(Library *library);
+double borrow_weight(Library *library, time_t now);
+double book_popularity(Library *library, const Book *book);
 void print_books(Library *library);
 void free_library(Library *library);
 void read_books_from_file(Library *library, const char *filename);
+int parse_book_line(char *line, char *title, char *author, char genres[MAX_GENRES][MAX_TITLE_LENGTH], int *genre_count, int *borrow_count);
+int random_level();
+
+// Bulk loading functions
+double monotonic_seconds();
+int random_level_r(unsigned int *seed);
+void arena_adopt(Arena *arena, Arena *other);
+void library_relink(Library *library, Book **books, int count);
+void shelf_relink(GenreShelf *shelf, ShelfEntry **entries, int count);
+int bulk_load_books_from_file(Library *library, const char *filename, FILE *report);
+
+// Genre shelf functions
+GenreShelf *find_genre_shelf(Library *library, const char *genre);
+GenreShelf *get_genre_shelf(Library *library, const char *genre);
+void shelf_insert(Library *library, GenreShelf *shelf, Book *book);
+ShelfEntry *shelf_seek(GenreShelf *shelf, const char *title);
+void shelf_update_top(GenreShelf *shelf, Book *book);
+void shelf_rebuild_top(GenreShelf *shelf);
+int shelf_top_books(Library *library, const char *genre, Book **top);
+
+// Position functions, ranks start at 1
+int book_rank(Library *library, const char *title);
+Book *book_at_rank(Library *library, int rank);
+int shelf_rank(GenreShelf *shelf, const char *title);
+ShelfEntry *shelf_entry_at_rank(GenreShelf *shelf, int rank);
+void print_shelf_page(Library *library, const char *genre, int first, int last);
+
+// Circulation functions
+int borrow_book(Library *library, Book *book, User *user);
+int return_book(Library *library, Book *book);
+
+// Concurrency stress test
+int run_stress_test(int max_threads, int book_count, double seconds, const char *journal_path);
+
+// Batch mode functions
+char *split_argument(char *arguments);
+int batch_execute(Library *library, const char *command, char *arguments);
+int run_batch(Library *library, ShardedLibrary *sharded, FILE *input);
+
+// Benchmark functions
+int run_benchmark(long *sizes, int size_count);
+
+// Password hashing functions
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t size);
+void sha256_final(Sha256 *ctx, unsigned char digest[USER_HASH_LENGTH]);
+void hash_password(const unsigned char *salt, const char *password, unsigned char *digest);
+
+// User store functions
+unsigned int hash_string(const char *text);
+User *find_user(UserStore *store, const char *username);
+User *store_user(UserStore *store, const char *username, const unsigned char *salt, const unsigned char *password_hash, int user_type);
+User *create_user(UserStore *store, const char *username, const char *password, int user_type);
+int verify_password(const User *user, const char *password);
+int load_patrons_from_file(UserStore *store, const char *filename);
+int save_patrons(UserStore *store, const char *filename);
+void free_user_store(UserStore *store);
+void register_user();
+User *login_user();
+
+// Snapshot functions
+uint64_t snapshot_checksum(const unsigned char *data, size_t size);
+int snapshot_string_valid(const unsigned char *data, size_t size, uint64_t offset, size_t limit);
+int snapshot_records_valid(const unsigned char *data, size_t size);
+int snapshot_valid(const unsigned char *data, size_t size);
+int save_snapshot(Library *library, UserStore *users, const char *filename);
+int load_snapshot(Library *library, UserStore *users, const char *filename);
+
+// Journal functions
+time_t library_now(Library *library);
+Journal *journal_open(const char *path, const char *base_path, uint64_t next_sequence);
+uint64_t journal_log_add(Journal *journal, time_t when, const Book *book);
+uint64_t journal_log_circulation(Journal *journal, int type, time_t when, const Book *book, const User *user);
+uint64_t journal_log_decay(Journal *journal, time_t when);
+int journal_commit(Journal *journal, uint64_t sequence);
+int journal_flush(Journal *journal);
+void journal_truncate(Journal *journal, uint64_t cut_bytes);
+void journal_maybe_compact(Library *library, UserStore *users);
+void journal_close(Journal *journal);
+int journal_replay(Library *library, const char *path, uint64_t after, uint64_t *last_sequence);
+Journal *journal_start(Library *library, const char *path, const char *base_path);
+
+// Fuzzy search functions
+int text_trigrams(const char *text, uint32_t *grams, int count, int max);
+int book_trigrams(const char *title, const char *author, uint32_t *grams);
+void trigram_index_book(TrigramIndex *index, Book *book);
+void trigram_add_books(Library *library, Book **books, int count);
+void trigram_build(Library *library);
+void trigram_free(TrigramIndex *index);
+int fuzzy_search_books(Library *library, const char *query, const char *genre, Book **results, double *scores, int limit);
+
+// Author functions
+Author *find_author(AuthorIndex *index, const char *name);
+Author *intern_author(Library *library, const char *name, int copy);
+void author_add_books(Library *library, Book **books, int count, int copy);
+void author_index_free(AuthorIndex *index);
+int books_by_author(Library *library, const char *name, int by_popularity, Book **results, int limit);
+void print_books_by_author(Library *library, const char *name, int by_popularity);
+
+// Book id and exact title functions
+void book_id_store(Library *library, Book *book);
+Book *find_book_by_id(Library *library, int id);
+int parse_book_id(const char *text);
+int borrow_book_by_id(Library *library, int id, User *user);
+int return_book_by_id(Library *library, int id);
+void title_index_reserve(Library *library, int count);
+void title_index_set(Library *library, Book *book);
+Book *find_book_by_title(Library *library, const char *title);
+void index_new_books(Library *library, Book **books, int count);
+void book_index_free(Library *library);
+
+// Genre mask functions
+uint64_t shelf_mask(const GenreShelf *shelf);
+int book_on_shelf(const Book *book, const GenreShelf *shelf);
+GenreShelf *book_genre_shelf(Library *library, const Book *book, const char *genre);
+BookColumns *book_columns(Library *library, int id);
+void book_mask_sync(Library *library, Book *book);
+void genre_query_init(GenreQuery *query, int available_only);
+int genre_query_add(Library *library, GenreQuery *query, const char *genre, char kind);
+int genre_match(uint64_t mask, const GenreQuery *query);
+int genre_scan_scalar(const uint64_t *masks, int count, const GenreQuery *query, int *matches);
+int popularity_scan_scalar(const uint64_t *masks, const double *scores, int count, const GenreQuery *query, double threshold, int *matches);
+void score_scale_scalar(double *scores, int count, double factor);
+int simd_level(const char **name);
+GenreScan genre_scan_best(const char **name);
+PopularityScan popularity_scan_best(const char **name);
+ScoreScale score_scale_best();
+int query_books_by_genres(Library *library, const GenreQuery *query, GenreScan scan, Book **results, int limit);
+int parse_genre_query(Library *library, char *spec, GenreQuery *query);
+void print_books_by_genres(Library *library, char *spec);
+int top_books_by_genres(Library *library, const GenreQuery *query, PopularityScan scan, Book **results, int limit);
+void print_top_books(Library *library, int limit, char *spec);
+void rescale_scores(Library *library, double factor);
+
+// Parallel scan functions
+int scan_thread_count(long items);
+int scan_partition_titles(Library *library, ScanPart *parts, int part_count);
+int scan_partition_pages(ScanPart *parts, int part_count, int id_count);
+void scan_run(Library *library, ScanPart *parts, int part_count, void (*task)(ScanPart *part), const void *context);
+
+// Borrow history and co-borrow functions
+void user_history_add(User *user, int id);
+int user_history_recent(const User *user, int *ids, int limit);
+void co_borrow_add(Library *library, Book *book, int other);
+void co_borrow_record(Library *library, User *user, Book *book);
+int co_borrowed_books(Library *library, const Book *book, Book **results, int *counts, int limit);
+int recommend_for_user(Library *library, const User *user, Book **results, int *scores, int limit);
+void print_co_borrowed_books(Library *library, const Book *book);
+void print_recommendations_for_user(Library *library, const User *user);
+
+// Cursor and export functions
+void book_cursor_open(Library *library, BookCursor *cursor, const char *after, int after_id, const GenreQuery *query);
+int book_cursor_next(BookCursor *cursor, Book **books, int limit);
+void export_flush(ExportBuffer *out);
+char *export_text(char *at, const char *text);
+char *export_json_text(char *at, const char *text);
+char *export_number(char *at, long value);
+void export_book(ExportBuffer *out, const Book *book, int id, int format);
+long export_books(BookCursor *cursor, FILE *file, int format, long limit);
+void export_catalogue(Library *library, const char *filename, int format, char *spec);
+void print_books_page(Library *library, int count, char *key, char *spec);
+
+// Sharded library functions
+ShardedLibrary *create_sharded_library(int count);
+void free_sharded_library(ShardedLibrary *sharded);
+int shard_of_title(const ShardedLibrary *sharded, const char *title);
+int sharded_book_id(const ShardedLibrary *sharded, int shard, const Book *book);
+Book *sharded_find_by_id(ShardedLibrary *sharded, int id, int *shard);
+int sharded_add_book(ShardedLibrary *sharded, const char *title, const char *author, const char genres[MAX_GENRES][MAX_TITLE_LENGTH], int genre_count, int borrow_count);
+void shard_run(ShardedLibrary *sharded, ShardTask *tasks, void (*run)(ShardTask *task), const void *context);
+void sharded_load_books(ShardedLibrary *sharded, const char *filename);
+int sharded_search_by_prefix(ShardedLibrary *sharded, const char *prefix, const char *genre, Book **results, int *shards, int limit);
+Book *sharded_search_book_by_genre_then_title(ShardedLibrary *sharded, const char *title, const char *genre, int *shard);
+int sharded_parse_genre_query(ShardedLibrary *sharded, const char *spec, GenreQuery *queries);
+void sharded_print_books_by_genres(ShardedLibrary *sharded, const char *spec);
+int sharded_merge_top(ShardedLibrary *sharded, Book *found[][POPULARITY_LIMIT], const int *counts, Book **results, int *shards, double *popularity, int limit);
+int sharded_top_books(ShardedLibrary *sharded, int limit, const char *spec, Book **results, int *shards, double *popularity);
+void sharded_print_top_books(ShardedLibrary *sharded, int limit, const char *spec);
+void sharded_recommend_books(ShardedLibrary *sharded, const char *genre);
+long sharded_export_books(ShardedLibrary *sharded, BookCursor *cursors, FILE *file, int format, long limit, Book **last, int *last_shard, int *more);
+int sharded_cursors_open(ShardedLibrary *sharded, BookCursor *cursors, GenreQuery *queries, char *key, const char *spec);
+void sharded_export_catalogue(ShardedLibrary *sharded, const char *filename, int format, const char *spec);
+void sharded_print_books_page(ShardedLibrary *sharded, int count, char *key, const char *spec);
+int sharded_batch_execute(ShardedLibrary *sharded, const char *command, char *arguments);
+int run_shard_test(int max_shards, int book_count, double seconds);
+
+// Loan functions
+void format_date(time_t when, char *text, size_t size);
+Loan **loan_list(LoanWheel *wheel, const Loan *loan);
+void loan_unlink(LoanWheel *wheel, Loan *loan);
+void loan_wheel_insert(LoanWheel *wheel, Loan *loan);
+void loan_start(Library *library, Book *book, User *user, time_t due);
+Book *loan_end(Library *library, Book *book);
+void loan_remind(FILE *out, const Loan *loan, const char *what);
+int loan_expire(LoanWheel *wheel, Loan *loans, uint64_t target, FILE *reminders);
+int loan_advance(Library *library, time_t now, FILE *reminders);
+void print_overdue_report(Library *library);
+void loan_wheel_free(LoanWheel *wheel);
+void loan_release(LoanWheel *wheel, Book *book);
+
+// Removal and recycling functions
+ReaderSlot *reader_slot();
+void reader_enter();
+void reader_exit();
+uint64_t reader_oldest();
+void retire_node(RetiredNodes *retired, void *node);
+Book *library_book_node(Library *library, int level);
+ShelfEntry *library_shelf_entry(Library *library, int level);
+char *library_title_copy(Library *library, const char *title, unsigned char *units);
+char **library_genre_array(Library *library, int count);
+void library_unlink(Library *library, Book *book);
+ShelfEntry *shelf_unlink(GenreShelf *shelf, Book *book);
+void title_index_remove(Library *library, Book *book);
+void author_remove_book(Library *library, Book *book);
+void trigram_remove_book(Library *library, Book *book);
+int remove_book(Library *library, Book *book);
+int remove_book_by_id(Library *library, int id);
+void library_reclaim(Library *library);
+int balanced_level(int rank);
+Book *book_current(Library *library, Book *book);
+Book *book_live(Library *library, Book *book);
+void rebuild_levels(Library *library, FILE *report);
+
+// Metrics functions
+uint64_t metrics_clock();
+int walk_compare(SkipWalk *walk, const char *title, const char *sought);
+void metrics_latency(int operation, uint64_t nanoseconds);
+void metrics_walk(int kind, const SkipWalk *walk);
+void metrics_level(int level);
+int metrics_bucket(uint64_t nanoseconds);
+uint64_t metrics_bucket_top(int bucket);
+uint64_t metrics_percentile(const uint64_t *buckets, uint64_t count, uint64_t max, double share);
+void print_metrics(Library *library, UserStore *users);
 
 // Heap functions
 MaxHeap *create_heap(int capacity)
@@ -84,12 +883,12 @@ void insert_heap(MaxHeap *heap, Book *book)
         heapify_up(heap, heap->size);
         heap->size++;
     }
-    else if (book->borrow_count > heap->books[0]->borrow_count)
+    else if (book->score > heap->books[0]->score)
     {
         heap->books[0] = book;
         heapify_down(heap, 0);
     }
-    else if (book->borrow_count == heap->books[0]->borrow_count)
+    else if (book->score == heap->books[0]->score)
     {
         // Add to the end if there is a tie
         heap->books[heap->size] = book;
@@ -113,7 +912,7 @@ void heapify_up(MaxHeap *heap, int index)
     while (index > 0)
     {
         int parent = (index - 1) / 2;
-        if (heap->books[parent]->borrow_count >= heap->books[index]->borrow_count)
+        if (heap->books[parent]->score >= heap->books[index]->score)
             break;
         Book *temp = heap->books[parent];
         heap->books[parent] = heap->books[index];
@@ -129,11 +928,11 @@ void heapify_down(MaxHeap *heap, int index)
         int left = 2 * index + 1;
         int right = left + 1;
         int largest = left;
-        if (right < heap->size && heap->books[right]->borrow_count > heap->books[left]->borrow_count)
+        if (right < heap->size && heap->books[right]->score > heap->books[left]->score)
         {
             largest = right;
         }
-        if (heap->books[index]->borrow_count >= heap->books[largest]->borrow_count)
+        if (heap->books[index]->score >= heap->books[largest]->score)
             break;
         Book *temp = heap->books[index];
         heap->books[index] = heap->books[largest];
@@ -142,336 +941,8290 @@ void heapify_down(MaxHeap *heap, int index)
     }
 }
 
-// Modify the recommend_books function to handle ties
+// Function to recommend the most borrowed books of a genre, keeping ties together
 void recommend_books(Library *library, const char *genre)
 {
-    MaxHeap *heap = create_heap(RECOMMENDATION_COUNT);
+    // The shelf keeps its top books up to date, so no scan is needed here
+    METRIC_START(timer);
+    Book *top[RECOMMENDATION_CACHE_SIZE];
+    int top_count = shelf_top_books(library, genre, top);
 
-    printf("Gathering books in genre '%s'...\n", genre); // Debugging: Print genre
+    printf("\nTop Recommended Books in Genre '%s':\n", genre);
+    if (top_count == 0)
+    {
+        printf("No recommendations available.\n");
+    }
 
-    for (Book *current = library->header->forward[0]; current != NULL; current = current->forward[0])
+    double last_score = -1;
+    for (int i = 0; i < top_count; i++)
     {
-        // Check if the book contains the specified genre
-        int genre_found = 0;
-        for (int j = 0; j < current->gen_count; j++)
+        Book *recommended = top[i];
+        // Past the last recommendation only books tied with it are shown
+        if (i >= RECOMMENDATION_COUNT && recommended->score != last_score)
         {
-            if (strcmp(current->genre[j], genre) == 0)
-            {
-                genre_found = 1;
-                break;
-            }
+            break;
+        }
+        last_score = recommended->score;
+        printf("Title: %s, Author: %s, Borrow Count: %d, Popularity: %.1f\n",
+               recommended->title, recommended->author, recommended->borrow_count, book_popularity(library, recommended));
+    }
+    METRIC_STOP(METRIC_RECOMMEND, timer);
+}
+
+// Function to carve size bytes with the given alignment out of the arena
+void *arena_alloc_aligned(Arena *arena, size_t size, size_t align)
+{
+    ArenaBlock *block = arena->blocks;
+    size_t offset = block ? (block->used + align - 1) & ~(align - 1) : 0;
+    if (block == NULL || offset + size > block->size)
+    {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + block_size);
+        block->used = 0;
+        block->size = block_size;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->allocated += sizeof(ArenaBlock) + block_size;
+        offset = 0;
+    }
+    block->used = offset + size;
+    return block->data + offset;
+}
+
+// Function to allocate pointer-aligned memory from the arena
+void *arena_alloc(Arena *arena, size_t size)
+{
+    return arena_alloc_aligned(arena, size, sizeof(void *));
+}
+
+// Function to copy a string into the arena, using exactly its length
+char *arena_strdup(Arena *arena, const char *text)
+{
+    size_t length = strlen(text) + 1;
+    char *copy = (char *)arena_alloc_aligned(arena, length, 1);
+    memcpy(copy, text, length);
+    return copy;
+}
+
+// Function to release every block of an arena
+void arena_free(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->allocated = 0;
+}
+
+// Function to create a new library
+Library *create_library()
+{
+    Library *library = (Library *)malloc(sizeof(Library));
+    library->arena.blocks = NULL;
+    library->arena.allocated = 0;
+    library->header = (Book *)arena_alloc(&library->arena, sizeof(Book) + MAX_LEVEL * sizeof(struct BookLink));
+    library->header->title = arena_strdup(&library->arena, "");
+    library->header->author = library->header->title;
+    library->header->genre = NULL;
+    library->header->borrow_count = 0;
+    library->header->score = 0;
+    library->header->gen_count = 0;
+    library->header->co_borrows = NULL;
+    library->header->loan = NULL;
+    library->header->status = STATUS_AVAILABLE;
+    library->header->level = MAX_LEVEL - 1;
+    library->header->title_units = 0;
+    library->level = 0;
+    library->total_books = 0;
+    library->shelves = NULL;
+    library->decay_epoch = time(NULL);
+    library->snapshot = NULL;
+    library->snapshot_size = 0;
+    library->journal_sequence = 0;
+    library->journal = NULL;
+    library->replay_time = 0;
+    library->trigrams.slots = NULL;
+    library->trigrams.capacity = 0;
+    library->trigrams.count = 0;
+    library->trigrams.built = 0;
+    pthread_rwlock_init(&library->trigrams.lock, NULL);
+    library->authors.slots = NULL;
+    library->authors.capacity = 0;
+    library->authors.by_id = NULL;
+    library->authors.count = 0;
+    pthread_rwlock_init(&library->authors.lock, NULL);
+    library->genre_count = 0;
+    for (int page = 0; page < BOOK_ID_PAGES; page++)
+    {
+        library->id_pages[page] = NULL;
+        library->column_pages[page] = NULL;
+    }
+    library->next_book_id = 1;
+    library->titles.slots = NULL;
+    library->titles.capacity = 0;
+    library->titles.count = 0;
+    pthread_rwlock_init(&library->titles.lock, NULL);
+    pthread_mutex_init(&library->write_lock, NULL);
+    pthread_rwlock_init(&library->decay_lock, NULL);
+    for (int i = 0; i < CO_BORROW_LOCKS; i++)
+    {
+        pthread_mutex_init(&library->co_borrow_locks[i], NULL);
+    }
+    library->co_borrow_lists = 0;
+    memset(&library->loans, 0, sizeof(LoanWheel));
+    library->loans.tick = time(NULL) / LOAN_TICK;
+    pthread_mutex_init(&library->loans.lock, NULL);
+    library->clock_offset = 0;
+    memset(&library->retired_books, 0, sizeof(RetiredNodes));
+    memset(&library->moved_books, 0, sizeof(RetiredNodes));
+    memset(&library->retired_entries, 0, sizeof(RetiredNodes));
+    memset(library->free_books, 0, sizeof(library->free_books));
+    memset(library->free_entries, 0, sizeof(library->free_entries));
+    memset(library->free_titles, 0, sizeof(library->free_titles));
+    memset(library->free_genres, 0, sizeof(library->free_genres));
+    library->recycled_bytes = 0;
+    library->removed_books = 0;
+    library->removed_borrows = 0;
+    library->removed_loans = 0;
+
+    for (int i = 0; i < MAX_LEVEL; i++)
+    {
+        library->header->forward[i].next = NULL;
+        library->header->forward[i].span = 0;
+    }
+    return library;
+}
+
+// Function to draw a random skip list level
+int random_level()
+{
+    int level = 0;
+    while ((rand() % 2) && (level < MAX_LEVEL - 1))
+    {
+        level++;
+    }
+    return level;
+}
+
+// Function to find the shelf of a genre, NULL if no book has that genre
+GenreShelf *find_genre_shelf(Library *library, const char *genre)
+{
+    for (GenreShelf *shelf = library->shelves; shelf != NULL; shelf = shelf->next)
+    {
+        if (strcmp(shelf->genre, genre) == 0)
+        {
+            return shelf;
+        }
+    }
+    return NULL;
+}
+
+// Function to find the shelf of a genre, creating an empty one if needed
+GenreShelf *get_genre_shelf(Library *library, const char *genre)
+{
+    GenreShelf *shelf = find_genre_shelf(library, genre);
+    if (shelf)
+    {
+        return shelf;
+    }
+
+    shelf = (GenreShelf *)arena_alloc(&library->arena, sizeof(GenreShelf));
+    shelf->genre = arena_strdup(&library->arena, genre);
+    shelf->head = (ShelfEntry *)arena_alloc(&library->arena, sizeof(ShelfEntry) + MAX_LEVEL * sizeof(struct ShelfLink));
+    shelf->head->book = NULL;
+    shelf->head->level = MAX_LEVEL - 1;
+    for (int i = 0; i < MAX_LEVEL; i++)
+    {
+        shelf->head->forward[i].next = NULL;
+        shelf->head->forward[i].span = 0;
+    }
+    shelf->id = library->genre_count++;
+    if (shelf->id < GENRE_MASK_BITS)
+    {
+        library->mask_shelves[shelf->id] = shelf;
+    }
+    shelf->level = 0;
+    shelf->count = 0;
+    shelf->top_count = 0;
+    pthread_mutex_init(&shelf->top_lock, NULL);
+    shelf->next = library->shelves;
+    library->shelves = shelf; // Readers see the shelf only once it is complete
+    return shelf;
+}
+
+// Function to return the first entry on a shelf whose title is >= title
+ShelfEntry *shelf_seek(GenreShelf *shelf, const char *title)
+{
+    SkipWalk walk = {0, 0};
+    ShelfEntry *current = shelf->head;
+    ShelfEntry *next = NULL;
+    for (int i = shelf->level; i >= 0; i--)
+    {
+        while ((next = current->forward[i].next) != NULL && walk_compare(&walk, next->book->title, title) < 0)
+        {
+            current = next;
+            walk.hops++;
         }
+    }
+    METRIC_WALK(WALK_SHELF_SEEK, &walk);
+    return next;
+}
+
+// Function to place a book on a shelf, in the same order as the main skip list
+void shelf_insert(Library *library, GenreShelf *shelf, Book *book)
+{
+    ShelfEntry *update[MAX_LEVEL];
+    int rank[MAX_LEVEL];
 
-        // Debugging: Print each book's genre and borrow count
-        if (genre_found)
+    // Find the predecessor at every level and its position on the shelf
+    SkipWalk walk = {0, 0};
+    ShelfEntry *current = shelf->head;
+    for (int i = shelf->level; i >= 0; i--)
+    {
+        rank[i] = (i == shelf->level) ? 0 : rank[i + 1];
+        while (current->forward[i].next != NULL && walk_compare(&walk, current->forward[i].next->book->title, book->title) < 0)
         {
-            printf("Found Book: %s (Borrow Count: %d)\n", current->title, current->borrow_count);
-            insert_heap(heap, current); // Add to heap only if it matches the genre
+            rank[i] += current->forward[i].span;
+            current = current->forward[i].next;
+            walk.hops++;
         }
+        update[i] = current;
     }
+    METRIC_WALK(WALK_SHELF_INSERT, &walk);
 
-    // Display the top recommendations
-    printf("\nTop Recommended Books in Genre '%s':\n", genre);
-    if (heap->size == 0)
+    // Entries only carry the links of their own level
+    int level = random_level();
+    ShelfEntry *entry = library_shelf_entry(library, level);
+    entry->book = book;
+    entry->level = level;
+    if (level > shelf->level)
     {
-        printf("No recommendations available.\n");
+        for (int i = shelf->level + 1; i <= level; i++)
+        {
+            rank[i] = 0;
+            update[i] = shelf->head;
+            update[i]->forward[i].span = shelf->count;
+        }
+        shelf->level = level;
+    }
+
+    for (int i = 0; i <= level; i++)
+    {
+        entry->forward[i].next = update[i]->forward[i].next;
+        update[i]->forward[i].next = entry;
+        entry->forward[i].span = update[i]->forward[i].span - (rank[0] - rank[i]);
+        update[i]->forward[i].span = (rank[0] - rank[i]) + 1;
+    }
+    for (int i = level + 1; i <= shelf->level; i++)
+    {
+        update[i]->forward[i].span++;
+    }
+    shelf->count++;
+
+    pthread_mutex_lock(&shelf->top_lock);
+    shelf_update_top(shelf, book);
+    pthread_mutex_unlock(&shelf->top_lock);
+}
+
+// Function to find the position of a title on a shelf, -1 if absent
+int shelf_rank(GenreShelf *shelf, const char *title)
+{
+    SkipWalk walk = {0, 0};
+    ShelfEntry *current = shelf->head;
+    ShelfEntry *next = NULL;
+    int rank = 0;
+    for (int i = shelf->level; i >= 0; i--)
+    {
+        while ((next = current->forward[i].next) != NULL && walk_compare(&walk, next->book->title, title) < 0)
+        {
+            rank += current->forward[i].span;
+            current = next;
+            walk.hops++;
+        }
+    }
+    METRIC_WALK(WALK_SHELF_RANK, &walk);
+
+    if (next && strcmp(next->book->title, title) == 0)
+    {
+        return rank + 1;
+    }
+    return -1;
+}
+
+// Function to find the entry at a position on a shelf, NULL if out of range
+ShelfEntry *shelf_entry_at_rank(GenreShelf *shelf, int rank)
+{
+    if (rank < 1 || rank > shelf->count)
+    {
+        return NULL;
+    }
+
+    ShelfEntry *current = shelf->head;
+    ShelfEntry *next;
+    int traversed = 0;
+    for (int i = shelf->level; i >= 0; i--)
+    {
+        while ((next = current->forward[i].next) != NULL && traversed + current->forward[i].span <= rank)
+        {
+            traversed += current->forward[i].span;
+            current = next;
+        }
+        if (traversed == rank)
+        {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+// Function to move a book into place in a shelf's top list after its score grew,
+// the caller holds the shelf's top_lock
+void shelf_update_top(GenreShelf *shelf, Book *book)
+{
+    // A borrow that raced with the book's removal may only get here after it
+    if (book->status == STATUS_REMOVED)
+    {
+        return;
+    }
+    int index = 0;
+    while (index < shelf->top_count && shelf->top[index] != book)
+    {
+        index++;
+    }
+
+    if (index == shelf->top_count)
+    {
+        // Books outside the list never score higher than its last entry
+        if (shelf->top_count < RECOMMENDATION_CACHE_SIZE)
+        {
+            shelf->top_count++;
+        }
+        else if (book->score > shelf->top[index - 1]->score)
+        {
+            index--;
+        }
+        else
+        {
+            return;
+        }
+    }
+
+    while (index > 0 && shelf->top[index - 1]->score < book->score)
+    {
+        shelf->top[index] = shelf->top[index - 1];
+        index--;
+    }
+    shelf->top[index] = book;
+}
+
+// Function to copy a genre's top list, returns how many books were copied
+int shelf_top_books(Library *library, const char *genre, Book **top)
+{
+    GenreShelf *shelf = find_genre_shelf(library, genre);
+    if (shelf == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&shelf->top_lock);
+    int top_count = shelf->top_count;
+    memcpy(top, shelf->top, top_count * sizeof(Book *));
+    pthread_mutex_unlock(&shelf->top_lock);
+    return top_count;
+}
+
+// Function to refill a shelf's top list from scratch
+void shelf_rebuild_top(GenreShelf *shelf)
+{
+    MaxHeap *heap = create_heap(shelf->count > 0 ? shelf->count : 1);
+    for (ShelfEntry *entry = shelf->head->forward[0].next; entry != NULL; entry = entry->forward[0].next)
+    {
+        insert_heap(heap, entry->book);
+    }
+
+    shelf->top_count = 0;
+    while (shelf->top_count < RECOMMENDATION_CACHE_SIZE && heap->size > 0)
+    {
+        shelf->top[shelf->top_count++] = extract_max(heap);
+    }
+
+    free(heap->books);
+    free(heap);
+}
+
+// Function to borrow an available book, returns 1 on success.
+// Only one of several desks borrowing the same book at once wins the status swap.
+// A borrow by a patron, user not NULL, also goes into their history and the co-borrow lists.
+int borrow_book(Library *library, Book *book, User *user)
+{
+    if (book == NULL)
+    {
+        return 0;
+    }
+
+    // The whole borrow, its journal record included, happens under the decay lock so a
+    // snapshot never sees it half done
+    METRIC_START(timer);
+    pthread_rwlock_rdlock(&library->decay_lock);
+    // The desk may hold a node that a rebuild moved the book off, which the decay lock now keeps in place
+    book = book_live(library, book);
+    const char *expected = STATUS_AVAILABLE;
+    if (book == NULL || !atomic_compare_exchange_strong(&book->status, &expected, STATUS_BORROWED))
+    {
+        pthread_rwlock_unlock(&library->decay_lock);
+        METRIC_STOP(METRIC_BORROW, timer);
+        return 0;
+    }
+    time_t now = library_now(library);
+    book->last_borrowed = now;
+    book->borrow_count++;
+    double score = book->score;
+    while (!atomic_compare_exchange_weak(&book->score, &score, score + borrow_weight(library, now)))
+    {
+    }
+    // Only the desk that won the status swap writes the score, so the copy cannot go stale
+    BookColumns *columns = book_columns(library, book->id);
+    if (columns)
+    {
+        atomic_store_explicit(&columns->score[book->id % BOOK_ID_PAGE_SIZE], book->score, memory_order_relaxed);
+    }
+    if (user != NULL)
+    {
+        co_borrow_record(library, user, book);
+    }
+    loan_start(library, book, user, now + LOAN_PERIOD);
+    uint64_t sequence = journal_log_circulation(library->journal, JOURNAL_BORROW, now, book, user);
+    pthread_rwlock_unlock(&library->decay_lock);
+    book_mask_sync(library, book);
+
+    for (int i = 0; i < book->gen_count; i++)
+    {
+        GenreShelf *shelf = book_genre_shelf(library, book, book->genre[i]);
+        if (shelf)
+        {
+            pthread_mutex_lock(&shelf->top_lock);
+            shelf_update_top(shelf, book);
+            pthread_mutex_unlock(&shelf->top_lock);
+        }
+    }
+    journal_commit(library->journal, sequence);
+    METRIC_STOP(METRIC_BORROW, timer);
+    return 1;
+}
+
+// Function to return a borrowed book, returns 1 on success
+int return_book(Library *library, Book *book)
+{
+    METRIC_START(timer);
+    Book *returned = book != NULL ? loan_end(library, book) : NULL;
+    if (returned)
+    {
+        book_mask_sync(library, returned);
+        journal_commit(library->journal, journal_log_circulation(library->journal, JOURNAL_RETURN, library_now(library), returned, NULL));
+    }
+    METRIC_STOP(METRIC_RETURN, timer);
+    return returned != NULL;
+}
+
+// SHA-256 round constants
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Function to hash one 64-byte block into the state
+void sha256_transform(uint32_t state[8], const unsigned char block[64])
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// Function to start a SHA-256 computation
+void sha256_init(Sha256 *ctx)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->block_used = 0;
+}
+
+// Function to feed bytes into a SHA-256 computation
+void sha256_update(Sha256 *ctx, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    ctx->length += size;
+    while (size > 0)
+    {
+        size_t take = 64 - ctx->block_used;
+        if (take > size)
+        {
+            take = size;
+        }
+        memcpy(ctx->block + ctx->block_used, bytes, take);
+        ctx->block_used += take;
+        bytes += take;
+        size -= take;
+        if (ctx->block_used == 64)
+        {
+            sha256_transform(ctx->state, ctx->block);
+            ctx->block_used = 0;
+        }
+    }
+}
+
+// Function to pad the message and write out the digest
+void sha256_final(Sha256 *ctx, unsigned char digest[USER_HASH_LENGTH])
+{
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->block_used != 56)
+    {
+        sha256_update(ctx, &pad, 1);
+    }
+    unsigned char length[8];
+    for (int i = 0; i < 8; i++)
+    {
+        length[i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, length, 8);
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+// Function to derive the stored hash of a password: SHA-256 of salt and password,
+// then USER_HASH_ROUNDS - 1 further rounds over the previous digest and the salt
+void hash_password(const unsigned char *salt, const char *password, unsigned char *digest)
+{
+    Sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, salt, USER_SALT_LENGTH);
+    sha256_update(&ctx, password, strlen(password));
+    sha256_final(&ctx, digest);
+    for (int round = 1; round < USER_HASH_ROUNDS; round++)
+    {
+        sha256_init(&ctx);
+        sha256_update(&ctx, digest, USER_HASH_LENGTH);
+        sha256_update(&ctx, salt, USER_SALT_LENGTH);
+        sha256_final(&ctx, digest);
+    }
+}
+
+// Hash table of users (both staff and visitors)
+UserStore user_store = {NULL, 0, 0, {NULL, 0}};
+
+// Function to hash a username or other name (FNV-1a)
+unsigned int hash_string(const char *text)
+{
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++)
+    {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+// Function to find a user by name, returns NULL if there is none
+User *find_user(UserStore *store, const char *username)
+{
+    if (store->capacity == 0)
+    {
+        return NULL;
+    }
+    unsigned int mask = store->capacity - 1;
+    for (unsigned int slot = hash_string(username) & mask; store->slots[slot] != NULL; slot = (slot + 1) & mask)
+    {
+        if (strcmp(store->slots[slot]->username, username) == 0)
+        {
+            return store->slots[slot];
+        }
+    }
+    return NULL;
+}
+
+// Function to double the table, rehashing every user into the new slots
+void user_store_grow(UserStore *store)
+{
+    int capacity = store->capacity ? store->capacity * 2 : USER_STORE_MIN_CAPACITY;
+    User **slots = (User **)calloc(capacity, sizeof(User *));
+    unsigned int mask = capacity - 1;
+    for (int i = 0; i < store->capacity; i++)
+    {
+        User *user = store->slots[i];
+        if (user)
+        {
+            unsigned int slot = hash_string(user->username) & mask;
+            while (slots[slot] != NULL)
+            {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = user;
+        }
+    }
+    free(store->slots);
+    store->slots = slots;
+    store->capacity = capacity;
+}
+
+// Function to add a user whose password is already hashed, returns NULL if the name is taken
+User *store_user(UserStore *store, const char *username, const unsigned char *salt, const unsigned char *password_hash, int user_type)
+{
+    if ((store->count + 1) * 2 > store->capacity)
+    {
+        user_store_grow(store);
+    }
+    unsigned int mask = store->capacity - 1;
+    unsigned int slot = hash_string(username) & mask;
+    while (store->slots[slot] != NULL)
+    {
+        if (strcmp(store->slots[slot]->username, username) == 0)
+        {
+            return NULL;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    User *user = (User *)arena_alloc(&store->arena, sizeof(User));
+    user->username = arena_strdup(&store->arena, username);
+    memcpy(user->salt, salt, USER_SALT_LENGTH);
+    memcpy(user->password_hash, password_hash, USER_HASH_LENGTH);
+    user->user_type = user_type;
+    user->history = NULL;
+    user->history_count = 0;
+    store->slots[slot] = user;
+    store->count++;
+    return user;
+}
+
+// Function to fill a buffer with random salt bytes
+void random_salt(unsigned char *salt)
+{
+    if (getentropy(salt, USER_SALT_LENGTH) != 0)
+    {
+        for (int i = 0; i < USER_SALT_LENGTH; i++)
+        {
+            salt[i] = (unsigned char)rand();
+        }
+    }
+}
+
+// Function to add a user with a fresh salt, returns NULL if the name is taken
+User *create_user(UserStore *store, const char *username, const char *password, int user_type)
+{
+    if (find_user(store, username) != NULL)
+    {
+        return NULL;
+    }
+    unsigned char salt[USER_SALT_LENGTH], password_hash[USER_HASH_LENGTH];
+    random_salt(salt);
+    hash_password(salt, password, password_hash);
+    return store_user(store, username, salt, password_hash, user_type);
+}
+
+// Function to check a password against a user's stored hash, returns 1 if it matches
+int verify_password(const User *user, const char *password)
+{
+    unsigned char password_hash[USER_HASH_LENGTH];
+    hash_password(user->salt, password, password_hash);
+
+    // Compare every byte so the time taken does not depend on where they differ
+    unsigned char difference = 0;
+    for (int i = 0; i < USER_HASH_LENGTH; i++)
+    {
+        difference |= password_hash[i] ^ user->password_hash[i];
+    }
+    return difference == 0;
+}
+
+// Function to load users saved by save_patrons, returns the number loaded or -1 if the file is damaged
+int load_patrons_binary(UserStore *store, FILE *file)
+{
+    unsigned char header[16];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        memcmp(header, USER_FILE_MAGIC, 8) != 0)
+    {
+        return -1;
+    }
+    uint32_t version = header[8] | (header[9] << 8) | (header[10] << 16) | ((uint32_t)header[11] << 24);
+    uint32_t count = header[12] | (header[13] << 8) | (header[14] << 16) | ((uint32_t)header[15] << 24);
+    if (version != USER_FILE_VERSION)
+    {
+        return -1;
+    }
+
+    int loaded = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // Record: name length, name, salt, hash, user type
+        char username[MAX_USER_NAME];
+        unsigned char salt[USER_SALT_LENGTH], password_hash[USER_HASH_LENGTH];
+        int length = fgetc(file);
+        if (length == EOF || length >= MAX_USER_NAME ||
+            fread(username, 1, length, file) != (size_t)length ||
+            fread(salt, 1, USER_SALT_LENGTH, file) != USER_SALT_LENGTH ||
+            fread(password_hash, 1, USER_HASH_LENGTH, file) != USER_HASH_LENGTH)
+        {
+            return -1;
+        }
+        int user_type = fgetc(file);
+        if (user_type != 1 && user_type != 2)
+        {
+            return -1;
+        }
+        username[length] = '\0';
+        if (store_user(store, username, salt, password_hash, user_type))
+        {
+            loaded++;
+        }
+    }
+    return loaded;
+}
+
+// Function to load patrons from a file written by save_patrons, or from a text file with
+// one "username,password,type" line per patron. Returns the number of users added, or -1.
+int load_patrons_from_file(UserStore *store, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        printf("Error opening file.\n");
+        return -1;
+    }
+
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, USER_FILE_MAGIC, 8) == 0)
+    {
+        rewind(file);
+        int loaded = load_patrons_binary(store, file);
+        fclose(file);
+        if (loaded < 0)
+        {
+            printf("Patron file is damaged.\n");
+        }
+        else
+        {
+            printf("Loaded %d patrons.\n", loaded);
+        }
+        return loaded;
+    }
+    rewind(file);
+
+    char line[MAX_USER_NAME + MAX_PASSWORD + 16];
+    int loaded = 0, duplicates = 0, malformed = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+        char *saveptr;
+        char *username = strtok_r(line, ",", &saveptr);
+        char *password = strtok_r(NULL, ",", &saveptr);
+        char *type = strtok_r(NULL, ",", &saveptr);
+        int user_type = type ? atoi(type) : 0;
+        if (username == NULL || password == NULL || strlen(username) >= MAX_USER_NAME ||
+            (user_type != 1 && user_type != 2))
+        {
+            malformed++;
+            continue;
+        }
+        if (create_user(store, username, password, user_type))
+        {
+            loaded++;
+        }
+        else
+        {
+            duplicates++;
+        }
+    }
+    fclose(file);
+    printf("Loaded %d patrons (%d duplicate names, %d malformed lines).\n", loaded, duplicates, malformed);
+    return loaded;
+}
+
+// Function to write every user in a compact binary form, returns the number written or -1.
+// The file is written beside the target and renamed over it, so a crash never leaves it half written.
+int save_patrons(UserStore *store, const char *filename)
+{
+    char temporary[PATH_MAX];
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", filename) >= (int)sizeof(temporary))
+    {
+        return -1;
+    }
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL)
+    {
+        printf("Error opening file.\n");
+        return -1;
+    }
+
+    unsigned char header[16];
+    memcpy(header, USER_FILE_MAGIC, 8);
+    for (int i = 0; i < 4; i++)
+    {
+        header[8 + i] = (unsigned char)(USER_FILE_VERSION >> (8 * i));
+        header[12 + i] = (unsigned char)((uint32_t)store->count >> (8 * i));
+    }
+    fwrite(header, 1, sizeof(header), file);
+    for (int i = 0; i < store->capacity; i++)
+    {
+        User *user = store->slots[i];
+        if (user)
+        {
+            fputc((int)strlen(user->username), file);
+            fwrite(user->username, 1, strlen(user->username), file);
+            fwrite(user->salt, 1, USER_SALT_LENGTH, file);
+            fwrite(user->password_hash, 1, USER_HASH_LENGTH, file);
+            fputc(user->user_type, file);
+        }
+    }
+
+    int failed = fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed |= fclose(file) != 0;
+    if (failed || rename(temporary, filename) != 0)
+    {
+        remove(temporary);
+        printf("Error writing file.\n");
+        return -1;
+    }
+    printf("Saved %d patrons.\n", store->count);
+    return store->count;
+}
+
+// Function to release every user
+void free_user_store(UserStore *store)
+{
+    for (int i = 0; i < store->capacity; i++)
+    {
+        if (store->slots[i])
+        {
+            free((void *)store->slots[i]->history);
+        }
+    }
+    free(store->slots);
+    arena_free(&store->arena);
+    store->slots = NULL;
+    store->capacity = 0;
+    store->count = 0;
+}
+
+// Function to register a new user
+void register_user() {
+    char username[MAX_USER_NAME], password[MAX_PASSWORD], type[16];
+
+    printf("Enter username: ");
+    fgets(username, MAX_USER_NAME, stdin);
+    username[strcspn(username, "\n")] = '\0';  // Remove the newline
+    if (find_user(&user_store, username) != NULL) {
+        printf("Username already taken.\n");
+        return;
+    }
+
+    printf("Enter password: ");
+    fgets(password, MAX_PASSWORD, stdin);
+    password[strcspn(password, "\n")] = '\0';  // Remove the newline
+
+    printf("Registering as:\n");
+    printf("1. Visitor\n");
+    printf("2. Staff\n");
+    printf("Enter your choice: ");
+    if (fgets(type, sizeof(type), stdin) == NULL) {
+        type[0] = '\0';
+    }
+    type[strcspn(type, "\n")] = '\0';  // Remove the newline
+
+    // Only visitors (1) and staff (2) exist, as in patron files
+    if (strcmp(type, "1") != 0 && strcmp(type, "2") != 0) {
+        printf("Invalid choice, registration cancelled.\n");
+        return;
+    }
+    create_user(&user_store, username, password, atoi(type));
+    printf("Registration successful!\n");
+}
+
+// Function to login a user
+User* login_user() {
+    char username[MAX_USER_NAME], password[MAX_PASSWORD];
+    
+    printf("Enter username: ");
+    fgets(username, MAX_USER_NAME, stdin);
+    username[strcspn(username, "\n")] = '\0';  // Remove the newline
+
+    printf("Enter password: ");
+    fgets(password, MAX_PASSWORD, stdin);
+    password[strcspn(password, "\n")] = '\0';  // Remove the newline
+
+    // Look the user up by name and check the password against the stored hash
+    User *user = find_user(&user_store, username);
+    if (user != NULL && verify_password(user, password)) {
+        printf("Login successful!\n");
+        return user;
+    }
+    
+    printf("Invalid username or password.\n");
+    return NULL;  // Return NULL if login failed
+}
+
+// Function to add a new book to the library
+void add_book(Library *library, const char *title, const char *author, const char genres[MAX_GENRES][MAX_TITLE_LENGTH], int genre_count, int borrow_count)
+{
+    METRIC_START(timer);
+    pthread_mutex_lock(&library->write_lock);
+
+    // Find the predecessor at every level and its position in the library
+    Book *update[MAX_LEVEL];
+    int rank[MAX_LEVEL];
+    SkipWalk walk = {0, 0};
+    Book *current = library->header;
+    for (int i = library->level; i >= 0; i--)
+    {
+        rank[i] = (i == library->level) ? 0 : rank[i + 1];
+        while (current->forward[i].next != NULL && walk_compare(&walk, current->forward[i].next->title, title) < 0)
+        {
+            rank[i] += current->forward[i].span;
+            current = current->forward[i].next;
+            walk.hops++;
+        }
+        update[i] = current;
+    }
+    METRIC_WALK(WALK_ADD_BOOK, &walk);
+
+    // Books only carry the links of their own level, and take over the node and strings of a
+    // removed book when one fits
+    int level = random_level();
+    METRIC_LEVEL(level);
+    Book *new_book = library_book_node(library, level);
+    new_book->title = library_title_copy(library, title, &new_book->title_units);
+    new_book->author = (char *)author;
+    author_add_books(library, &new_book, 1, 1);
+    new_book->genre = library_genre_array(library, genre_count);
+    new_book->genre_mask = 0;
+    new_book->co_borrows = NULL;
+    new_book->loan = NULL;
+    for (int i = 0; i < genre_count; i++)
+    {
+        GenreShelf *shelf = get_genre_shelf(library, genres[i]);
+        new_book->genre[i] = shelf->genre;
+        new_book->genre_mask |= shelf_mask(shelf);
+    }
+    time_t now = library_now(library);
+    new_book->borrow_count = borrow_count;
+    new_book->score = borrow_count * borrow_weight(library, now);
+    new_book->gen_count = genre_count;
+    new_book->last_borrowed = 0;
+    new_book->status = STATUS_AVAILABLE;
+    new_book->level = level;
+    new_book->id = library->next_book_id++; // Searches reach the node once it is linked, so it needs its own id by then
+    if (level > library->level)
+    {
+        for (int i = library->level + 1; i <= level; i++)
+        {
+            rank[i] = 0;
+            update[i] = library->header;
+            update[i]->forward[i].span = library->total_books;
+        }
+        library->level = level;
+    }
+
+    // Each level is linked bottom-up, with the book's own link set before it becomes reachable
+    for (int i = 0; i <= level; i++)
+    {
+        new_book->forward[i].next = update[i]->forward[i].next;
+        update[i]->forward[i].next = new_book;
+        new_book->forward[i].span = update[i]->forward[i].span - (rank[0] - rank[i]);
+        update[i]->forward[i].span = (rank[0] - rank[i]) + 1;
+    }
+    for (int i = level + 1; i <= library->level; i++)
+    {
+        update[i]->forward[i].span++;
+    }
+
+    // Keep the genre shelves in step with the main skip list
+    for (int i = 0; i < genre_count; i++)
+    {
+        shelf_insert(library, get_genre_shelf(library, new_book->genre[i]), new_book);
+    }
+
+    // Ids and exact titles only lead to linked books
+    book_id_store(library, new_book);
+    title_index_set(library, new_book);
+    trigram_add_books(library, &new_book, 1);
+    library->total_books++;
+    uint64_t sequence = journal_log_add(library->journal, now, new_book);
+    pthread_mutex_unlock(&library->write_lock);
+    journal_commit(library->journal, sequence);
+    METRIC_STOP(METRIC_ADD_BOOK, timer);
+}
+
+// Function to parse one "title,author,genre...,borrow count" line, returns 0 if it has no title or author
+int parse_book_line(char *line, char *title, char *author, char genres[MAX_GENRES][MAX_TITLE_LENGTH], int *genre_count, int *borrow_count)
+{
+    char *saved;
+    *genre_count = 0;
+    *borrow_count = 0;
+
+    // Remove newline character from the line
+    line[strcspn(line, "\r\n")] = '\0';
+
+    // Parse title
+    char *token = strtok_r(line, ",", &saved);
+    if (token == NULL)
+        return 0;
+    strncpy(title, token, MAX_TITLE_LENGTH - 1);
+    title[MAX_TITLE_LENGTH - 1] = '\0';
+
+    // Parse author
+    token = strtok_r(NULL, ",", &saved);
+    if (token == NULL)
+        return 0;
+    strncpy(author, token, MAX_AUTHOR_LENGTH - 1);
+    author[MAX_AUTHOR_LENGTH - 1] = '\0';
+
+    // Parse genres
+    while ((token = strtok_r(NULL, ",", &saved)) != NULL)
+    {
+        // Check if this token is the borrow count (last token)
+        if (sscanf(token, "%d", borrow_count) == 1)
+        {
+            break;
+        }
+        // Otherwise, add the genre to the array
+        if (*genre_count < MAX_GENRES)
+        {
+            strncpy(genres[*genre_count], token, MAX_TITLE_LENGTH - 1);
+            genres[*genre_count][MAX_TITLE_LENGTH - 1] = '\0';
+            (*genre_count)++;
+        }
+    }
+    return 1;
+}
+
+void read_books_from_file(Library *library, const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        printf("Error opening file.\n");
+        return;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        char title[MAX_TITLE_LENGTH];
+        char author[MAX_AUTHOR_LENGTH];
+        char genres[MAX_GENRES][MAX_TITLE_LENGTH];
+        int borrow_count;
+        int genre_count;
+
+        if (!parse_book_line(line, title, author, genres, &genre_count, &borrow_count))
+            continue;
+
+        // Add the book to the library
+        add_book(library, title, author, genres, genre_count, borrow_count);
+    }
+
+    fclose(file);
+    printf("Books loaded successfully from file.\n");
+}
+
+// State of one bulk-load parser thread
+typedef struct BulkChunk
+{
+    const char *start; // First byte of the chunk, always at the start of a line
+    const char *end;   // One past the last byte of the chunk
+    Arena arena;       // Books parsed by this thread
+    Book **books;
+    int count;
+    int capacity;
+    int malformed;
+    char **genres;     // Genre names seen by this thread, shared by its books, open addressing
+    int genre_total;
+    int genre_slots;
+    char *authors[BULK_AUTHOR_SLOTS];    // Author names seen by this thread, open addressing
+    int author_total;
+    unsigned int seed; // Level draws without touching rand()
+    double weight;     // Score of one borrow at load time
+} BulkChunk;
+
+// Per-shelf state while the bulk loader relinks the shelves
+typedef struct ShelfBuild
+{
+    GenreShelf *shelf;
+    ShelfEntry **entries; // New entries in title order
+    int count;
+    int capacity;
+} ShelfBuild;
+
+// Function to return a monotonic clock reading in seconds
+double monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Function to draw a random skip list level from a private seed
+int random_level_r(unsigned int *seed)
+{
+    int level = 0;
+    while ((rand_r(seed) % 2) && (level < MAX_LEVEL - 1))
+    {
+        level++;
+    }
+    return level;
+}
+
+// Function to hand the blocks of one arena over to another
+void arena_adopt(Arena *arena, Arena *other)
+{
+    // The receiving arena keeps allocating from its own current block
+    ArenaBlock **tail = &arena->blocks;
+    while (*tail != NULL)
+    {
+        tail = &(*tail)->next;
+    }
+    *tail = other->blocks;
+    arena->allocated += other->allocated;
+    other->blocks = NULL;
+    other->allocated = 0;
+}
+
+// Function to find a genre name already seen by a parser thread, copying it on first sight.
+// The table doubles once it is half full, so any number of genres can be told apart.
+char *bulk_chunk_genre(BulkChunk *chunk, const char *name, size_t length)
+{
+    if ((chunk->genre_total + 1) * 2 > chunk->genre_slots)
+    {
+        int slots = chunk->genre_slots ? 2 * chunk->genre_slots : BULK_GENRE_SLOTS;
+        char **genres = (char **)calloc(slots, sizeof(char *));
+        for (int i = 0; i < chunk->genre_slots; i++)
+        {
+            if (chunk->genres[i] != NULL)
+            {
+                unsigned int slot = hash_string(chunk->genres[i]) & (slots - 1);
+                while (genres[slot] != NULL)
+                {
+                    slot = (slot + 1) & (slots - 1);
+                }
+                genres[slot] = chunk->genres[i];
+            }
+        }
+        free(chunk->genres);
+        chunk->genres = genres;
+        chunk->genre_slots = slots;
+    }
+
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    unsigned int slot = hash & (chunk->genre_slots - 1);
+    while (chunk->genres[slot] != NULL)
+    {
+        if (strncmp(chunk->genres[slot], name, length) == 0 && chunk->genres[slot][length] == '\0')
+        {
+            return chunk->genres[slot];
+        }
+        slot = (slot + 1) & (chunk->genre_slots - 1);
+    }
+
+    char *copy = (char *)arena_alloc_aligned(&chunk->arena, length + 1, 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    chunk->genres[slot] = copy;
+    chunk->genre_total++;
+    return copy;
+}
+
+// Function to find an author name already seen by a parser thread, copying it on first sight.
+// Once the thread's table is half full, further new names are copied without being shared.
+char *bulk_chunk_author(BulkChunk *chunk, const char *name, size_t length)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    unsigned int slot = hash & (BULK_AUTHOR_SLOTS - 1);
+    while (chunk->authors[slot] != NULL)
+    {
+        if (strncmp(chunk->authors[slot], name, length) == 0 && chunk->authors[slot][length] == '\0')
+        {
+            return chunk->authors[slot];
+        }
+        slot = (slot + 1) & (BULK_AUTHOR_SLOTS - 1);
+    }
+
+    char *copy = (char *)arena_alloc_aligned(&chunk->arena, length + 1, 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    if (chunk->author_total * 2 < BULK_AUTHOR_SLOTS)
+    {
+        chunk->authors[slot] = copy;
+        chunk->author_total++;
+    }
+    return copy;
+}
+
+// Function to parse one catalogue row into a book, returns NULL if the row is malformed
+Book *bulk_parse_row(BulkChunk *chunk, const char *line, const char *end)
+{
+    const char *fields[MAX_GENRES + 3];
+    size_t lengths[MAX_GENRES + 3];
+    int field_count = 0;
+
+    // Split on commas, dropping empty fields like strtok did
+    const char *field = line;
+    while (field <= end && field_count < MAX_GENRES + 3)
+    {
+        const char *comma = memchr(field, ',', end - field);
+        const char *field_end = comma ? comma : end;
+        if (field_end > field)
+        {
+            fields[field_count] = field;
+            lengths[field_count] = field_end - field;
+            field_count++;
+        }
+        if (comma == NULL)
+        {
+            break;
+        }
+        field = comma + 1;
+    }
+
+    if (field_count < 3 || lengths[0] >= MAX_TITLE_LENGTH || lengths[1] >= MAX_AUTHOR_LENGTH)
+    {
+        return NULL;
+    }
+
+    // Genres run up to the first field that reads as a number, which is the borrow count
+    int genre_count = 0;
+    int borrow_count = 0;
+    int has_count = 0;
+    for (int i = 2; i < field_count; i++)
+    {
+        const char *digits = fields[i];
+        const char *field_end = fields[i] + lengths[i];
+        while (digits < field_end && (*digits == ' ' || *digits == '\t'))
+        {
+            digits++;
+        }
+        int negative = 0;
+        if (digits < field_end && (*digits == '-' || *digits == '+'))
+        {
+            negative = (*digits == '-');
+            digits++;
+        }
+        if (digits < field_end && *digits >= '0' && *digits <= '9')
+        {
+            while (digits < field_end && *digits >= '0' && *digits <= '9')
+            {
+                // A count past INT_MAX makes the row malformed, rather than overflowing
+                if (borrow_count > (INT_MAX - (*digits - '0')) / 10)
+                {
+                    return NULL;
+                }
+                borrow_count = borrow_count * 10 + (*digits - '0');
+                digits++;
+            }
+            if (negative)
+            {
+                borrow_count = -borrow_count;
+            }
+            has_count = 1;
+            break;
+        }
+        if (genre_count == MAX_GENRES || lengths[i] >= MAX_TITLE_LENGTH)
+        {
+            return NULL;
+        }
+        fields[2 + genre_count] = fields[i];
+        lengths[2 + genre_count] = lengths[i];
+        genre_count++;
+    }
+    if (!has_count)
+    {
+        return NULL;
+    }
+
+    int level = random_level_r(&chunk->seed);
+    Book *book = (Book *)arena_alloc(&chunk->arena, sizeof(Book) + (level + 1) * sizeof(struct BookLink));
+    book->genre = (char **)arena_alloc(&chunk->arena, genre_count * sizeof(char *));
+    book->genre_mask = 0; // Set once the genres are matched to shelves
+    book->co_borrows = NULL;
+    book->loan = NULL;
+    for (int i = 0; i < genre_count; i++)
+    {
+        book->genre[i] = bulk_chunk_genre(chunk, fields[2 + i], lengths[2 + i]);
+    }
+    book->title = (char *)arena_alloc_aligned(&chunk->arena, lengths[0] + 1, 1);
+    memcpy(book->title, fields[0], lengths[0]);
+    book->title[lengths[0]] = '\0';
+    book->title_units = 0;
+    book->author = bulk_chunk_author(chunk, fields[1], lengths[1]);
+    book->gen_count = genre_count;
+    book->borrow_count = borrow_count;
+    book->score = borrow_count * chunk->weight;
+    book->last_borrowed = 0;
+    book->status = STATUS_AVAILABLE;
+    book->level = level;
+    for (int i = 0; i <= level; i++)
+    {
+        book->forward[i].next = NULL;
+        book->forward[i].span = 0;
+    }
+    return book;
+}
+
+// Thread body that parses every row of one chunk
+void *bulk_parse_chunk(void *arg)
+{
+    BulkChunk *chunk = (BulkChunk *)arg;
+    const char *line = chunk->start;
+    while (line < chunk->end)
+    {
+        const char *newline = memchr(line, '\n', chunk->end - line);
+        const char *line_end = newline ? newline : chunk->end;
+        const char *next_line = newline ? newline + 1 : chunk->end;
+        if (line_end > line && line_end[-1] == '\r')
+        {
+            line_end--;
+        }
+
+        if (line_end > line)
+        {
+            Book *book = bulk_parse_row(chunk, line, line_end);
+            if (book == NULL)
+            {
+                chunk->malformed++;
+            }
+            else
+            {
+                if (chunk->count == chunk->capacity)
+                {
+                    chunk->capacity = chunk->capacity ? 2 * chunk->capacity : 1024;
+                    chunk->books = (Book **)realloc(chunk->books, chunk->capacity * sizeof(Book *));
+                }
+                chunk->books[chunk->count++] = book;
+            }
+        }
+        line = next_line;
+    }
+    return NULL;
+}
+
+// Comparison of two books by title for qsort
+int compare_book_titles(const void *a, const void *b)
+{
+    return strcmp((*(Book *const *)a)->title, (*(Book *const *)b)->title);
+}
+
+// Comparison of two parsed rows by title, then by their place in the file, which bulk loads
+// keep in the id until the real ids are given out
+int compare_book_rows(const void *a, const void *b)
+{
+    const Book *x = *(Book *const *)a, *y = *(Book *const *)b;
+    int order = strcmp(x->title, y->title);
+    if (order != 0)
+    {
+        return order;
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+// Function to relink every level of the library over books already in title order, in O(n)
+void library_relink(Library *library, Book **books, int count)
+{
+    Book *last[MAX_LEVEL];
+    int last_rank[MAX_LEVEL];
+    int top = 0;
+    for (int i = 0; i < MAX_LEVEL; i++)
+    {
+        last[i] = library->header;
+        last_rank[i] = 0;
+    }
+
+    for (int rank = 1; rank <= count; rank++)
+    {
+        Book *book = books[rank - 1];
+        for (int i = 0; i <= book->level; i++)
+        {
+            last[i]->forward[i].next = book;
+            last[i]->forward[i].span = rank - last_rank[i];
+            last[i] = book;
+            last_rank[i] = rank;
+        }
+        if (book->level > top)
+        {
+            top = book->level;
+        }
+    }
+
+    for (int i = 0; i < MAX_LEVEL; i++)
+    {
+        last[i]->forward[i].next = NULL;
+        last[i]->forward[i].span = count - last_rank[i];
+    }
+    library->level = top;
+    library->total_books = count;
+}
+
+// Function to relink every level of a shelf over entries already in title order, in O(n)
+void shelf_relink(GenreShelf *shelf, ShelfEntry **entries, int count)
+{
+    ShelfEntry *last[MAX_LEVEL];
+    int last_rank[MAX_LEVEL];
+    int top = 0;
+    for (int i = 0; i < MAX_LEVEL; i++)
+    {
+        last[i] = shelf->head;
+        last_rank[i] = 0;
+    }
+
+    for (int rank = 1; rank <= count; rank++)
+    {
+        ShelfEntry *entry = entries[rank - 1];
+        for (int i = 0; i <= entry->level; i++)
+        {
+            last[i]->forward[i].next = entry;
+            last[i]->forward[i].span = rank - last_rank[i];
+            last[i] = entry;
+            last_rank[i] = rank;
+        }
+        if (entry->level > top)
+        {
+            top = entry->level;
+        }
+    }
+
+    for (int i = 0; i < MAX_LEVEL; i++)
+    {
+        last[i]->forward[i].next = NULL;
+        last[i]->forward[i].span = count - last_rank[i];
+    }
+    shelf->level = top;
+    shelf->count = count;
+}
+
+// Function to merge the books of a shelf with new entries and relink it
+void shelf_merge_build(ShelfBuild *build)
+{
+    GenreShelf *shelf = build->shelf;
+    ShelfEntry **merged = (ShelfEntry **)malloc((shelf->count + build->count + 1) * sizeof(ShelfEntry *));
+    ShelfEntry *old_entry = shelf->head->forward[0].next;
+    int merged_count = 0;
+    int j = 0;
+
+    // New entries go before existing ones with the same title, as shelf_insert does
+    while (old_entry != NULL || j < build->count)
+    {
+        if (j < build->count && (old_entry == NULL || strcmp(build->entries[j]->book->title, old_entry->book->title) <= 0))
+        {
+            merged[merged_count++] = build->entries[j++];
+        }
+        else
+        {
+            merged[merged_count++] = old_entry;
+            old_entry = old_entry->forward[0].next;
+        }
+    }
+
+    // New entries lead on before they are published, like new books in bulk_load_books_from_file
+    ShelfEntry *successor[MAX_LEVEL];
+    int successor_rank[MAX_LEVEL];
+    for (int i = 0; i < MAX_LEVEL; i++)
+    {
+        successor[i] = NULL;
+        successor_rank[i] = merged_count;
+    }
+    for (int rank = merged_count, k = build->count - 1; rank >= 1; rank--)
+    {
+        ShelfEntry *entry = merged[rank - 1];
+        int added = k >= 0 && entry == build->entries[k];
+        k -= added;
+        for (int i = 0; i <= entry->level; i++)
+        {
+            if (added)
+            {
+                entry->forward[i].next = successor[i];
+                entry->forward[i].span = successor_rank[i] - rank;
+            }
+            successor[i] = entry;
+            successor_rank[i] = rank;
+        }
+    }
+    shelf_relink(shelf, merged, merged_count);
+    pthread_mutex_lock(&shelf->top_lock);
+    for (j = 0; j < build->count; j++)
+    {
+        shelf_update_top(shelf, build->entries[j]->book);
+    }
+    pthread_mutex_unlock(&shelf->top_lock);
+    free(merged);
+}
+
+// Function to load a large catalogue by mapping the file, parsing it on several threads
+// and building every skip list level in one linear pass. Returns the number of books loaded,
+// and prints how the load went to report unless it is NULL.
+int bulk_load_books_from_file(Library *library, const char *filename, FILE *report)
+{
+    double started = monotonic_seconds();
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Error opening file.\n");
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        if (report)
+        {
+            fprintf(report, "Loaded 0 books from %s.\n", filename);
+        }
+        return 0;
+    }
+    size_t size = info.st_size;
+    const char *data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        printf("Error mapping file.\n");
+        return 0;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    // One chunk per core, each starting at a line boundary
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = (int)(size / BULK_MIN_CHUNK_BYTES) + 1;
+    if (thread_count > cores)
+    {
+        thread_count = cores > 0 ? (int)cores : 1;
+    }
+    if (thread_count > BULK_MAX_THREADS)
+    {
+        thread_count = BULK_MAX_THREADS;
+    }
+    BulkChunk *chunks = (BulkChunk *)calloc(thread_count, sizeof(BulkChunk));
+    const char *cursor = data;
+    const char *end = data + size;
+    for (int t = 0; t < thread_count; t++)
+    {
+        const char *target = (t == thread_count - 1) ? end : data + size / thread_count * (t + 1);
+        if (target < cursor)
+        {
+            target = cursor;
+        }
+        if (target < end)
+        {
+            const char *newline = memchr(target, '\n', end - target);
+            target = newline ? newline + 1 : end;
+        }
+        chunks[t].start = cursor;
+        chunks[t].end = target;
+        chunks[t].seed = (unsigned int)rand();
+        chunks[t].weight = borrow_weight(library, library_now(library));
+        cursor = target;
+    }
+
+    pthread_t threads[BULK_MAX_THREADS];
+    for (int t = 1; t < thread_count; t++)
+    {
+        pthread_create(&threads[t], NULL, bulk_parse_chunk, &chunks[t]);
+    }
+    bulk_parse_chunk(&chunks[0]);
+    for (int t = 1; t < thread_count; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    int new_count = 0;
+    int malformed = 0;
+    int genre_names = 0;
+    for (int t = 0; t < thread_count; t++)
+    {
+        new_count += chunks[t].count;
+        malformed += chunks[t].malformed;
+        genre_names += chunks[t].genre_total;
+    }
+    Book **new_books = (Book **)malloc((new_count + 1) * sizeof(Book *));
+    int filled = 0;
+    for (int t = 0; t < thread_count; t++)
+    {
+        memcpy(new_books + filled, chunks[t].books, chunks[t].count * sizeof(Book *));
+        filled += chunks[t].count;
+    }
+    // Copies of a title stay in file order
+    for (int b = 0; b < new_count; b++)
+    {
+        new_books[b]->id = b;
+    }
+    qsort(new_books, new_count, sizeof(Book *), compare_book_rows);
+
+    // Readers keep searching while the shelves and levels are relinked. They may miss new books
+    // that are still being linked, but never books that were already there. New books are complete,
+    // id and shelf names included, before any link leads to them.
+    pthread_mutex_lock(&library->write_lock);
+    for (int b = 0; b < new_count; b++)
+    {
+        new_books[b]->id = library->next_book_id++;
+    }
+    author_add_books(library, new_books, new_count, 1);
+
+    // Give the new books their shelf entries, visiting them in title order
+    ShelfBuild *builds = NULL;
+    int build_count = 0;
+    long seen_slots = 16;
+    while (seen_slots < genre_names * 2L)
+    {
+        seen_slots *= 2;
+    }
+    const char **seen_names = (const char **)calloc(seen_slots, sizeof(char *));
+    int *seen_builds = (int *)malloc(seen_slots * sizeof(int));
+    for (int b = 0; b < new_count; b++)
+    {
+        Book *book = new_books[b];
+        for (int i = 0; i < book->gen_count; i++)
+        {
+            // Each thread shares one copy of a genre name, so names are matched by pointer first
+            long slot = (long)(((uintptr_t)book->genre[i] >> 4) * 2654435761u) & (seen_slots - 1);
+            while (seen_names[slot] != NULL && seen_names[slot] != book->genre[i])
+            {
+                slot = (slot + 1) & (seen_slots - 1);
+            }
+            int index;
+            if (seen_names[slot] != NULL)
+            {
+                index = seen_builds[slot];
+            }
+            else
+            {
+                GenreShelf *shelf = get_genre_shelf(library, book->genre[i]);
+                for (index = 0; index < build_count && builds[index].shelf != shelf; index++)
+                {
+                }
+                if (index == build_count)
+                {
+                    builds = (ShelfBuild *)realloc(builds, (build_count + 1) * sizeof(ShelfBuild));
+                    builds[index].shelf = shelf;
+                    builds[index].entries = NULL;
+                    builds[index].count = 0;
+                    builds[index].capacity = 0;
+                    build_count++;
+                }
+                seen_names[slot] = book->genre[i];
+                seen_builds[slot] = index;
+            }
+
+            ShelfBuild *build = &builds[index];
+            book->genre[i] = build->shelf->genre;
+            book->genre_mask |= shelf_mask(build->shelf);
+            int level = random_level();
+            ShelfEntry *entry = (ShelfEntry *)arena_alloc(&library->arena, sizeof(ShelfEntry) + (level + 1) * sizeof(struct ShelfLink));
+            entry->book = book;
+            entry->level = level;
+            for (int k = 0; k <= level; k++)
+            {
+                entry->forward[k].next = NULL;
+                entry->forward[k].span = 0;
+            }
+            if (build->count == build->capacity)
+            {
+                build->capacity = build->capacity ? 2 * build->capacity : 256;
+                build->entries = (ShelfEntry **)realloc(build->entries, build->capacity * sizeof(ShelfEntry *));
+            }
+            build->entries[build->count++] = entry;
+        }
+    }
+    for (int k = 0; k < build_count; k++)
+    {
+        shelf_merge_build(&builds[k]);
+        free(builds[k].entries);
+    }
+    free(seen_names);
+    free(seen_builds);
+    // Merge with the books already in the library, new books first among equal titles
+    Book **books = (Book **)malloc((library->total_books + new_count + 1) * sizeof(Book *));
+    Book *old_book = library->header->forward[0].next;
+    int count = 0;
+    int j = 0;
+    while (old_book != NULL || j < new_count)
+    {
+        if (j < new_count && (old_book == NULL || strcmp(new_books[j]->title, old_book->title) <= 0))
+        {
+            books[count++] = new_books[j++];
+        }
+        else
+        {
+            books[count++] = old_book;
+            old_book = old_book->forward[0].next;
+        }
+    }
+
+    // Each new book leads to the next book of its level in the merged order before the relink
+    // publishes it, as rebuild_levels does, so a search that reaches it carries on past it
+    Book *successor[MAX_LEVEL];
+    int successor_rank[MAX_LEVEL];
+    for (int i = 0; i < MAX_LEVEL; i++)
+    {
+        successor[i] = NULL;
+        successor_rank[i] = count;
+    }
+    for (int rank = count, k = new_count - 1; rank >= 1; rank--)
+    {
+        Book *book = books[rank - 1];
+        int added = k >= 0 && book == new_books[k];
+        k -= added;
+        for (int i = 0; i <= book->level; i++)
+        {
+            if (added)
+            {
+                book->forward[i].next = successor[i];
+                book->forward[i].span = successor_rank[i] - rank;
+            }
+            successor[i] = book;
+            successor_rank[i] = rank;
+        }
+    }
+    library_relink(library, books, count);
+
+    index_new_books(library, new_books, new_count);
+    trigram_add_books(library, new_books, new_count);
+    for (int t = 0; t < thread_count; t++)
+    {
+        arena_adopt(&library->arena, &chunks[t].arena);
+        free(chunks[t].books);
+        free(chunks[t].genres);
+    }
+    pthread_mutex_unlock(&library->write_lock);
+
+    free(builds);
+    free(books);
+    free(new_books);
+    free(chunks);
+    munmap((void *)data, size);
+    close(fd);
+
+    double elapsed = monotonic_seconds() - started;
+    if (report)
+    {
+        fprintf(report, "Loaded %d books from %s in %.3f s (%.0f rows/sec, %d threads), %d malformed rows skipped.\n",
+                new_count, filename, elapsed, elapsed > 0 ? (new_count + malformed) / elapsed : 0.0, thread_count, malformed);
+    }
+
+    // Bulk-loaded books are not logged one by one, a fresh base snapshot makes them durable instead
+    if (library->journal && library->journal->base_path && new_count > 0)
+    {
+        save_snapshot(library, &user_store, library->journal->base_path);
+    }    return new_count;
+}
+// Function to read the library clock, which follows the journal while it is replayed and the
+// batch clock command otherwise
+time_t library_now(Library *library)
+{
+    return library->replay_time ? library->replay_time : time(NULL) + library->clock_offset;
+}
+
+// Function to write a whole buffer to a file, returns 1 on success
+int write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0)
+        {
+            return 0;
+        }
+        data += written;
+        size -= written;
+    }
+    return 1;
+}
+
+// Function to open a journal for appending, records get sequence numbers from next_sequence on
+Journal *journal_open(const char *path, const char *base_path, uint64_t next_sequence)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        printf("Error opening journal.\n");
+        return NULL;
+    }
+    struct stat info;
+    fstat(fd, &info);
+
+    Journal *journal = (Journal *)calloc(1, sizeof(Journal));
+    journal->fd = fd;
+    journal->path = strdup(path);
+    journal->base_path = base_path ? strdup(base_path) : NULL;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->synced, NULL);
+    journal->next_sequence = next_sequence;
+    journal->durable_sequence = next_sequence - 1;
+    journal->appended_bytes = info.st_size; // The file's existing records count as appended
+    journal->last_sync = monotonic_seconds();
+    journal->wait_for_sync = 1;
+    return journal;
+}
+
+// Function to append one record to the journal buffer, returns its sequence number.
+// Record layout: size, checksum, sequence, time, type, payload. Size counts the bytes after
+// itself and the checksum covers the bytes after the checksum.
+uint64_t journal_append(Journal *journal, int type, time_t when, const char *payload, size_t payload_size)
+{
+    size_t record_size = JOURNAL_RECORD_HEADER + payload_size;
+    pthread_mutex_lock(&journal->lock);
+    if (journal->failed)
+    {
+        uint64_t sequence = journal->next_sequence++; // Never written, so never buffered
+        pthread_mutex_unlock(&journal->lock);
+        return sequence;
+    }
+    if (journal->used + record_size > journal->capacity)
+    {
+        journal->capacity = (journal->used + record_size) * 2;
+        journal->buffer = (char *)realloc(journal->buffer, journal->capacity);
+    }
+    char *record = journal->buffer + journal->used;
+    uint32_t size = (uint32_t)(record_size - 4);
+    uint64_t sequence = journal->next_sequence++;
+    int64_t time_value = when;
+    unsigned char type_byte = (unsigned char)type;
+    memcpy(record, &size, 4);
+    memcpy(record + 8, &sequence, 8);
+    memcpy(record + 16, &time_value, 8);
+    memcpy(record + 24, &type_byte, 1);
+    memcpy(record + JOURNAL_RECORD_HEADER, payload, payload_size);
+    uint32_t checksum = (uint32_t)snapshot_checksum((const unsigned char *)record + 8, record_size - 8);
+    memcpy(record + 4, &checksum, 4);
+    journal->used += record_size;
+    journal->appended_bytes += record_size;
+    journal->records++;
+    pthread_mutex_unlock(&journal->lock);
+    return sequence;
+}
+
+// Function to log a new book, returns the record's sequence number or 0 without a journal
+uint64_t journal_log_add(Journal *journal, time_t when, const Book *book)
+{
+    if (journal == NULL)
+    {
+        return 0;
+    }
+    // Payload: title, author, genre count, genres, borrow count, id
+    char payload[JOURNAL_MAX_PAYLOAD];
+    size_t size = 0;
+    size_t length = strlen(book->title) + 1;
+    memcpy(payload + size, book->title, length);
+    size += length;
+    length = strlen(book->author) + 1;
+    memcpy(payload + size, book->author, length);
+    size += length;
+    payload[size++] = (char)book->gen_count;
+    for (int i = 0; i < book->gen_count; i++)
+    {
+        length = strlen(book->genre[i]) + 1;
+        memcpy(payload + size, book->genre[i], length);
+        size += length;
+    }
+    int32_t numbers[2] = {book->borrow_count, book->id};
+    memcpy(payload + size, numbers, 8);
+    size += 8;
+    return journal_append(journal, JOURNAL_ADD, when, payload, size);
+}
+
+// Function to log a borrow, return or removal, returns the record's sequence number or 0 without a journal.
+// user is the patron a borrow is recorded for, NULL if there is none.
+uint64_t journal_log_circulation(Journal *journal, int type, time_t when, const Book *book, const User *user)
+{
+    if (journal == NULL)
+    {
+        return 0;
+    }
+    // Payload: the book's id, then the patron's name for a patron's borrow
+    char payload[4 + MAX_USER_NAME];
+    int32_t id = book->id;
+    size_t size = 4;
+    memcpy(payload, &id, 4);
+    if (user != NULL && strlen(user->username) < MAX_USER_NAME)
+    {
+        size += strlen(user->username) + 1;
+        memcpy(payload + 4, user->username, size - 4);
+    }
+    return journal_append(journal, type, when, payload, size);
+}
+
+// Function to log a rescale of the decay epoch, returns the record's sequence number or 0 without a journal
+uint64_t journal_log_decay(Journal *journal, time_t when)
+{
+    if (journal == NULL)
+    {
+        return 0;
+    }
+    return journal_append(journal, JOURNAL_DECAY, when, NULL, 0);
+}
+
+// Function to make every record up to sequence durable, returns 1 if they are. Desks that arrive while
+// a group is being written wait for it, and the next of them writes everything buffered meanwhile with
+// one fsync. A failed write may have left part of a record behind, and replay stops at it, so the
+// failure sticks: nothing is written after it and no later record counts as durable.
+int journal_sync(Journal *journal, uint64_t sequence)
+{
+    pthread_mutex_lock(&journal->lock);
+    while (journal->durable_sequence < sequence && !journal->failed)
+    {
+        if (journal->syncing)
+        {
+            pthread_cond_wait(&journal->synced, &journal->lock);
+            continue;
+        }
+
+        // Lead the next group, appends carry on into the other buffer while it is written
+        char *data = journal->buffer;
+        size_t size = journal->used;
+        size_t capacity = journal->capacity;
+        uint64_t last = journal->next_sequence - 1;
+        journal->buffer = journal->spare;
+        journal->capacity = journal->spare_capacity;
+        journal->spare = data;
+        journal->spare_capacity = capacity;
+        journal->used = 0;
+        journal->syncing = 1;
+        pthread_mutex_unlock(&journal->lock);
+
+        int ok = write_all(journal->fd, data, size) && fdatasync(journal->fd) == 0;
+
+        pthread_mutex_lock(&journal->lock);
+        if (ok)
+        {
+            journal->durable_sequence = last;
+        }
+        else
+        {
+            journal->failed = 1;
+            journal->used = 0;
+            printf("Error writing journal, changes from now on are not durable.\n");
+        }
+        journal->syncing = 0;
+        journal->group_commits++;
+        journal->last_sync = monotonic_seconds();
+        pthread_cond_broadcast(&journal->synced);
+    }
+    int durable = journal->durable_sequence >= sequence;
+    pthread_mutex_unlock(&journal->lock);
+    return durable;
+}
+
+// Function to make a record durable as the journal's policy asks: at once when desks wait for
+// their records, otherwise once enough bytes or time have gathered for a group commit.
+// Returns 0 once the journal has failed, 1 otherwise.
+int journal_commit(Journal *journal, uint64_t sequence)
+{
+    if (journal == NULL)
+    {
+        return 1;
+    }
+    pthread_mutex_lock(&journal->lock);
+    int due = journal->wait_for_sync || journal->used >= JOURNAL_GROUP_BYTES ||
+              monotonic_seconds() - journal->last_sync >= JOURNAL_GROUP_SECONDS;
+    int failed = journal->failed;
+    pthread_mutex_unlock(&journal->lock);
+    if (due)
+    {
+        return journal_sync(journal, sequence);
+    }
+    return !failed;
+}
+
+// Function to make every appended record durable, returns 1 if they are
+int journal_flush(Journal *journal)
+{
+    pthread_mutex_lock(&journal->lock);
+    uint64_t last = journal->next_sequence - 1;
+    pthread_mutex_unlock(&journal->lock);
+    return journal_sync(journal, last);
+}
+
+// Function to drop the records a new base snapshot already holds, keeping those after cut_bytes
+void journal_truncate(Journal *journal, uint64_t cut_bytes)
+{
+    journal_flush(journal);
+    pthread_mutex_lock(&journal->lock);
+    while (journal->syncing)
+    {
+        pthread_cond_wait(&journal->synced, &journal->lock);
+    }
+    if (journal->failed)
+    {
+        // The snapshot holds every change, and replay skips the records up to it and cuts what the failure left
+        pthread_mutex_unlock(&journal->lock);
+        return;
+    }
+    if (journal->used > 0 && !write_all(journal->fd, journal->buffer, journal->used))
+    {
+        journal->failed = 1;
+    }
+    journal->used = 0;
+
+    // Records appended since the snapshot was cut move to a fresh file, renamed over the old one
+    size_t tail_size = journal->appended_bytes - cut_bytes;
+    char *tail = (char *)malloc(tail_size + 1);
+    int ok = !journal->failed && pread(journal->fd, tail, tail_size, cut_bytes - journal->file_start) == (ssize_t)tail_size;
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", journal->path);
+    int fd = ok ? open(temporary, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644) : -1;
+    if (fd >= 0 && write_all(fd, tail, tail_size) && fsync(fd) == 0 && rename(temporary, journal->path) == 0)
+    {
+        close(journal->fd);
+        journal->fd = fd;
+        journal->file_start = cut_bytes;
+        journal->durable_sequence = journal->next_sequence - 1;
+    }
+    else
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            remove(temporary);
+        }
+        printf("Error compacting journal.\n");
+    }
+    free(tail);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+// Function to fold the journal into a fresh base snapshot once it has grown large
+void journal_maybe_compact(Library *library, UserStore *users)
+{
+    Journal *journal = library->journal;
+    if (journal && journal->base_path && journal->appended_bytes - journal->file_start >= JOURNAL_COMPACT_BYTES)
+    {
+        save_snapshot(library, users, journal->base_path);
+    }
+}
+
+// Function to flush and close a journal
+void journal_close(Journal *journal)
+{
+    journal_flush(journal);
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->synced);
+    free(journal->buffer);
+    free(journal->spare);
+    free(journal->path);
+    free(journal->base_path);
+    free(journal);
+}
+
+// Function to apply the journal records newer than after, returns the number that took effect:
+// a borrow, return or removal whose book is gone or in another state is skipped. A torn or damaged tail, left by a crash during a write, ends the replay and is cut off.
+int journal_replay(Library *library, const char *path, uint64_t after, uint64_t *last_sequence)
+{
+    *last_sequence = after;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    struct stat info;
+    fstat(fd, &info);
+    size_t size = info.st_size;
+    char *data = (char *)malloc(size + 1);
+    size_t valid = 0;
+    int applied = 0;
+    if (read(fd, data, size) != (ssize_t)size)
+    {
+        size = 0;
+    }
+    close(fd);
+
+    while (valid + JOURNAL_RECORD_HEADER <= size)
+    {
+        char *record = data + valid;
+        uint32_t record_size, checksum;
+        memcpy(&record_size, record, 4);
+        memcpy(&checksum, record + 4, 4);
+        if (record_size < JOURNAL_RECORD_HEADER - 4 || record_size > size - valid - 4 ||
+            (uint32_t)snapshot_checksum((const unsigned char *)record + 8, record_size - 4) != checksum)
+        {
+            break;
+        }
+        uint64_t sequence;
+        int64_t when;
+        memcpy(&sequence, record + 8, 8);
+        memcpy(&when, record + 16, 8);
+        int type = (unsigned char)record[24];
+        char *payload = record + JOURNAL_RECORD_HEADER;
+        size_t payload_size = record_size + 4 - JOURNAL_RECORD_HEADER;
+        valid += record_size + 4;
+        if (sequence <= after)
+        {
+            continue; // Already in the base snapshot
+        }
+        *last_sequence = sequence;
+
+        library->replay_time = when;
+        int done = 1;
+        if (type == JOURNAL_DECAY)
+        {
+            decay_borrow_counts(library);
+        }
+        else if (type == JOURNAL_BORROW || type == JOURNAL_RETURN || type == JOURNAL_REMOVE)
+        {
+            // A patron's name ends the payload. Patrons are not journaled, so one registered after
+            // the snapshot is unknown here and the borrow is replayed without history.
+            int32_t id;
+            if (payload_size < 4 || (payload_size > 4 && payload[payload_size - 1] != '\0'))
+            {
+                continue;
+            }
+            memcpy(&id, payload, 4);
+            if (type == JOURNAL_BORROW)
+            {
+                done = borrow_book_by_id(library, id, payload_size > 4 ? find_user(&user_store, payload + 4) : NULL);
+            }
+            else if (type == JOURNAL_RETURN)
+            {
+                done = return_book_by_id(library, id);
+            }
+            else
+            {
+                done = remove_book_by_id(library, id);
+            }
+        }
+        else
+        {
+            // Strings of the payload end inside it, checked before they are read
+            char *end = payload + payload_size;
+            char *title = payload;
+            char *author = memchr(title, '\0', end - title) ? title + strlen(title) + 1 : end;
+            if (author >= end || memchr(author, '\0', end - author) == NULL)
+            {
+                continue;
+            }
+            if (type == JOURNAL_ADD)
+            {
+                char genres[MAX_GENRES][MAX_TITLE_LENGTH];
+                char *cursor = author + strlen(author) + 1;
+                int genre_count = cursor < end ? (unsigned char)*cursor++ : MAX_GENRES + 1;
+                for (int i = 0; i < genre_count && genre_count <= MAX_GENRES; i++)
+                {
+                    char *name_end = cursor < end ? memchr(cursor, '\0', end - cursor) : NULL;
+                    if (name_end == NULL || name_end - cursor >= MAX_TITLE_LENGTH)
+                    {
+                        genre_count = MAX_GENRES + 1;
+                        break;
+                    }
+                    strcpy(genres[i], cursor);
+                    cursor = name_end + 1;
+                }
+                int32_t numbers[2];
+                if (genre_count > MAX_GENRES || end - cursor != 8)
+                {
+                    continue;
+                }
+                memcpy(numbers, cursor, 8);
+                // The book gets back the id it was logged with
+                if (numbers[1] >= library->next_book_id)
+                {
+                    library->next_book_id = numbers[1];
+                }
+                add_book(library, title, author, genres, genre_count, numbers[0]);
+            }
+        }
+        applied += done;
+    }
+    library->replay_time = 0;
+    free(data);
+
+    if (valid < size)
+    {
+        truncate(path, valid);
+        printf("Cut %zu bytes of damaged journal tail.\n", size - valid);
+    }
+    return applied;
+}
+
+// Function to replay a journal on top of its base snapshot and keep logging to it.
+// base_path is the snapshot that compaction folds the journal into. The records only make sense on
+// top of it, so an empty library loads it first and a library built some other way is refused.
+Journal *journal_start(Library *library, const char *path, const char *base_path)
+{
+    if (library->journal != NULL)
+    {
+        printf("The journal is already open.\n");
+        return NULL;
+    }
+    if (base_path && library->snapshot == NULL && access(base_path, F_OK) == 0)
+    {
+        if (library->total_books != 0)
+        {
+            printf("The journal's snapshot %s must be loaded into an empty library before the journal.\n", base_path);
+            return NULL;
+        }
+        if (load_snapshot(library, &user_store, base_path) < 0)
+        {
+            return NULL;
+        }
+    }
+    uint64_t last_sequence;
+    int applied = journal_replay(library, path, library->journal_sequence, &last_sequence);
+    Journal *journal = journal_open(path, base_path, last_sequence + 1);
+    if (journal && applied > 0)
+    {
+        printf("Replayed %d journal records from %s.\n", applied, path);
+    }
+    library->journal = journal;
+    return journal;
+}
+
+// Header at the start of a snapshot file. Offsets count bytes from the start of the file,
+// and numbers are stored in the byte order of the machine that wrote them.
+typedef struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t file_size;
+    uint64_t checksum; // Of every byte after the header
+    int64_t decay_epoch;
+    uint64_t journal_sequence; // Last journal record whose change the snapshot holds
+    uint32_t next_book_id;
+    uint32_t reserved;
+    uint32_t book_count;
+    uint32_t genre_count;
+    uint32_t user_count;
+    uint32_t shelf_ref_count;
+    uint32_t co_borrow_count;
+    uint32_t history_count;
+    uint64_t books_offset;
+    uint64_t shelf_refs_offset;
+    uint64_t co_borrows_offset; // CoBorrow entries of every book, in book order
+    uint64_t genres_offset;
+    uint64_t users_offset;
+    uint64_t histories_offset;  // int32_t book ids of every user's history, in user order, oldest first
+    uint64_t strings_offset;
+} SnapshotHeader;
+
+// One book of a snapshot, in title order
+typedef struct SnapshotBook
+{
+    uint64_t title;  // Offsets of NUL-terminated strings
+    uint64_t author;
+    uint64_t shelf_refs; // Index of the book's first SnapshotShelfRef
+    uint32_t id;
+    uint32_t co_borrow_count;
+    double score;
+    int64_t last_borrowed;
+    int64_t due;       // Due date of the current loan, 0 when not borrowed
+    uint64_t borrower; // String offset of the borrowing patron's name, 0 for none
+    int32_t borrow_count;
+    uint16_t gen_count;
+    uint8_t borrowed;
+    uint8_t level;
+} SnapshotBook;
+
+// One (book, genre) pair of a snapshot, with the level of its shelf entry
+typedef struct SnapshotShelfRef
+{
+    uint32_t genre; // Index into the genre table
+    uint32_t level;
+} SnapshotShelfRef;
+
+// One user of a snapshot
+typedef struct SnapshotUser
+{
+    uint64_t username;
+    unsigned char salt[USER_SALT_LENGTH];
+    unsigned char password_hash[USER_HASH_LENGTH];
+    int32_t user_type;
+    uint32_t history_length;
+} SnapshotUser;
+
+// Function to checksum a byte range eight bytes at a time (FNV-1a over 64-bit words)
+uint64_t snapshot_checksum(const unsigned char *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < size; i++)
+    {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Function to copy a string into the snapshot image, returns its offset
+uint64_t snapshot_string(unsigned char *image, uint64_t *cursor, const char *text)
+{
+    uint64_t offset = *cursor;
+    size_t length = strlen(text) + 1;
+    memcpy(image + offset, text, length);
+    *cursor += length;
+    return offset;
+}
+
+// Function to write the library and its users to a snapshot file, returns the number of books or -1.
+// The snapshot is written beside the target and renamed over it, so a crash never leaves it half written.
+int save_snapshot(Library *library, UserStore *users, const char *filename)
+{
+    char temporary[PATH_MAX];
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", filename) >= (int)sizeof(temporary))
+    {
+        return -1;
+    }
+    double started = monotonic_seconds();
+
+    // No insert or borrow is half done while the library is copied. The journal is cut at the
+    // same moment, so its later records are exactly the changes the snapshot misses.
+    pthread_mutex_lock(&library->write_lock);
+    pthread_rwlock_wrlock(&library->decay_lock);
+    uint64_t journal_sequence = library->journal_sequence;
+    uint64_t cut_bytes = 0;
+    if (library->journal)
+    {
+        pthread_mutex_lock(&library->journal->lock);
+        journal_sequence = library->journal->next_sequence - 1;
+        cut_bytes = library->journal->appended_bytes;
+        pthread_mutex_unlock(&library->journal->lock);
+    }
+
+    // Size every section first, the image is then filled in one pass
+    // Book genre names are the shelves' own strings, so a table keyed by the name pointer finds each shelf's index
+    GenreShelf **shelf_table = (GenreShelf **)malloc((library->genre_count + 1) * sizeof(GenreShelf *));
+    long genre_slots = 16;
+    while (genre_slots < library->genre_count * 2L)
+    {
+        genre_slots *= 2;
+    }
+    const char **genre_names = (const char **)calloc(genre_slots, sizeof(char *));
+    uint32_t *genre_index = (uint32_t *)malloc(genre_slots * sizeof(uint32_t));
+    uint32_t genre_count = 0;
+    uint64_t strings_size = 0;
+    for (GenreShelf *shelf = library->shelves; shelf != NULL; shelf = shelf->next)
+    {
+        long slot = (long)(((uintptr_t)shelf->genre >> 4) * 2654435761u) & (genre_slots - 1);
+        while (genre_names[slot] != NULL)
+        {
+            slot = (slot + 1) & (genre_slots - 1);
+        }
+        genre_names[slot] = shelf->genre;
+        genre_index[slot] = genre_count;
+        shelf_table[genre_count++] = shelf;
+        strings_size += strlen(shelf->genre) + 1;
+    }
+    uint32_t book_count = library->total_books;
+    uint64_t ref_count = 0;
+    uint64_t co_borrow_count = 0;
+    // Returns do not take the decay lock, the wheel lock holds loans still until the books are copied
+    pthread_mutex_lock(&library->loans.lock);
+    for (Book *book = library->header->forward[0].next; book != NULL; book = book->forward[0].next)
+    {
+        strings_size += strlen(book->title) + 1;
+        ref_count += book->gen_count;
+        co_borrow_count += book->co_borrows ? book->co_borrows->count : 0;
+        if (book->loan && book->loan->user)
+        {
+            strings_size += strlen(book->loan->user->username) + 1;
+        }
+    }
+    for (int a = 0; a < library->authors.count; a++)
+    {
+        strings_size += strlen(library->authors.by_id[a]->name) + 1;
+    }
+    // Histories only change during borrows, which the decay lock holds off
+    uint64_t history_count = 0;
+    for (int i = 0; i < users->capacity; i++)
+    {
+        if (users->slots[i])
+        {
+            strings_size += strlen(users->slots[i]->username) + 1;
+            int length = users->slots[i]->history_count;
+            history_count += length < USER_HISTORY_LENGTH ? length : USER_HISTORY_LENGTH;
+        }
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(SnapshotHeader);
+    header.decay_epoch = library->decay_epoch;
+    header.journal_sequence = journal_sequence;
+    header.next_book_id = library->next_book_id;
+    header.book_count = book_count;
+    header.genre_count = genre_count;
+    header.user_count = users->count;
+    header.shelf_ref_count = (uint32_t)ref_count;
+    header.co_borrow_count = (uint32_t)co_borrow_count;
+    header.history_count = (uint32_t)history_count;
+    header.books_offset = sizeof(SnapshotHeader);
+    header.shelf_refs_offset = header.books_offset + (uint64_t)book_count * sizeof(SnapshotBook);
+    header.co_borrows_offset = header.shelf_refs_offset + ref_count * sizeof(SnapshotShelfRef);
+    header.genres_offset = header.co_borrows_offset + co_borrow_count * sizeof(CoBorrow);
+    header.users_offset = header.genres_offset + (uint64_t)genre_count * sizeof(uint64_t);
+    header.histories_offset = header.users_offset + (uint64_t)users->count * sizeof(SnapshotUser);
+    header.strings_offset = header.histories_offset + history_count * sizeof(int32_t);
+    header.file_size = header.strings_offset + strings_size + 1; // A final NUL ends every string in bounds
+
+    unsigned char *image = (unsigned char *)calloc(1, header.file_size);
+    if (image == NULL)
+    {
+        pthread_mutex_unlock(&library->loans.lock);
+        pthread_rwlock_unlock(&library->decay_lock);
+        pthread_mutex_unlock(&library->write_lock);
+        free(shelf_table);
+        free(genre_names);
+        free(genre_index);
+        printf("Not enough memory for a snapshot.\n");
+        return -1;
+    }
+    uint64_t cursor = header.strings_offset;
+    uint64_t *genres = (uint64_t *)(image + header.genres_offset);
+    for (uint32_t g = 0; g < genre_count; g++)
+    {
+        genres[g] = snapshot_string(image, &cursor, shelf_table[g]->genre);
+    }
+
+    uint64_t *author_offsets = (uint64_t *)calloc(library->authors.count + 1, sizeof(uint64_t));
+
+    // Shelves share the library's title order, so one cursor per shelf finds each entry in turn
+    ShelfEntry **cursors = (ShelfEntry **)malloc((genre_count + 1) * sizeof(ShelfEntry *));
+    for (uint32_t g = 0; g < genre_count; g++)
+    {
+        cursors[g] = shelf_table[g]->head->forward[0].next;
+    }
+    SnapshotBook *records = (SnapshotBook *)(image + header.books_offset);
+    SnapshotShelfRef *refs = (SnapshotShelfRef *)(image + header.shelf_refs_offset);
+    CoBorrow *co_borrows = (CoBorrow *)(image + header.co_borrows_offset);
+    uint64_t ref = 0;
+    uint32_t b = 0;
+    for (Book *book = library->header->forward[0].next; book != NULL; book = book->forward[0].next, b++)
+    {
+        SnapshotBook *record = &records[b];
+        record->title = snapshot_string(image, &cursor, book->title);
+        // Each interned author is written once and shared by its books
+        if (author_offsets[book->author_id] == 0)
+        {
+            author_offsets[book->author_id] = snapshot_string(image, &cursor, book->author);
+        }
+        record->author = author_offsets[book->author_id];
+        record->shelf_refs = ref;
+        record->id = book->id;
+        record->score = book->score;
+        record->last_borrowed = book->last_borrowed;
+        record->borrow_count = book->borrow_count;
+        record->gen_count = book->gen_count;
+        record->borrowed = book->status == STATUS_BORROWED;
+        record->level = book->level;
+        if (book->loan)
+        {
+            record->due = book->loan->due;
+            record->borrower = book->loan->user ? snapshot_string(image, &cursor, book->loan->user->username) : 0;
+        }
+        if (book->co_borrows)
+        {
+            record->co_borrow_count = book->co_borrows->count;
+            memcpy(co_borrows, book->co_borrows->entries, book->co_borrows->count * sizeof(CoBorrow));
+            co_borrows += book->co_borrows->count;
+        }
+        for (int i = 0; i < book->gen_count; i++, ref++)
+        {
+            long slot = (long)(((uintptr_t)book->genre[i] >> 4) * 2654435761u) & (genre_slots - 1);
+            while (genre_names[slot] != book->genre[i])
+            {
+                slot = (slot + 1) & (genre_slots - 1);
+            }
+            uint32_t g = genre_index[slot];
+            ShelfEntry *entry = cursors[g];
+            if (entry != NULL && entry->book == book)
+            {
+                cursors[g] = entry->forward[0].next;
+            }
+            else
+            {
+                // Books with equal titles may sit in another order on the shelf
+                for (entry = shelf_seek(shelf_table[g], book->title); entry->book != book; entry = entry->forward[0].next)
+                {
+                }
+            }
+            refs[ref].genre = g;
+            refs[ref].level = entry->level;
+        }
+    }
+    pthread_mutex_unlock(&library->loans.lock);
+    free(cursors);
+    free(author_offsets);
+    free(shelf_table);
+    free(genre_names);
+    free(genre_index);
+
+    SnapshotUser *user_records = (SnapshotUser *)(image + header.users_offset);
+    int32_t *histories = (int32_t *)(image + header.histories_offset);
+    uint32_t u = 0;
+    for (int i = 0; i < users->capacity; i++)
+    {
+        User *user = users->slots[i];
+        if (user)
+        {
+            user_records[u].username = snapshot_string(image, &cursor, user->username);
+            memcpy(user_records[u].salt, user->salt, USER_SALT_LENGTH);
+            memcpy(user_records[u].password_hash, user->password_hash, USER_HASH_LENGTH);
+            user_records[u].user_type = user->user_type;
+            int first = user->history_count > USER_HISTORY_LENGTH ? user->history_count - USER_HISTORY_LENGTH : 0;
+            for (int borrow = first; borrow < user->history_count; borrow++)
+            {
+                *histories++ = user->history[borrow % USER_HISTORY_LENGTH];
+            }
+            user_records[u].history_length = user->history_count - first;
+            u++;
+        }
+    }
+    pthread_rwlock_unlock(&library->decay_lock);
+    pthread_mutex_unlock(&library->write_lock);
+
+    header.checksum = snapshot_checksum(image + sizeof(SnapshotHeader), header.file_size - sizeof(SnapshotHeader));
+    memcpy(image, &header, sizeof(header));
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int failed = fd < 0;
+    for (uint64_t written = 0; !failed && written < header.file_size;)
+    {
+        ssize_t step = write(fd, image + written, header.file_size - written);
+        failed = step <= 0;
+        written += failed ? 0 : (uint64_t)step;
+    }
+    failed |= fd >= 0 && fsync(fd) != 0;
+    failed |= fd >= 0 && close(fd) != 0;
+    free(image);
+    if (failed || rename(temporary, filename) != 0)
+    {
+        remove(temporary);
+        printf("Error writing snapshot.\n");
+        return -1;
+    }
+
+    double elapsed = monotonic_seconds() - started;
+    printf("Saved snapshot of %u books and %u users to %s in %.3f s.\n", book_count, u, filename, elapsed);
+
+    // A new base snapshot makes the journal records it holds redundant
+    if (library->journal && library->journal->base_path && strcmp(filename, library->journal->base_path) == 0)
+    {
+        journal_truncate(library->journal, cut_bytes);
+    }
+    return (int)book_count;
+}
+
+// Function to check that a string offset of a snapshot lies in its string section and that the string
+// ends within limit bytes, so it fits the buffers that titles, authors and names are copied into
+int snapshot_string_valid(const unsigned char *data, size_t size, uint64_t offset, size_t limit)
+{
+    const SnapshotHeader *header = (const SnapshotHeader *)data;
+    if (offset < header->strings_offset || offset >= size)
+    {
+        return 0;
+    }
+    size_t left = size - offset;
+    return memchr(data + offset, '\0', left < limit ? left : limit) != NULL;
+}
+
+// Function to check every record of a snapshot whose layout is valid, returns 1 if the loader can use
+// them as they are: strings, ids, shelf references, genre indexes and list lengths all stay in bounds
+int snapshot_records_valid(const unsigned char *data, size_t size)
+{
+    const SnapshotHeader *header = (const SnapshotHeader *)data;
+    const SnapshotBook *records = (const SnapshotBook *)(data + header->books_offset);
+    const SnapshotShelfRef *refs = (const SnapshotShelfRef *)(data + header->shelf_refs_offset);
+    const uint64_t *genres = (const uint64_t *)(data + header->genres_offset);
+    const SnapshotUser *user_records = (const SnapshotUser *)(data + header->users_offset);
+    if (header->book_count > INT_MAX || header->next_book_id > INT_MAX)
+    {
+        return 0;
+    }
+
+    for (uint32_t g = 0; g < header->genre_count; g++)
+    {
+        if (!snapshot_string_valid(data, size, genres[g], MAX_TITLE_LENGTH))
+        {
+            return 0;
+        }
+    }
+    for (uint32_t r = 0; r < header->shelf_ref_count; r++)
+    {
+        if (refs[r].genre >= header->genre_count)
+        {
+            return 0;
+        }
+    }
+
+    uint64_t co_borrows = 0;
+    for (uint32_t b = 0; b < header->book_count; b++)
+    {
+        const SnapshotBook *record = &records[b];
+        if (!snapshot_string_valid(data, size, record->title, MAX_TITLE_LENGTH) ||
+            !snapshot_string_valid(data, size, record->author, MAX_AUTHOR_LENGTH) ||
+            (record->borrower != 0 && !snapshot_string_valid(data, size, record->borrower, MAX_USER_NAME)) ||
+            record->id == 0 || record->id >= (uint64_t)BOOK_ID_PAGE_SIZE * BOOK_ID_PAGES ||
+            record->gen_count > MAX_GENRES || record->shelf_refs > header->shelf_ref_count ||
+            record->gen_count > header->shelf_ref_count - record->shelf_refs)
+        {
+            return 0;
+        }
+        // Books are linked in the order they are stored, so they must be in title order
+        if (b > 0 && strcmp((const char *)data + records[b - 1].title, (const char *)data + record->title) > 0)
+        {
+            return 0;
+        }
+        co_borrows += record->co_borrow_count;
+    }
+
+    uint64_t histories = 0;
+    for (uint32_t u = 0; u < header->user_count; u++)
+    {
+        if (!snapshot_string_valid(data, size, user_records[u].username, MAX_USER_NAME) ||
+            (user_records[u].user_type != 1 && user_records[u].user_type != 2))
+        {
+            return 0;
+        }
+        histories += user_records[u].history_length;
+    }
+    return co_borrows <= header->co_borrow_count && histories <= header->history_count;
+}
+
+// Function to check that a mapped snapshot is complete and undamaged, returns 1 if it is
+int snapshot_valid(const unsigned char *data, size_t size)
+{
+    if (size < sizeof(SnapshotHeader))
+    {
+        return 0;
+    }
+    const SnapshotHeader *header = (const SnapshotHeader *)data;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 || header->version != SNAPSHOT_VERSION ||
+        header->header_size != sizeof(SnapshotHeader) || header->file_size != size || data[size - 1] != '\0')
+    {
+        return 0;
+    }
+    if (header->shelf_refs_offset != header->books_offset + (uint64_t)header->book_count * sizeof(SnapshotBook) ||
+        header->co_borrows_offset != header->shelf_refs_offset + (uint64_t)header->shelf_ref_count * sizeof(SnapshotShelfRef) ||
+        header->genres_offset != header->co_borrows_offset + (uint64_t)header->co_borrow_count * sizeof(CoBorrow) ||
+        header->users_offset != header->genres_offset + (uint64_t)header->genre_count * sizeof(uint64_t) ||
+        header->histories_offset != header->users_offset + (uint64_t)header->user_count * sizeof(SnapshotUser) ||
+        header->strings_offset != header->histories_offset + (uint64_t)header->history_count * sizeof(int32_t) ||
+        header->books_offset != sizeof(SnapshotHeader) || header->strings_offset >= size)
+    {
+        return 0;
+    }
+    return snapshot_checksum(data + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader)) == header->checksum &&
+           snapshot_records_valid(data, size);
+}
+
+// Function to restore an empty library and the users from a snapshot, returns the number of books or -1.
+// The file stays mapped for the life of the library and book titles and authors point into it.
+int load_snapshot(Library *library, UserStore *users, const char *filename)
+{
+    double started = monotonic_seconds();
+    if (library->total_books != 0 || library->snapshot != NULL || library->journal != NULL)
+    {
+        printf("A snapshot can only be loaded into an empty library, before its journal is opened.\n");
+        return -1;
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Error opening file.\n");
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        printf("Snapshot is damaged.\n");
+        return -1;
+    }
+    size_t size = info.st_size;
+    unsigned char *data = (unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        printf("Error mapping file.\n");
+        return -1;
+    }
+    if (!snapshot_valid(data, size))
+    {
+        munmap(data, size);
+        printf("Snapshot is damaged.\n");
+        return -1;
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader *)data;
+    const SnapshotBook *records = (const SnapshotBook *)(data + header->books_offset);
+    const SnapshotShelfRef *refs = (const SnapshotShelfRef *)(data + header->shelf_refs_offset);
+    const uint64_t *genres = (const uint64_t *)(data + header->genres_offset);
+    const SnapshotUser *user_records = (const SnapshotUser *)(data + header->users_offset);
+    const CoBorrow *co_borrows = (const CoBorrow *)(data + header->co_borrows_offset);
+    const int32_t *histories = (const int32_t *)(data + header->histories_offset);
+    uint64_t co_borrows_left = header->co_borrow_count;
+    uint64_t histories_left = header->history_count;
+    int book_count = header->book_count;
+
+    // Users come first so loans can name their borrowers
+    int user_count = 0;
+    for (uint32_t u = 0; u < header->user_count; u++)
+    {
+        User *user = store_user(users, (const char *)data + user_records[u].username, user_records[u].salt,
+                                user_records[u].password_hash, user_records[u].user_type);
+        uint32_t length = user_records[u].history_length <= histories_left ? user_records[u].history_length : 0;
+        for (uint32_t i = 0; user != NULL && i < length; i++)
+        {
+            user_history_add(user, histories[i]);
+        }
+        histories += length;
+        histories_left -= length;
+        if (user)
+        {
+            user_count++;
+        }
+    }
+
+    pthread_mutex_lock(&library->write_lock);
+    library->snapshot = data;
+    library->snapshot_size = size;
+    library->decay_epoch = header->decay_epoch;
+    library->journal_sequence = header->journal_sequence;
+    library->next_book_id = header->next_book_id > 0 ? header->next_book_id : 1;
+
+    ShelfBuild *builds = (ShelfBuild *)calloc(header->genre_count + 1, sizeof(ShelfBuild));
+    for (uint32_t g = 0; g < header->genre_count; g++)
+    {
+        builds[g].shelf = get_genre_shelf(library, (const char *)data + genres[g]);
+    }
+
+    Book **books = (Book **)malloc((book_count + 1) * sizeof(Book *));
+    title_index_reserve(library, book_count);
+    for (int b = 0; b < book_count; b++)
+    {
+        const SnapshotBook *record = &records[b];
+        int level = record->level < MAX_LEVEL ? record->level : MAX_LEVEL - 1;
+        Book *book = (Book *)arena_alloc(&library->arena, sizeof(Book) + (level + 1) * sizeof(struct BookLink));
+        book->title = (char *)data + record->title;
+        book->title_units = 0;
+        book->author = (char *)data + record->author;
+        book->gen_count = record->gen_count;
+        book->genre = (char **)arena_alloc(&library->arena, (record->gen_count + 1) * sizeof(char *));
+        book->borrow_count = record->borrow_count;
+        book->score = record->score;
+        book->last_borrowed = record->last_borrowed;
+        book->status = record->borrowed ? STATUS_BORROWED : STATUS_AVAILABLE;
+        book->level = level;
+        book->id = record->id;
+        book->genre_mask = 0;
+        book->co_borrows = NULL;
+        book->loan = NULL;
+        if (record->borrowed)
+        {
+            // A borrow saved without a loan falls due a loan period after it was made
+            User *borrower = record->borrower ? find_user(users, (const char *)data + record->borrower) : NULL;
+            loan_start(library, book, borrower, record->due ? record->due : record->last_borrowed + LOAN_PERIOD);
+        }
+        if (record->co_borrow_count > 0 && record->co_borrow_count <= co_borrows_left)
+        {
+            // Entries beyond what a list holds were written by a build that kept more
+            book->co_borrows = (CoBorrowList *)calloc(1, sizeof(CoBorrowList));
+            book->co_borrows->count = record->co_borrow_count < CO_BORROW_NEIGHBOURS ? record->co_borrow_count : CO_BORROW_NEIGHBOURS;
+            memcpy(book->co_borrows->entries, co_borrows, book->co_borrows->count * sizeof(CoBorrow));
+            co_borrows += record->co_borrow_count;
+            co_borrows_left -= record->co_borrow_count;
+            library->co_borrow_lists++;
+        }
+        if (b == 0 || strcmp(book->title, books[b - 1]->title) != 0)
+        {
+            title_index_set(library, book);
+        }
+        for (int i = 0; i < record->gen_count; i++)
+        {
+            const SnapshotShelfRef *shelf_ref = &refs[record->shelf_refs + i];
+            ShelfBuild *build = &builds[shelf_ref->genre];
+            int entry_level = shelf_ref->level < MAX_LEVEL ? (int)shelf_ref->level : MAX_LEVEL - 1;
+            ShelfEntry *entry = (ShelfEntry *)arena_alloc(&library->arena, sizeof(ShelfEntry) + (entry_level + 1) * sizeof(struct ShelfLink));
+            entry->book = book;
+            entry->level = entry_level;
+            book->genre[i] = build->shelf->genre;
+            book->genre_mask |= shelf_mask(build->shelf);
+            if (build->count == build->capacity)
+            {
+                build->capacity = build->capacity ? 2 * build->capacity : 256;
+                build->entries = (ShelfEntry **)realloc(build->entries, build->capacity * sizeof(ShelfEntry *));
+            }
+            build->entries[build->count++] = entry;
+        }
+        book_id_store(library, book);
+        books[b] = book;
+    }
+
+    // Books and shelf entries are already in title order with their levels, so every list links in one pass
+    author_add_books(library, books, book_count, 0);
+    library_relink(library, books, book_count);
+    for (uint32_t g = 0; g < header->genre_count; g++)
+    {
+        shelf_merge_build(&builds[g]);
+        free(builds[g].entries);
+    }
+    trigram_add_books(library, books, book_count);
+    pthread_mutex_unlock(&library->write_lock);
+    free(builds);
+    free(books);
+
+    double elapsed = monotonic_seconds() - started;
+    printf("Loaded snapshot of %d books and %d users from %s in %.3f s.\n", book_count, user_count, filename, elapsed);
+    return book_count;
+}
+
+Book *search_book_by_genre_then_title(Library *library, const char *title, const char *genre)
+{
+    Book *book = NULL;
+    search_books_by_prefix(library, title, genre, 0, &book, 1);
+    return book; //  the book with matching title and genre
+}
+
+// Function to return the first book in the library whose title is >= title
+Book *library_seek(Library *library, const char *title)
+{
+    SkipWalk walk = {0, 0};
+    Book *current = library->header;
+    Book *next = NULL; // Each link is loaded once, a change may land between two loads
+    for (int i = library->level; i >= 0; i--)
+    {
+        while ((next = current->forward[i].next) != NULL && walk_compare(&walk, next->title, title) < 0)
+        {
+            current = next;
+            walk.hops++;
+        }
+    }
+    METRIC_WALK(WALK_LIBRARY_SEEK, &walk);
+    return next; // The link the walk stopped at, an insert may already have put a smaller title before it
+}
+
+// Function to collect up to limit books whose title starts with prefix, in title order.
+// genre may be NULL to search every shelf, available_only skips borrowed books.
+int search_books_by_prefix(Library *library, const char *prefix, const char *genre, int available_only, Book **results, int limit)
+{
+    METRIC_START(timer);
+    size_t prefix_length = strlen(prefix);
+    int found = 0;
+
+    // Titles sharing a prefix are contiguous, so the walk starts at the first title >= prefix
+    // and stops at the first title that no longer matches
+    if (genre != NULL)
+    {
+        GenreShelf *shelf = find_genre_shelf(library, genre);
+        for (ShelfEntry *entry = shelf ? shelf_seek(shelf, prefix) : NULL; entry != NULL && found < limit; entry = entry->forward[0].next)
+        {
+            if (strncmp(entry->book->title, prefix, prefix_length) != 0)
+            {
+                break;
+            }
+            if (!available_only || entry->book->status == STATUS_AVAILABLE)
+            {
+                results[found++] = entry->book;
+            }
+        }
+    }
+    else
+    {
+        for (Book *current = library_seek(library, prefix); current != NULL && found < limit; current = current->forward[0].next)
+        {
+            if (strncmp(current->title, prefix, prefix_length) != 0)
+            {
+                break;
+            }
+            if (!available_only || current->status == STATUS_AVAILABLE)
+            {
+                results[found++] = current;
+            }
+        }
+    }
+    METRIC_STOP(METRIC_SEARCH, timer);
+    return found;
+}
+
+int find_book_position_in_genre(Library *library, const char *title, const char *genre)
+{
+    METRIC_START(timer);
+    GenreShelf *shelf = find_genre_shelf(library, genre);
+    int rank = shelf ? shelf_rank(shelf, title) : -1;
+    METRIC_STOP(METRIC_GENRE_POSITION, timer);
+    return rank;
+}
+
+// Function to find the position of a title in the whole library, -1 if absent
+int book_rank(Library *library, const char *title)
+{
+    SkipWalk walk = {0, 0};
+    Book *current = library->header;
+    Book *next = NULL;
+    int rank = 0;
+    for (int i = library->level; i >= 0; i--)
+    {
+        while ((next = current->forward[i].next) != NULL && walk_compare(&walk, next->title, title) < 0)
+        {
+            rank += current->forward[i].span;
+            current = next;
+            walk.hops++;
+        }
+    }
+    METRIC_WALK(WALK_BOOK_RANK, &walk);
+
+    if (next && strcmp(next->title, title) == 0)
+    {
+        return rank + 1;
+    }
+    return -1;
+}
+
+// Function to find the book at a position in the whole library, NULL if out of range
+Book *book_at_rank(Library *library, int rank)
+{
+    if (rank < 1 || rank > library->total_books)
+    {
+        return NULL;
+    }
+
+    Book *current = library->header;
+    Book *next;
+    int traversed = 0;
+    for (int i = library->level; i >= 0; i--)
+    {
+        while ((next = current->forward[i].next) != NULL && traversed + current->forward[i].span <= rank)
+        {
+            traversed += current->forward[i].span;
+            current = next;
+        }
+        if (traversed == rank)
+        {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+// Function to print the books at positions first..last of a genre shelf
+void print_shelf_page(Library *library, const char *genre, int first, int last)
+{
+    GenreShelf *shelf = find_genre_shelf(library, genre);
+    if (shelf == NULL)
+    {
+        printf("No books on the '%s' shelf.\n", genre);
+        return;
+    }
+
+    if (first < 1)
+    {
+        first = 1;
+    }
+    int position = first;
+    for (ShelfEntry *entry = shelf_entry_at_rank(shelf, first); entry != NULL && position <= last; entry = entry->forward[0].next)
+    {
+        printf("%d. Title: %s, Author: %s, Borrow Count: %d\n",
+               position, entry->book->title, entry->book->author, entry->book->borrow_count);
+        position++;
+    }
+    if (position == first)
+    {
+        printf("No books at positions %d-%d on the '%s' shelf.\n", first, last, genre);
+    }
+}
+
+// Function to compare two trigrams for qsort
+int compare_trigrams(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to add the trigrams of a text to grams, returns the new count.
+// Text is lowercased, anything but letters and digits splits words, and each word is padded
+// with two spaces in front and one behind, so "Lost" gives "  l", " lo", "los", "ost" and "st ".
+int text_trigrams(const char *text, uint32_t *grams, int count, int max)
+{
+    unsigned char previous[2] = {' ', ' '};
+    for (const unsigned char *c = (const unsigned char *)text;; c++)
+    {
+        unsigned char letter = (*c >= 'A' && *c <= 'Z') ? *c + ('a' - 'A') : *c;
+        int in_word = (letter >= 'a' && letter <= 'z') || (letter >= '0' && letter <= '9') || letter >= 0x80;
+        if (!in_word)
+        {
+            // A word ends here, close it with a trailing space
+            if (previous[1] != ' ' && count < max)
+            {
+                grams[count++] = ((uint32_t)previous[0] << 16) | ((uint32_t)previous[1] << 8) | ' ';
+            }
+            previous[0] = previous[1] = ' ';
+            if (*c == '\0')
+            {
+                break;
+            }
+            continue;
+        }
+        if (count < max)
+        {
+            grams[count++] = ((uint32_t)previous[0] << 16) | ((uint32_t)previous[1] << 8) | letter;
+        }
+        previous[0] = previous[1];
+        previous[1] = letter;
+    }
+    return count;
+}
+
+// Function to collect the distinct trigrams of a title and author, returns how many there are
+int book_trigrams(const char *title, const char *author, uint32_t *grams)
+{
+    int count = text_trigrams(title, grams, 0, TRIGRAM_MAX_PER_BOOK);
+    count = author ? text_trigrams(author, grams, count, TRIGRAM_MAX_PER_BOOK) : count;
+    qsort(grams, count, sizeof(uint32_t), compare_trigrams);
+    int distinct = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (distinct == 0 || grams[distinct - 1] != grams[i])
+        {
+            grams[distinct++] = grams[i];
+        }
+    }
+    return distinct;
+}
+
+// Function to find the posting slot of a trigram, the free slot it would take if it is missing
+TrigramPosting *trigram_slot(TrigramIndex *index, uint32_t gram)
+{
+    unsigned int mask = index->capacity - 1;
+    unsigned int slot = (gram * 2654435761u) & mask;
+    while (index->slots[slot].gram != 0 && index->slots[slot].gram != gram)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return &index->slots[slot];
+}
+
+// Function to add a book to the postings of its trigrams, the caller holds the index write lock
+void trigram_index_book(TrigramIndex *index, Book *book)
+{
+    uint32_t grams[TRIGRAM_MAX_PER_BOOK];
+    int count = book_trigrams(book->title, book->author, grams);
+    book->gram_count = count;
+
+    if ((index->count + count) * 2 > index->capacity)
+    {
+        // Rehash into a table at least twice the size
+        int capacity = index->capacity ? index->capacity : TRIGRAM_MIN_CAPACITY;
+        while ((index->count + count) * 2 > capacity)
+        {
+            capacity *= 2;
+        }
+        TrigramPosting *old_slots = index->slots;
+        int old_capacity = index->capacity;
+        index->slots = (TrigramPosting *)calloc(capacity, sizeof(TrigramPosting));
+        index->capacity = capacity;
+        for (int i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i].gram != 0)
+            {
+                *trigram_slot(index, old_slots[i].gram) = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        TrigramPosting *posting = trigram_slot(index, grams[i]);
+        if (posting->gram == 0)
+        {
+            posting->gram = grams[i];
+            index->count++;
+        }
+        if (posting->count == posting->capacity)
+        {
+            posting->capacity = posting->capacity ? 2 * posting->capacity : 4;
+            posting->books = (Book **)realloc(posting->books, posting->capacity * sizeof(Book *));
+        }
+        posting->books[posting->count++] = book;
+    }
+}
+
+// Function to add new books to the trigram index if the index has been built.
+// The caller holds the library write lock.
+void trigram_add_books(Library *library, Book **books, int count)
+{
+    if (!library->trigrams.built)
+    {
+        return;
+    }
+    pthread_rwlock_wrlock(&library->trigrams.lock);
+    for (int i = 0; i < count; i++)
+    {
+        trigram_index_book(&library->trigrams, books[i]);
+    }
+    pthread_rwlock_unlock(&library->trigrams.lock);
+}
+
+// Function to index every book, run by the first fuzzy search. Holding the write lock keeps
+// add_book from slipping a book past the walk before the index counts as built.
+void trigram_build(Library *library)
+{
+    pthread_mutex_lock(&library->write_lock);
+    pthread_rwlock_wrlock(&library->trigrams.lock);
+    if (!library->trigrams.built)
+    {
+        for (Book *book = library->header->forward[0].next; book != NULL; book = book->forward[0].next)
+        {
+            trigram_index_book(&library->trigrams, book);
+        }
+        library->trigrams.built = 1;
+    }
+    pthread_rwlock_unlock(&library->trigrams.lock);
+    pthread_mutex_unlock(&library->write_lock);
+}
+
+// Function to release the trigram postings
+void trigram_free(TrigramIndex *index)
+{
+    for (int i = 0; i < index->capacity; i++)
+    {
+        free(index->slots[i].books);
+    }
+    free(index->slots);
+    pthread_rwlock_destroy(&index->lock);
+}
+
+// Function to find books whose title or author shares trigrams with query, best match first.
+// Books are scored by the Dice coefficient of the trigram sets, and those below FUZZY_MIN_SCORE
+// are dropped. genre may be NULL. Only the postings of the query's trigrams are visited.
+int fuzzy_search_books(Library *library, const char *query, const char *genre, Book **results, double *scores, int limit)
+{
+    METRIC_START(timer);
+    uint32_t grams[TRIGRAM_MAX_PER_BOOK];
+    int gram_count = book_trigrams(query, NULL, grams);
+    if (gram_count == 0 || limit <= 0)
+    {
+        METRIC_STOP(METRIC_FUZZY_SEARCH, timer);
+        return 0;
+    }
+    GenreShelf *shelf = NULL;
+    if (genre != NULL && (shelf = find_genre_shelf(library, genre)) == NULL)
+    {
+        METRIC_STOP(METRIC_FUZZY_SEARCH, timer);
+        return 0;
+    }
+    if (!library->trigrams.built)
+    {
+        trigram_build(library);
+    }
+
+    pthread_rwlock_rdlock(&library->trigrams.lock);
+    TrigramIndex *index = &library->trigrams;
+    TrigramPosting *postings[TRIGRAM_MAX_PER_BOOK];
+    long total = 0;
+    int posting_count = 0;
+    for (int i = 0; i < gram_count; i++)
+    {
+        TrigramPosting *posting = trigram_slot(index, grams[i]);
+        if (posting->gram != 0)
+        {
+            postings[posting_count++] = posting;
+            total += posting->count;
+        }
+    }
+
+    // Count the shared trigrams of every book in the postings, a book appears once per trigram
+    long distinct = total < library->total_books ? total : library->total_books;
+    long capacity = 16;
+    while (capacity < distinct * 2)
+    {
+        capacity *= 2;
+    }
+    Book **candidates = (Book **)calloc(capacity, sizeof(Book *));
+    int *hits = (int *)malloc(capacity * sizeof(int));
+    long mask = capacity - 1;
+    for (int i = 0; i < posting_count; i++)
+    {
+        for (int j = 0; j < postings[i]->count; j++)
+        {
+            Book *book = postings[i]->books[j];
+            long slot = (long)(((uintptr_t)book >> 4) * 2654435761u) & mask;
+            while (candidates[slot] != NULL && candidates[slot] != book)
+            {
+                slot = (slot + 1) & mask;
+            }
+            if (candidates[slot] == NULL)
+            {
+                candidates[slot] = book;
+                hits[slot] = 0;
+            }
+            hits[slot]++;
+        }
+    }
+    pthread_rwlock_unlock(&library->trigrams.lock);
+
+    // Keep the best scores, insertion sorted as limit is small
+    int found = 0;
+    for (long slot = 0; slot < capacity; slot++)
+    {
+        Book *book = candidates[slot];
+        if (book == NULL)
+        {
+            continue;
+        }
+        double score = 2.0 * hits[slot] / (gram_count + book->gram_count);
+        if (score < FUZZY_MIN_SCORE || (found == limit && score <= scores[found - 1]))
+        {
+            continue;
+        }
+        if (shelf != NULL && !book_on_shelf(book, shelf))
+        {
+            continue;
+        }
+        int position = found < limit ? found++ : limit - 1;
+        while (position > 0 && (scores[position - 1] < score ||
+                                (scores[position - 1] == score && strcmp(results[position - 1]->title, book->title) > 0)))
+        {
+            results[position] = results[position - 1];
+            scores[position] = scores[position - 1];
+            position--;
+        }
+        results[position] = book;
+        scores[position] = score;
+    }
+    free(candidates);
+    free(hits);
+    METRIC_STOP(METRIC_FUZZY_SEARCH, timer);
+    return found;
+}
+
+// Function to find an interned author, NULL if no book has that author
+Author *find_author(AuthorIndex *index, const char *name)
+{
+    if (index->capacity == 0)
+    {
+        return NULL;
+    }
+    unsigned int mask = index->capacity - 1;
+    for (unsigned int slot = hash_string(name) & mask; index->slots[slot] != NULL; slot = (slot + 1) & mask)
+    {
+        if (strcmp(index->slots[slot]->name, name) == 0)
+        {
+            return index->slots[slot];
+        }
+    }
+    return NULL;
+}
+
+// Function to intern an author, giving a new name the next id. The caller holds the index write lock.
+// Names are copied into the library arena unless they already live as long as the library.
+Author *intern_author(Library *library, const char *name, int copy)
+{
+    AuthorIndex *index = &library->authors;
+    Author *author = find_author(index, name);
+    if (author)
+    {
+        return author;
+    }
+
+    if ((index->count + 1) * 2 > index->capacity)
+    {
+        int capacity = index->capacity ? index->capacity * 2 : AUTHOR_MIN_CAPACITY;
+        Author **slots = (Author **)calloc(capacity, sizeof(Author *));
+        for (int i = 0; i < index->count; i++)
+        {
+            unsigned int slot = hash_string(index->by_id[i]->name) & (capacity - 1);
+            while (slots[slot] != NULL)
+            {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot] = index->by_id[i];
+        }
+        free(index->slots);
+        index->slots = slots;
+        index->capacity = capacity;
+        index->by_id = (Author **)realloc(index->by_id, capacity / 2 * sizeof(Author *));
+    }
+
+    author = (Author *)arena_alloc(&library->arena, sizeof(Author));
+    author->name = copy ? arena_strdup(&library->arena, name) : (char *)name;
+    author->id = index->count;
+    author->count = 0;
+    author->capacity = 0;
+    author->books = NULL;
+    unsigned int slot = hash_string(name) & (index->capacity - 1);
+    while (index->slots[slot] != NULL)
+    {
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+    index->slots[slot] = author;
+    index->by_id[index->count++] = author;
+    return author;
+}
+
+// Function to point new books at their interned author and add them to the author's postings.
+// The caller holds the library write lock.
+void author_add_books(Library *library, Book **books, int count, int copy)
+{
+    pthread_rwlock_wrlock(&library->authors.lock);
+    for (int i = 0; i < count; i++)
+    {
+        Book *book = books[i];
+        Author *author = intern_author(library, book->author, copy);
+        book->author = author->name;
+        book->author_id = author->id;
+        if (author->count == author->capacity)
+        {
+            author->capacity = author->capacity ? 2 * author->capacity : 4;
+            author->books = (Book **)realloc(author->books, author->capacity * sizeof(Book *));
+        }
+        author->books[author->count++] = book;
+    }
+    pthread_rwlock_unlock(&library->authors.lock);
+}
+
+// Function to release the author dictionary, names live in the arena
+void author_index_free(AuthorIndex *index)
+{
+    for (int i = 0; i < index->count; i++)
+    {
+        free(index->by_id[i]->books);
+    }
+    free(index->slots);
+    free(index->by_id);
+    pthread_rwlock_destroy(&index->lock);
+}
+
+// Function to compare books by decayed popularity, most popular first, for qsort
+int compare_book_scores(const void *a, const void *b)
+{
+    double x = (*(Book *const *)a)->score, y = (*(Book *const *)b)->score;
+    if (x != y)
+    {
+        return x < y ? 1 : -1;
+    }
+    return compare_book_titles(a, b);
+}
+
+// Function to collect up to limit books by an author, in title order or most popular first.
+// Returns how many books the author has, which may exceed limit.
+int books_by_author(Library *library, const char *name, int by_popularity, Book **results, int limit)
+{
+    METRIC_START(timer);
+    pthread_rwlock_rdlock(&library->authors.lock);
+    Author *author = find_author(&library->authors, name);
+    int count = author ? author->count : 0;
+    Book **books = (Book **)malloc((count + 1) * sizeof(Book *));
+    if (count > 0)
+    {
+        memcpy(books, author->books, count * sizeof(Book *));
+    }
+    pthread_rwlock_unlock(&library->authors.lock);
+
+    qsort(books, count, sizeof(Book *), by_popularity ? compare_book_scores : compare_book_titles);
+    memcpy(results, books, (count < limit ? count : limit) * sizeof(Book *));
+    free(books);
+    METRIC_STOP(METRIC_BY_AUTHOR, timer);
+    return count;
+}
+
+// Function to print the books of an author
+void print_books_by_author(Library *library, const char *name, int by_popularity)
+{
+    Book *results[AUTHOR_SEARCH_LIMIT];
+    int count = books_by_author(library, name, by_popularity, results, AUTHOR_SEARCH_LIMIT);
+    for (int i = 0; i < count && i < AUTHOR_SEARCH_LIMIT; i++)
+    {
+        printf("ID: %d, Title: %s, Author: %s, Borrow Count: %d, Popularity: %.1f\n", results[i]->id, results[i]->title, results[i]->author,
+               results[i]->borrow_count, book_popularity(library, results[i]));
+    }
+    if (count == 0)
+    {
+        printf("No books by %s.\n", name);
+    }
+    else if (count > AUTHOR_SEARCH_LIMIT)
+    {
+        printf("... and %d more.\n", count - AUTHOR_SEARCH_LIMIT);
+    }
+}
+
+// Function to file a book under the id it already has
+void book_id_store(Library *library, Book *book)
+{
+    int page = book->id / BOOK_ID_PAGE_SIZE;
+    if (page >= BOOK_ID_PAGES)
+    {
+        return; // Past the table, the book is still reachable by title
+    }
+    if (library->id_pages[page] == NULL)
+    {
+        library->id_pages[page] = (Book *_Atomic *)calloc(BOOK_ID_PAGE_SIZE, sizeof(Book *));
+        library->column_pages[page] = (BookColumns *)calloc(1, sizeof(BookColumns));
+    }
+    int slot = book->id % BOOK_ID_PAGE_SIZE;
+    library->id_pages[page][slot] = book;
+    atomic_store_explicit(&library->column_pages[page]->score[slot], book->score, memory_order_relaxed);
+    library->column_pages[page]->mask[slot] =
+        book->genre_mask | BOOK_MASK_LISTED | (book->status == STATUS_AVAILABLE ? BOOK_MASK_AVAILABLE : 0);
+    if (book->id >= library->next_book_id)
+    {
+        library->next_book_id = book->id + 1;
+    }
+}
+
+// Function to find a book by id in O(1), NULL if there is none
+Book *find_book_by_id(Library *library, int id)
+{
+    METRIC_START(timer);
+    Book *book = NULL;
+    if (id > 0 && id < BOOK_ID_PAGE_SIZE * BOOK_ID_PAGES)
+    {
+        Book *_Atomic *page = library->id_pages[id / BOOK_ID_PAGE_SIZE];
+        book = page ? page[id % BOOK_ID_PAGE_SIZE] : NULL;
+    }
+    METRIC_STOP(METRIC_FIND_BY_ID, timer);
+    return book;
+}
+
+// Function to read a book id typed by a user, returns 0 unless the text is a positive number
+int parse_book_id(const char *text)
+{
+    if (*text == '#')
+    {
+        text++;
+    }
+    if (*text == '\0' || strspn(text, "0123456789") != strlen(text) || strlen(text) > 9)
+    {
+        return 0;
+    }
+    return atoi(text);
+}
+
+// Function to borrow a book by id for a patron, or for nobody in particular when user is NULL.
+// Returns 1 on success.
+int borrow_book_by_id(Library *library, int id, User *user)
+{
+    return borrow_book(library, find_book_by_id(library, id), user);
+}
+
+// Function to return a book by id, returns 1 on success
+int return_book_by_id(Library *library, int id)
+{
+    return return_book(library, find_book_by_id(library, id));
+}
+
+// Function to add a book id to a patron's history. The ring is allocated on the first borrow,
+// and a desk that loses the race to allocate it uses the winner's.
+void user_history_add(User *user, int id)
+{
+    _Atomic int *history = user->history;
+    if (history == NULL)
+    {
+        _Atomic int *fresh = (_Atomic int *)calloc(USER_HISTORY_LENGTH, sizeof(_Atomic int));
+        if (atomic_compare_exchange_strong(&user->history, &history, fresh))
+        {
+            history = fresh;
+        }
+        else
+        {
+            free(fresh);
+        }
+    }
+    int borrow = atomic_fetch_add(&user->history_count, 1);
+    history[borrow % USER_HISTORY_LENGTH] = id;
+}
+
+// Function to copy up to limit distinct ids from a patron's history, latest first, returns their number
+int user_history_recent(const User *user, int *ids, int limit)
+{
+    _Atomic int *history = user->history;
+    int count = user->history_count;
+    int found = 0;
+    for (int borrow = count - 1; history != NULL && borrow >= 0 && borrow >= count - USER_HISTORY_LENGTH && found < limit; borrow--)
+    {
+        int id = history[borrow % USER_HISTORY_LENGTH];
+        int seen = id == 0; // A slot another desk has claimed but not yet written
+        for (int i = 0; i < found && !seen; i++)
+        {
+            seen = ids[i] == id;
+        }
+        if (!seen)
+        {
+            ids[found++] = id;
+        }
+    }
+    return found;
+}
+
+// Function to count one more patron who borrowed both book and the book with id other.
+// A full list gives the place of its least counted book to the new one, which inherits that
+// count plus one, so the books kept are the most co-borrowed ones and their counts never run low.
+void co_borrow_add(Library *library, Book *book, int other)
+{
+    pthread_mutex_t *lock = &library->co_borrow_locks[book->id % CO_BORROW_LOCKS];
+    pthread_mutex_lock(lock);
+    CoBorrowList *list = book->co_borrows;
+    if (list == NULL)
+    {
+        list = (CoBorrowList *)calloc(1, sizeof(CoBorrowList));
+        book->co_borrows = list;
+        library->co_borrow_lists++;
+    }
+    int slot = 0, smallest = 0;
+    while (slot < list->count && list->entries[slot].id != other)
+    {
+        if (list->entries[slot].count < list->entries[smallest].count)
+        {
+            smallest = slot;
+        }
+        slot++;
+    }
+    if (slot < list->count)
+    {
+        list->entries[slot].count++;
+    }
+    else if (list->count < CO_BORROW_NEIGHBOURS)
+    {
+        list->entries[list->count].id = other;
+        list->entries[list->count].count = 1;
+        list->count++;
+    }
+    else
+    {
+        list->entries[smallest].id = other;
+        list->entries[smallest].count++;
+    }
+    pthread_mutex_unlock(lock);
+}
+
+// Function to pair a patron's new borrow with their latest ones, then add it to their history.
+// The work is bounded by CO_BORROW_WINDOW whatever the size of the catalogue.
+void co_borrow_record(Library *library, User *user, Book *book)
+{
+    int recent[CO_BORROW_WINDOW];
+    int recent_count = user_history_recent(user, recent, CO_BORROW_WINDOW);
+    for (int i = 0; i < recent_count; i++)
+    {
+        Book *other = recent[i] != book->id ? find_book_by_id(library, recent[i]) : NULL;
+        if (other != NULL)
+        {
+            co_borrow_add(library, book, other->id);
+            co_borrow_add(library, other, book->id);
+        }
+    }
+    user_history_add(user, book->id);
+}
+
+// Function to copy a book's co-borrow list, returns the number of entries
+int co_borrow_copy(Library *library, const Book *book, CoBorrow *entries)
+{
+    pthread_mutex_t *lock = &library->co_borrow_locks[book->id % CO_BORROW_LOCKS];
+    pthread_mutex_lock(lock);
+    int count = book->co_borrows ? book->co_borrows->count : 0;
+    if (count > 0)
+    {
+        memcpy(entries, book->co_borrows->entries, count * sizeof(CoBorrow));
+    }
+    pthread_mutex_unlock(lock);
+    return count;
+}
+
+// Function to order co-borrows by count, highest first, then by book id
+int compare_co_borrow_counts(const void *a, const void *b)
+{
+    const CoBorrow *x = (const CoBorrow *)a, *y = (const CoBorrow *)b;
+    return x->count != y->count ? y->count - x->count : x->id - y->id;
+}
+
+// Function to turn sorted co-borrows into books, skipping ids without a book, returns the number kept
+int co_borrow_books(Library *library, const CoBorrow *entries, int count, Book **results, int *counts, int limit)
+{
+    int found = 0;
+    for (int i = 0; i < count && found < limit; i++)
+    {
+        Book *book = find_book_by_id(library, entries[i].id);
+        if (book != NULL)
+        {
+            results[found] = book;
+            counts[found++] = entries[i].count;
+        }
+    }
+    return found;
+}
+
+// Function to find the books most often borrowed by the patrons who borrowed a book, returns their number
+int co_borrowed_books(Library *library, const Book *book, Book **results, int *counts, int limit)
+{
+    CoBorrow entries[CO_BORROW_NEIGHBOURS];
+    int count = co_borrow_copy(library, book, entries);
+    qsort(entries, count, sizeof(CoBorrow), compare_co_borrow_counts);
+    return co_borrow_books(library, entries, count, results, counts, limit);
+}
+
+// Function to add to a candidate's score in a recommendation table, inserting it if needed
+void recommend_table_add(CoBorrow *table, int id, int count)
+{
+    unsigned int slot = ((unsigned int)id * 2654435761u) & (RECOMMEND_TABLE_SIZE - 1);
+    while (table[slot].id != 0 && table[slot].id != id)
+    {
+        slot = (slot + 1) & (RECOMMEND_TABLE_SIZE - 1);
+    }
+    table[slot].id = id;
+    table[slot].count += count;
+}
+
+// Function to recommend books for a patron from the co-borrow lists of their latest borrows.
+// A candidate scores the sum of its co-borrow counts with those books, and books in the history
+// are left out. At most USER_HISTORY_LENGTH lists are read, so the cost does not grow with the catalogue.
+int recommend_for_user(Library *library, const User *user, Book **results, int *scores, int limit)
+{
+    METRIC_START(timer);
+    int history[USER_HISTORY_LENGTH];
+    int history_count = user_history_recent(user, history, USER_HISTORY_LENGTH);
+    CoBorrow table[RECOMMEND_TABLE_SIZE];
+    memset(table, 0, sizeof(table));
+
+    // Books in the history enter the table far below zero, so no co-borrow count lifts them
+    for (int h = 0; h < history_count; h++)
+    {
+        recommend_table_add(table, history[h], INT_MIN / 2);
+    }
+    for (int h = 0; h < history_count; h++)
+    {
+        Book *book = find_book_by_id(library, history[h]);
+        CoBorrow entries[CO_BORROW_NEIGHBOURS];
+        int count = book ? co_borrow_copy(library, book, entries) : 0;
+        for (int i = 0; i < count; i++)
+        {
+            recommend_table_add(table, entries[i].id, entries[i].count);
+        }
+    }
+
+    // Keep the best limit candidates, insertion sorted as limit is small
+    CoBorrow best[RECOMMEND_TABLE_SIZE];
+    int best_count = 0;
+    for (int slot = 0; slot < RECOMMEND_TABLE_SIZE; slot++)
+    {
+        if (table[slot].id == 0 || table[slot].count <= 0 ||
+            (best_count == limit && compare_co_borrow_counts(&table[slot], &best[limit - 1]) > 0))
+        {
+            continue;
+        }
+        int position = best_count < limit ? best_count++ : limit - 1;
+        while (position > 0 && compare_co_borrow_counts(&table[slot], &best[position - 1]) < 0)
+        {
+            best[position] = best[position - 1];
+            position--;
+        }
+        best[position] = table[slot];
+    }
+    int found = co_borrow_books(library, best, best_count, results, scores, limit);
+    METRIC_STOP(METRIC_RECOMMEND_USER, timer);
+    return found;
+}
+
+// Function to print the books most often borrowed by the patrons who borrowed a book
+void print_co_borrowed_books(Library *library, const Book *book)
+{
+    Book *results[CO_BORROW_NEIGHBOURS];
+    int counts[CO_BORROW_NEIGHBOURS];
+    int found = co_borrowed_books(library, book, results, counts, CO_BORROW_NEIGHBOURS);
+    printf("\nPatrons who borrowed '%s' also borrowed:\n", book->title);
+    if (found == 0)
+    {
+        printf("No other book has been borrowed by the same patrons yet.\n");
+    }
+    for (int i = 0; i < found; i++)
+    {
+        printf("ID: %d, Title: %s, Author: %s, Borrowed together: %d\n", results[i]->id, results[i]->title, results[i]->author, counts[i]);
+    }
+}
+
+// Function to print a patron's personal recommendations
+void print_recommendations_for_user(Library *library, const User *user)
+{
+    Book *results[PERSONAL_RECOMMENDATION_COUNT];
+    int scores[PERSONAL_RECOMMENDATION_COUNT];
+    int found = recommend_for_user(library, user, results, scores, PERSONAL_RECOMMENDATION_COUNT);
+    printf("\nRecommended for %s:\n", user->username);
+    if (found == 0)
+    {
+        printf("No recommendations yet, they follow from the books you borrow.\n");
+    }
+    for (int i = 0; i < found; i++)
+    {
+        printf("ID: %d, Title: %s, Author: %s, Status: %s, Score: %d\n", results[i]->id, results[i]->title, results[i]->author,
+               results[i]->status, scores[i]);
+    }
+}
+
+// Function to write a time as a calendar date
+void format_date(time_t when, char *text, size_t size)
+{
+    struct tm parts;
+    localtime_r(&when, &parts);
+    strftime(text, size, "%Y-%m-%d", &parts);
+}
+
+// Function to return the list a loan sits in, a wheel slot or the overdue list
+Loan **loan_list(LoanWheel *wheel, const Loan *loan)
+{
+    return loan->level < 0 ? &wheel->overdue : &wheel->slots[loan->level][loan->slot];
+}
+
+// Function to take a loan out of its list. The caller holds the wheel lock.
+void loan_unlink(LoanWheel *wheel, Loan *loan)
+{
+    if (loan->prev)
+    {
+        loan->prev->next = loan->next;
+    }
+    else
+    {
+        *loan_list(wheel, loan) = loan->next;
+    }
+    if (loan->next)
+    {
+        loan->next->prev = loan->prev;
+    }
+    else if (loan->level < 0)
+    {
+        wheel->overdue_tail = loan->prev;
+    }
+    if (loan->level < 0)
+    {
+        wheel->overdue_count--;
+    }
+    else if (wheel->slots[loan->level][loan->slot] == NULL)
+    {
+        wheel->occupied[loan->level] &= ~(1ULL << loan->slot);
+    }
+}
+
+// Function to put a loan in the wheel slot of its fire tick. The level is the first whose
+// slots still tell that tick apart from the next one to be handled. A tick already passed fires
+// on the next one, and one beyond the wheel waits in its farthest slot to be placed again.
+// The caller holds the wheel lock.
+void loan_wheel_insert(LoanWheel *wheel, Loan *loan)
+{
+    uint64_t next = wheel->tick + 1;
+    uint64_t tick = loan->fire > next ? loan->fire : next;
+    uint64_t span = 1ULL << (LOAN_WHEEL_BITS * LOAN_WHEEL_LEVELS);
+    if (tick - next >= span)
+    {
+        tick = next + span - 1;
+    }
+    int level = 0;
+    while (level < LOAN_WHEEL_LEVELS - 1 && tick - next >= 1ULL << (LOAN_WHEEL_BITS * (level + 1)))
+    {
+        level++;
+    }
+    loan->level = level;
+    loan->slot = (tick >> (LOAN_WHEEL_BITS * level)) & (LOAN_WHEEL_SLOTS - 1);
+    loan->prev = NULL;
+    loan->next = wheel->slots[level][loan->slot];
+    if (loan->next)
+    {
+        loan->next->prev = loan;
+    }
+    wheel->slots[level][loan->slot] = loan;
+    wheel->occupied[level] |= 1ULL << loan->slot;
+}
+
+// Function to start the loan of a borrowed book, due at the given time. A desk that lost the
+// book to a return in the meantime starts none, and a later borrow's loan replaces an earlier one.
+void loan_start(Library *library, Book *book, User *user, time_t due)
+{
+    LoanWheel *wheel = &library->loans;
+    pthread_mutex_lock(&wheel->lock);
+    if (book->status != STATUS_BORROWED)
+    {
+        pthread_mutex_unlock(&wheel->lock);
+        return;
+    }
+    Loan *loan = book->loan;
+    if (loan)
+    {
+        loan_unlink(wheel, loan);
+    }
+    else if ((loan = wheel->free_loans) != NULL)
+    {
+        wheel->free_loans = loan->next;
+        wheel->count++;
+    }
+    else
+    {
+        loan = (Loan *)malloc(sizeof(Loan));
+        wheel->count++;
+    }
+    loan->book = book;
+    loan->user = user;
+    loan->due = due;
+    loan->stage = LOAN_OUT;
+    // The reminder fires first, then the due date, both rounded up to whole ticks
+    loan->fire = (due - LOAN_REMINDER_LEAD + LOAN_TICK - 1) / LOAN_TICK;
+    loan_wheel_insert(wheel, loan);
+    book->loan = loan;
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+// Function to mark a borrowed book available and end its loan in O(1), returns the node of the book
+// whose loan ended, NULL if it was not borrowed. The status swap happens under the wheel lock so a loan
+// never outlives its borrow, and rebuild_levels moves books under it too.
+Book *loan_end(Library *library, Book *book)
+{
+    LoanWheel *wheel = &library->loans;
+    pthread_mutex_lock(&wheel->lock);
+    book = book_live(library, book);
+    const char *expected = STATUS_BORROWED;
+    int returned = book != NULL && atomic_compare_exchange_strong(&book->status, &expected, STATUS_AVAILABLE);
+    if (returned)
+    {
+        loan_release(wheel, book);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    return returned ? book : NULL;
+}
+
+// Function to take a book's loan off the wheel and keep its node for the next loan.
+// The caller holds the wheel lock.
+void loan_release(LoanWheel *wheel, Book *book)
+{
+    Loan *loan = book->loan;
+    if (loan)
+    {
+        loan_unlink(wheel, loan);
+        book->loan = NULL;
+        loan->next = wheel->free_loans;
+        wheel->free_loans = loan;
+        wheel->count--;
+    }
+}
+
+// Function to write a reminder for a loan
+void loan_remind(FILE *out, const Loan *loan, const char *what)
+{
+    char due[32];
+    format_date(loan->due, due, sizeof(due));
+    fprintf(out, "Reminder: '%s' (ID: %d) borrowed by %s %s %s.\n", loan->book->title, loan->book->id,
+            loan->user ? loan->user->username : "a visitor", what, due);
+}
+
+// Function to handle the loans of a slot whose tick has come: a loan reaching its reminder
+// is put back for its due date, and a loan reaching its due date joins the overdue list. A loan
+// that also falls due before the target tick gets only the overdue reminder.
+// Returns the number of loans handled. The caller holds the wheel lock.
+int loan_expire(LoanWheel *wheel, Loan *loans, uint64_t target, FILE *reminders)
+{
+    int handled = 0;
+    wheel->slots[0][wheel->tick & (LOAN_WHEEL_SLOTS - 1)] = NULL;
+    wheel->occupied[0] &= ~(1ULL << (wheel->tick & (LOAN_WHEEL_SLOTS - 1)));
+    while (loans != NULL)
+    {
+        Loan *loan = loans;
+        loans = loan->next;
+        uint64_t due_tick = (loan->due + LOAN_TICK - 1) / LOAN_TICK;
+        if (loan->stage == LOAN_OUT && due_tick > wheel->tick)
+        {
+            loan->stage = LOAN_DUE_SOON;
+            loan->fire = due_tick;
+            loan_wheel_insert(wheel, loan);
+            if (reminders && due_tick > target)
+            {
+                loan_remind(reminders, loan, "is due back on");
+            }
+        }
+        else
+        {
+            loan->stage = LOAN_OVERDUE;
+            loan->level = -1;
+            loan->next = NULL;
+            loan->prev = wheel->overdue_tail;
+            if (wheel->overdue_tail)
+            {
+                wheel->overdue_tail->next = loan;
+            }
+            else
+            {
+                wheel->overdue = loan;
+            }
+            wheel->overdue_tail = loan;
+            wheel->overdue_count++;
+            if (reminders)
+            {
+                loan_remind(reminders, loan, "is overdue, it was due on");
+            }
+        }
+        handled++;
+    }
+    return handled;
+}
+
+// Function to move the wheel forward to a time, writing reminders for the loans that reach their
+// reminder or due date, NULL for none. Returns the number of such loans. Empty stretches of the
+// lowest level are skipped through its occupancy bits, so the work follows the loans handled and
+// the slots cascaded, never the number of loans out.
+int loan_advance(Library *library, time_t now, FILE *reminders)
+{
+    LoanWheel *wheel = &library->loans;
+    uint64_t target = now / LOAN_TICK;
+    int handled = 0;
+    pthread_mutex_lock(&wheel->lock);
+    while (wheel->tick < target)
+    {
+        uint64_t tick = wheel->tick + 1;
+        if (wheel->count == wheel->overdue_count)
+        {
+            wheel->tick = target; // Nothing left in the wheel
+            break;
+        }
+        if (tick & (LOAN_WHEEL_SLOTS - 1))
+        {
+            uint64_t pending = wheel->occupied[0] & (~0ULL << (tick & (LOAN_WHEEL_SLOTS - 1)));
+            tick = pending ? (tick & ~(uint64_t)(LOAN_WHEEL_SLOTS - 1)) + __builtin_ctzll(pending)
+                           : (tick | (LOAN_WHEEL_SLOTS - 1)) + 1;
+            if (tick > target)
+            {
+                wheel->tick = target;
+                break;
+            }
+        }
+
+        // At the start of a rotation the slots above that begin one too are spread into the
+        // levels below, highest first, while the wheel still stands on the tick before
+        wheel->tick = tick - 1;
+        for (int level = LOAN_WHEEL_LEVELS - 1; level > 0; level--)
+        {
+            if ((tick & ((1ULL << (LOAN_WHEEL_BITS * level)) - 1)) != 0)
+            {
+                continue;
+            }
+            int slot = (tick >> (LOAN_WHEEL_BITS * level)) & (LOAN_WHEEL_SLOTS - 1);
+            Loan *loans = wheel->slots[level][slot];
+            wheel->slots[level][slot] = NULL;
+            wheel->occupied[level] &= ~(1ULL << slot);
+            while (loans != NULL)
+            {
+                Loan *loan = loans;
+                loans = loan->next;
+                loan_wheel_insert(wheel, loan);
+            }
+        }
+        wheel->tick = tick;
+        handled += loan_expire(wheel, wheel->slots[0][tick & (LOAN_WHEEL_SLOTS - 1)], target, reminders);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    return handled;
+}
+
+// Function to print every overdue loan, oldest due date first. Only the overdue list is read.
+void print_overdue_report(Library *library)
+{
+    time_t now = library_now(library);
+    loan_advance(library, now, NULL);
+    LoanWheel *wheel = &library->loans;
+    pthread_mutex_lock(&wheel->lock);
+    printf("\nOverdue loans: %ld of %ld loans out\n", wheel->overdue_count, wheel->count);
+    for (Loan *loan = wheel->overdue; loan != NULL; loan = loan->next)
+    {
+        char due[32];
+        format_date(loan->due, due, sizeof(due));
+        printf("ID: %d, Title: %s, Borrowed by: %s, Due: %s, Days overdue: %ld\n", loan->book->id, loan->book->title,
+               loan->user ? loan->user->username : "a visitor", due, (long)((now - loan->due) / (24 * 60 * 60)));
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+// Function to free every loan node
+void loan_wheel_free(LoanWheel *wheel)
+{
+    for (int level = 0; level < LOAN_WHEEL_LEVELS; level++)
+    {
+        for (int slot = 0; slot < LOAN_WHEEL_SLOTS; slot++)
+        {
+            while (wheel->slots[level][slot] != NULL)
+            {
+                Loan *loan = wheel->slots[level][slot];
+                wheel->slots[level][slot] = loan->next;
+                free(loan);
+            }
+        }
+    }
+    Loan *lists[2] = {wheel->overdue, wheel->free_loans};
+    for (int i = 0; i < 2; i++)
+    {
+        while (lists[i] != NULL)
+        {
+            Loan *loan = lists[i];
+            lists[i] = loan->next;
+            free(loan);
+        }
+    }
+    pthread_mutex_destroy(&wheel->lock);
+}
+
+// Function to make room in the title index for count more titles, the caller holds the write lock
+void title_index_reserve(Library *library, int count)
+{
+    TitleIndex *index = &library->titles;
+    if ((index->count + count) * 2 <= index->capacity)
+    {
+        return;
+    }
+    int capacity = index->capacity ? index->capacity : TITLE_INDEX_MIN_CAPACITY;
+    while ((index->count + count) * 2 > capacity)
+    {
+        capacity *= 2;
+    }
+    TitleSlot *slots = (TitleSlot *)calloc(capacity, sizeof(TitleSlot));
+    for (int i = 0; i < index->capacity; i++)
+    {
+        if (index->slots[i].book)
+        {
+            unsigned int slot = index->slots[i].hash & (capacity - 1);
+            while (slots[slot].book != NULL)
+            {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot] = index->slots[i];
+        }
+    }
+    pthread_rwlock_wrlock(&index->lock);
+    TitleSlot *old_slots = index->slots;
+    index->slots = slots;
+    index->capacity = capacity;
+    pthread_rwlock_unlock(&index->lock);
+    free(old_slots);
+}
+
+// Function to point the title index at the first book with a title, the caller holds the write lock.
+// Books are inserted before others with the same title, so a new book always becomes the first.
+void title_index_set(Library *library, Book *book)
+{
+    TitleIndex *index = &library->titles;
+    unsigned int hash = hash_string(book->title);
+    title_index_reserve(library, 1);
+    pthread_rwlock_wrlock(&index->lock);
+    unsigned int mask = index->capacity - 1;
+    unsigned int slot = hash & mask;
+    while (index->slots[slot].book != NULL &&
+           (index->slots[slot].hash != hash || strcmp(index->slots[slot].book->title, book->title) != 0))
+    {
+        slot = (slot + 1) & mask;
+    }
+    if (index->slots[slot].book == NULL)
+    {
+        index->count++;
+    }
+    index->slots[slot].hash = hash;
+    index->slots[slot].book = book;
+    pthread_rwlock_unlock(&index->lock);
+}
+
+// Function to find the first book with exactly this title in O(1), NULL if there is none.
+// Other books with the same title follow it on level 0.
+Book *find_book_by_title(Library *library, const char *title)
+{
+    METRIC_START(timer);
+    TitleIndex *index = &library->titles;
+    unsigned int hash = hash_string(title);
+    Book *book = NULL;
+    pthread_rwlock_rdlock(&index->lock);
+    if (index->capacity > 0)
+    {
+        unsigned int mask = index->capacity - 1;
+        for (unsigned int slot = hash & mask; index->slots[slot].book != NULL; slot = (slot + 1) & mask)
+        {
+            if (index->slots[slot].hash == hash && strcmp(index->slots[slot].book->title, title) == 0)
+            {
+                book = index->slots[slot].book;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&index->lock);
+    METRIC_STOP(METRIC_FIND_BY_TITLE, timer);
+    return book;
+}
+
+// Function to file books added in title order under their ids and in the title index.
+// The caller holds the write lock.
+void index_new_books(Library *library, Book **books, int count)
+{
+    title_index_reserve(library, count);
+    for (int i = 0; i < count; i++)
+    {
+        book_id_store(library, books[i]);
+        if (i == 0 || strcmp(books[i - 1]->title, books[i]->title) != 0)
+        {
+            title_index_set(library, books[i]);
+        }
+    }
+}
+
+// Function to release the id table and the title index
+void book_index_free(Library *library)
+{
+    for (int page = 0; page < BOOK_ID_PAGES; page++)
+    {
+        for (int i = 0; library->id_pages[page] != NULL && i < BOOK_ID_PAGE_SIZE; i++)
+        {
+            if (library->id_pages[page][i] != NULL)
+            {
+                free(library->id_pages[page][i]->co_borrows);
+            }
+        }
+        free((void *)library->id_pages[page]);
+        free(library->column_pages[page]);
+    }
+    free(library->titles.slots);
+    pthread_rwlock_destroy(&library->titles.lock);
+}
+
+_Atomic uint64_t reader_epoch = 1; // Moved on by every library_reclaim
+ReaderSlot *reader_slots = NULL;    // Every thread's slot, kept after the thread ends
+pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t reader_key;
+pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+_Thread_local ReaderSlot *thread_reader = NULL;
+
+// Function to hand an ended thread's slot to the next new thread
+void reader_release_slot(void *slot)
+{
+    pthread_mutex_lock(&reader_lock);
+    atomic_store(&((ReaderSlot *)slot)->epoch, 0);
+    ((ReaderSlot *)slot)->in_use = 0;
+    pthread_mutex_unlock(&reader_lock);
+}
+
+// Function to create the key that notices when a thread ends
+void reader_create_key()
+{
+    pthread_key_create(&reader_key, reader_release_slot);
+}
+
+// Function to return the calling thread's slot, claiming a free one or making one on first use
+ReaderSlot *reader_slot()
+{
+    if (thread_reader != NULL)
+    {
+        return thread_reader;
+    }
+    pthread_once(&reader_key_once, reader_create_key);
+    pthread_mutex_lock(&reader_lock);
+    ReaderSlot *slot = reader_slots;
+    while (slot != NULL && slot->in_use)
+    {
+        slot = slot->next;
+    }
+    if (slot == NULL)
+    {
+        slot = (ReaderSlot *)calloc(1, sizeof(ReaderSlot));
+        slot->next = reader_slots;
+        reader_slots = slot;
+    }
+    slot->in_use = 1;
+    pthread_mutex_unlock(&reader_lock);
+    pthread_setspecific(reader_key, slot);
+    thread_reader = slot;
+    return slot;
+}
+
+// Function to start a read section, in which the nodes a thread reaches without locks stay as they are.
+// Desks hold one around each request; sections nest, and only the outermost one counts.
+void reader_enter()
+{
+    ReaderSlot *slot = reader_slot();
+    if (slot->depth++ == 0)
+    {
+        atomic_store(&slot->epoch, atomic_load(&reader_epoch));
+        // The epoch is visible before the first link is read: a reclaim that misses it ran before
+        // this section could reach anything it frees
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+// Function to end a read section, after which the thread holds no node it reached inside it
+void reader_exit()
+{
+    ReaderSlot *slot = thread_reader;
+    if (--slot->depth == 0)
+    {
+        atomic_store_explicit(&slot->epoch, 0, memory_order_release);
+    }
+}
+
+// Function to find the epoch of the oldest read section under way, UINT64_MAX when there is none
+uint64_t reader_oldest()
+{
+    uint64_t oldest = UINT64_MAX;
+    pthread_mutex_lock(&reader_lock);
+    for (ReaderSlot *slot = reader_slots; slot != NULL; slot = slot->next)
+    {
+        uint64_t epoch = atomic_load(&slot->epoch);
+        if (epoch != 0 && epoch < oldest)
+        {
+            oldest = epoch;
+        }
+    }
+    pthread_mutex_unlock(&reader_lock);
+    return oldest;
+}
+
+// Function to remember a node that was unlinked, until library_reclaim can reuse it. It is tagged with
+// the current epoch: read sections that start after the epoch moves on can no longer reach it.
+void retire_node(RetiredNodes *retired, void *node)
+{
+    if (retired->count == retired->capacity)
+    {
+        retired->capacity = retired->capacity ? 2 * retired->capacity : 64;
+        retired->nodes = (RetiredNode *)realloc(retired->nodes, retired->capacity * sizeof(RetiredNode));
+    }
+    retired->nodes[retired->count].node = node;
+    retired->nodes[retired->count].epoch = atomic_load(&reader_epoch);
+    retired->count++;
+}
+
+// Function to get the node of a new book, reusing the node of a removed book of the same level or,
+// failing that, of the nearest higher level so the free lists cannot drift apart from the levels drawn.
+// The spare links of a taller node go unused until it is freed again. The caller holds the write lock.
+Book *library_book_node(Library *library, int level)
+{
+    for (int l = level; l < MAX_LEVEL; l++)
+    {
+        Book *book = library->free_books[l];
+        if (book != NULL)
+        {
+            library->free_books[l] = book->forward[0].next;
+            library->recycled_bytes -= sizeof(Book) + (l + 1) * sizeof(struct BookLink);
+            return book;
+        }
+    }
+    return (Book *)arena_alloc(&library->arena, sizeof(Book) + (level + 1) * sizeof(struct BookLink));
+}
+
+// Function to get a new shelf entry, reusing one of the same level or the nearest higher one.
+// The caller holds the write lock.
+ShelfEntry *library_shelf_entry(Library *library, int level)
+{
+    for (int l = level; l < MAX_LEVEL; l++)
+    {
+        ShelfEntry *entry = library->free_entries[l];
+        if (entry != NULL)
+        {
+            library->free_entries[l] = entry->forward[0].next;
+            library->recycled_bytes -= sizeof(ShelfEntry) + (l + 1) * sizeof(struct ShelfLink);
+            return entry;
+        }
+    }
+    return (ShelfEntry *)arena_alloc(&library->arena, sizeof(ShelfEntry) + (level + 1) * sizeof(struct ShelfLink));
+}
+
+// Function to copy the title of a new book into whole TITLE_UNIT-byte units, reusing the title of
+// a removed book that holds as many. Sets units to the units taken, 0 for a title too long for the free lists.
+char *library_title_copy(Library *library, const char *title, unsigned char *units)
+{
+    size_t length = strlen(title) + 1;
+    size_t needed = (length + TITLE_UNIT - 1) / TITLE_UNIT;
+    if (needed >= TITLE_CLASSES)
+    {
+        *units = 0;
+        return arena_strdup(&library->arena, title);
+    }
+    char *copy = library->free_titles[needed];
+    if (copy != NULL)
+    {
+        memcpy(&library->free_titles[needed], copy, sizeof(char *)); // Titles are not aligned
+        library->recycled_bytes -= needed * TITLE_UNIT;
+    }
+    else
+    {
+        copy = (char *)arena_alloc_aligned(&library->arena, needed * TITLE_UNIT, 1);
+    }
+    memcpy(copy, title, length);
+    *units = (unsigned char)needed;
+    return copy;
+}
+
+// Function to get the genre array of a new book, reusing one of a removed book with as many genres
+char **library_genre_array(Library *library, int count)
+{
+    char **genre = count > 0 ? library->free_genres[count] : NULL;
+    if (genre == NULL)
+    {
+        return (char **)arena_alloc(&library->arena, count * sizeof(char *));
+    }
+    library->free_genres[count] = (char **)genre[0];
+    library->recycled_bytes -= count * sizeof(char *);
+    return genre;
+}
+
+// Function to unlink a book from every level of the library in O(log n), the caller holds the write lock.
+// The book keeps its own links, so a search standing on it carries on to the books after it.
+void library_unlink(Library *library, Book *book)
+{
+    Book *update[MAX_LEVEL];
+    Book *current = library->header;
+    for (int i = library->level; i >= 0; i--)
+    {
+        while (current->forward[i].next != NULL && strcmp(current->forward[i].next->title, book->title) < 0)
+        {
+            current = current->forward[i].next;
+        }
+        update[i] = current;
+    }
+    // Copies with the same title may come before the book, then the last of them on each level precedes it there
+    for (Book *copy = update[0]->forward[0].next; copy != book; copy = copy->forward[0].next)
+    {
+        for (int i = 0; i <= copy->level; i++)
+        {
+            update[i] = copy;
+        }
+    }
+
+    for (int i = 0; i <= library->level; i++)
+    {
+        if (update[i]->forward[i].next == book)
+        {
+            update[i]->forward[i].span += book->forward[i].span - 1;
+            update[i]->forward[i].next = book->forward[i].next;
+        }
+        else
+        {
+            update[i]->forward[i].span--;
+        }
+    }
+    while (library->level > 0 && library->header->forward[library->level].next == NULL)
+    {
+        library->level--;
+    }
+    library->total_books--;
+}
+
+// Function to unlink a book from a shelf in O(log n) and return its entry, the caller holds the write lock
+ShelfEntry *shelf_unlink(GenreShelf *shelf, Book *book)
+{
+    ShelfEntry *update[MAX_LEVEL];
+    ShelfEntry *current = shelf->head;
+    for (int i = shelf->level; i >= 0; i--)
+    {
+        while (current->forward[i].next != NULL && strcmp(current->forward[i].next->book->title, book->title) < 0)
+        {
+            current = current->forward[i].next;
+        }
+        update[i] = current;
+    }
+    ShelfEntry *entry = update[0]->forward[0].next;
+    for (; entry->book != book; entry = entry->forward[0].next)
+    {
+        for (int i = 0; i <= entry->level; i++)
+        {
+            update[i] = entry;
+        }
+    }
+
+    for (int i = 0; i <= shelf->level; i++)
+    {
+        if (update[i]->forward[i].next == entry)
+        {
+            update[i]->forward[i].span += entry->forward[i].span - 1;
+            update[i]->forward[i].next = entry->forward[i].next;
+        }
+        else
+        {
+            update[i]->forward[i].span--;
+        }
+    }
+    while (shelf->level > 0 && shelf->head->forward[shelf->level].next == NULL)
+    {
+        shelf->level--;
+    }
+    shelf->count--;
+    return entry;
+}
+
+// Function to drop a book from the title index, the caller holds the write lock. A copy with the
+// same title takes over the entry, otherwise the entries after it shift back so probes still find them.
+void title_index_remove(Library *library, Book *book)
+{
+    TitleIndex *index = &library->titles;
+    if (index->capacity == 0)
+    {
+        return;
+    }
+    unsigned int hash = hash_string(book->title);
+    pthread_rwlock_wrlock(&index->lock);
+    unsigned int mask = index->capacity - 1;
+    unsigned int slot = hash & mask;
+    while (index->slots[slot].book != NULL &&
+           (index->slots[slot].hash != hash || strcmp(index->slots[slot].book->title, book->title) != 0))
+    {
+        slot = (slot + 1) & mask;
+    }
+    // The entry of a later copy leads to the first one and stays as it is
+    Book *next = book->forward[0].next;
+    if (index->slots[slot].book == book && next != NULL && strcmp(next->title, book->title) == 0)
+    {
+        index->slots[slot].book = next;
+    }
+    else if (index->slots[slot].book == book)
+    {
+        unsigned int hole = slot;
+        for (unsigned int probe = (hole + 1) & mask; index->slots[probe].book != NULL; probe = (probe + 1) & mask)
+        {
+            // An entry may fill the hole unless its own slot lies between the hole and where it sits
+            unsigned int home = index->slots[probe].hash & mask;
+            if (((probe - home) & mask) >= ((probe - hole) & mask))
+            {
+                index->slots[hole] = index->slots[probe];
+                hole = probe;
+            }
+        }
+        index->slots[hole].book = NULL;
+        index->count--;
+    }
+    pthread_rwlock_unlock(&index->lock);
+}
+
+// Function to drop a book from its author's postings, the caller holds the write lock
+void author_remove_book(Library *library, Book *book)
+{
+    pthread_rwlock_wrlock(&library->authors.lock);
+    Author *author = library->authors.by_id[book->author_id];
+    for (int i = 0; i < author->count; i++)
+    {
+        if (author->books[i] == book)
+        {
+            memmove(&author->books[i], &author->books[i + 1], (author->count - i - 1) * sizeof(Book *));
+            author->count--;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&library->authors.lock);
+}
+
+// Function to drop a book from the postings of its trigrams if the index has been built.
+// The caller holds the write lock. Each posting is scanned, so this costs the lengths of the postings.
+void trigram_remove_book(Library *library, Book *book)
+{
+    if (!library->trigrams.built)
+    {
+        return;
+    }
+    uint32_t grams[TRIGRAM_MAX_PER_BOOK];
+    int count = book_trigrams(book->title, book->author, grams);
+    pthread_rwlock_wrlock(&library->trigrams.lock);
+    for (int g = 0; g < count; g++)
+    {
+        TrigramPosting *posting = trigram_slot(&library->trigrams, grams[g]);
+        for (int i = 0; posting->gram != 0 && i < posting->count; i++)
+        {
+            if (posting->books[i] == book)
+            {
+                memmove(&posting->books[i], &posting->books[i + 1], (posting->count - i - 1) * sizeof(Book *));
+                posting->count--;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&library->trigrams.lock);
+}
+
+// Function to take a weeded or lost book out of the library and every index, returns 1 on success.
+// It is unlinked from every level in O(log n), like an insert. Searches take no lock and may be
+// standing on it, so its node and strings only go back on the free lists at library_reclaim.
+// Its id is never handed out again.
+int remove_book(Library *library, Book *book)
+{
+    if (book == NULL)
+    {
+        return 0;
+    }
+
+    // The decay lock holds off borrows and snapshots and the wheel lock returns, so the status stays put
+    METRIC_START(timer);
+    pthread_mutex_lock(&library->write_lock);
+    book = book_live(library, book); // Books only move under the write lock
+    pthread_rwlock_wrlock(&library->decay_lock);
+    pthread_mutex_lock(&library->loans.lock);
+    int removed = book != NULL && book->status != STATUS_REMOVED;
+    if (removed)
+    {
+        library->removed_books++;
+        library->removed_borrows += book->borrow_count;
+        library->removed_loans += book->loan != NULL;
+        loan_release(&library->loans, book);
+        book->status = STATUS_REMOVED;
+    }
+    pthread_mutex_unlock(&library->loans.lock);
+    if (!removed)
+    {
+        pthread_rwlock_unlock(&library->decay_lock);
+        pthread_mutex_unlock(&library->write_lock);
+        METRIC_STOP(METRIC_REMOVE, timer);
+        return 0;
+    }
+
+    // Scans stop matching the id before it stops leading to the book
+    BookColumns *columns = book_columns(library, book->id);
+    if (columns)
+    {
+        columns->mask[book->id % BOOK_ID_PAGE_SIZE] = 0;
+        atomic_store_explicit(&columns->score[book->id % BOOK_ID_PAGE_SIZE], 0, memory_order_relaxed);
+        library->id_pages[book->id / BOOK_ID_PAGE_SIZE][book->id % BOOK_ID_PAGE_SIZE] = NULL;
+    }
+    title_index_remove(library, book);
+    library_unlink(library, book);
+    for (int i = 0; i < book->gen_count; i++)
+    {
+        GenreShelf *shelf = book_genre_shelf(library, book, book->genre[i]);
+        retire_node(&library->retired_entries, shelf_unlink(shelf, book));
+
+        // A full top list that loses a book is refilled from the shelf
+        pthread_mutex_lock(&shelf->top_lock);
+        int index = 0;
+        while (index < shelf->top_count && shelf->top[index] != book)
+        {
+            index++;
+        }
+        if (index < shelf->top_count)
+        {
+            memmove(&shelf->top[index], &shelf->top[index + 1], (shelf->top_count - index - 1) * sizeof(Book *));
+            shelf->top_count--;
+            if (shelf->count > shelf->top_count)
+            {
+                shelf_rebuild_top(shelf);
+            }
+        }
+        pthread_mutex_unlock(&shelf->top_lock);
+    }
+    author_remove_book(library, book);
+    trigram_remove_book(library, book);
+
+    // Other books' co-borrow lists and patrons' histories keep the id, which now leads nowhere
+    pthread_mutex_t *lock = &library->co_borrow_locks[book->id % CO_BORROW_LOCKS];
+    pthread_mutex_lock(lock);
+    if (book->co_borrows)
+    {
+        free(book->co_borrows);
+        book->co_borrows = NULL;
+        library->co_borrow_lists--;
+    }
+    pthread_mutex_unlock(lock);
+
+    retire_node(&library->retired_books, book);
+    uint64_t sequence = journal_log_circulation(library->journal, JOURNAL_REMOVE, library_now(library), book, NULL);
+    pthread_rwlock_unlock(&library->decay_lock);
+    pthread_mutex_unlock(&library->write_lock);
+    journal_commit(library->journal, sequence);
+    METRIC_STOP(METRIC_REMOVE, timer);
+    return 1;
+}
+
+// Function to remove a book by id, returns 1 on success
+int remove_book_by_id(Library *library, int id)
+{
+    return remove_book(library, find_book_by_id(library, id));
+}
+
+// Function to put the nodes and strings of removed books on the free lists, where new books pick
+// them up. Searches and listings take no lock, so only nodes retired before the oldest read section
+// under way are reused; the rest wait for a later call. The batch loop, the menus and the stress
+// test's maintenance thread call this.
+void library_reclaim(Library *library)
+{
+    pthread_mutex_lock(&library->write_lock);
+    // Read sections that start from here on cannot reach anything retired so far
+    atomic_fetch_add(&reader_epoch, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t oldest = reader_oldest();
+    RetiredNodes *lists[2] = {&library->retired_books, &library->moved_books};
+    for (int l = 0; l < 2; l++)
+    {
+        int kept = 0;
+        for (int i = 0; i < lists[l]->count; i++)
+        {
+            if (lists[l]->nodes[i].epoch >= oldest)
+            {
+                lists[l]->nodes[kept++] = lists[l]->nodes[i];
+                continue;
+            }
+            Book *book = (Book *)lists[l]->nodes[i].node;
+            // A moved book's strings belong to its new node, and titles in the snapshot mapping are not ours.
+            // A title sized to fit goes to the units it fills.
+            unsigned char *title = (unsigned char *)book->title;
+            size_t units = book->title_units ? book->title_units : (strlen(book->title) + 1) / TITLE_UNIT;
+            units = units < TITLE_CLASSES ? units : TITLE_CLASSES - 1;
+            if (l == 0 && units > 0 && (library->snapshot == NULL || title < library->snapshot || title >= library->snapshot + library->snapshot_size))
+            {
+                memcpy(book->title, &library->free_titles[units], sizeof(char *));
+                library->free_titles[units] = book->title;
+                library->recycled_bytes += units * TITLE_UNIT;
+            }
+            if (l == 0 && book->gen_count > 0 && book->gen_count <= MAX_GENRES)
+            {
+                book->genre[0] = (char *)library->free_genres[book->gen_count];
+                library->free_genres[book->gen_count] = book->genre;
+                library->recycled_bytes += book->gen_count * sizeof(char *);
+            }
+            book->forward[0].next = library->free_books[book->level];
+            library->free_books[book->level] = book;
+            library->recycled_bytes += sizeof(Book) + (book->level + 1) * sizeof(struct BookLink);
+        }
+        lists[l]->count = kept;
+    }
+    int kept = 0;
+    for (int i = 0; i < library->retired_entries.count; i++)
+    {
+        if (library->retired_entries.nodes[i].epoch >= oldest)
+        {
+            library->retired_entries.nodes[kept++] = library->retired_entries.nodes[i];
+            continue;
+        }
+        ShelfEntry *entry = (ShelfEntry *)library->retired_entries.nodes[i].node;
+        entry->forward[0].next = library->free_entries[entry->level];
+        library->free_entries[entry->level] = entry;
+        library->recycled_bytes += sizeof(ShelfEntry) + (entry->level + 1) * sizeof(struct ShelfLink);
+    }
+    library->retired_entries.count = kept;
+    pthread_mutex_unlock(&library->write_lock);
+}
+
+// Function to return the level of the book at a position of a perfectly balanced skip list,
+// where every second book reaches level 1, every fourth level 2 and so on
+int balanced_level(int rank)
+{
+    int level = __builtin_ctz(rank);
+    return level < MAX_LEVEL - 1 ? level : MAX_LEVEL - 1;
+}
+
+// Function to follow a book to the node rebuild_levels moved it to, the book itself if it stayed
+Book *book_current(Library *library, Book *book)
+{
+    BookColumns *columns = book_columns(library, book->id);
+    Book *current = columns ? library->id_pages[book->id / BOOK_ID_PAGE_SIZE][book->id % BOOK_ID_PAGE_SIZE] : NULL;
+    return current ? current : book;
+}
+
+// Function to follow a book a desk still holds to the node it lives on now, through every rebuild
+// that moved it since, NULL if the book was removed. The caller holds a lock that keeps books from moving.
+Book *book_live(Library *library, Book *book)
+{
+    while (book != NULL && book->status == STATUS_MOVED)
+    {
+        Book *current = book_current(library, book);
+        book = current != book ? current : NULL;
+    }
+    return book;
+}
+
+// Function to give every book and shelf entry the level of its position in a perfectly balanced
+// skip list, for after heavy weeding and acquisition. Random levels keep walks O(log n) on average,
+// balanced ones also bound the longest walk. A node whose level changes is replaced by one of the
+// right size, every index is moved over to it, and the old node waits for library_reclaim.
+// Searches keep running meanwhile: every link, old or new, leads on in title order to a node that has
+// a link at that level, and old nodes keep their links until no read section can reach them. Positions
+// read through the spans may be off while the relink runs. Prints what moved to report unless it is NULL.
+void rebuild_levels(Library *library, FILE *report)
+{
+    double started = monotonic_seconds();
+    pthread_mutex_lock(&library->write_lock);
+    pthread_rwlock_wrlock(&library->decay_lock);
+    Book **books = (Book **)malloc((library->total_books + 1) * sizeof(Book *));
+    int count = 0;
+    for (Book *book = library->header->forward[0].next; book != NULL; book = book->forward[0].next)
+    {
+        books[count++] = book;
+    }
+
+    // Loans point back at their books, and the wheel lock keeps returns off the statuses meanwhile
+    int moved = 0;
+    pthread_mutex_lock(&library->loans.lock);
+    for (int rank = 1; rank <= count; rank++)
+    {
+        Book *book = books[rank - 1];
+        int level = balanced_level(rank);
+        if (level == book->level || book_columns(library, book->id) == NULL)
+        {
+            continue; // Books past the id table keep their nodes, as nothing could lead to new ones
+        }
+        Book *fresh = library_book_node(library, level);
+        memcpy(fresh, book, sizeof(Book));
+        fresh->level = level;
+        // Until the relink, the new node leads where the old one did. Links above the old level end
+        // the list, so a search standing on it drops to a level whose next node reaches as high.
+        for (int i = 0; i <= level; i++)
+        {
+            fresh->forward[i].next = i <= book->level ? book->forward[i].next : NULL;
+            fresh->forward[i].span = i <= book->level ? book->forward[i].span : 0;
+        }
+        if (fresh->loan)
+        {
+            fresh->loan->book = fresh;
+        }
+        pthread_mutex_t *lock = &library->co_borrow_locks[book->id % CO_BORROW_LOCKS];
+        pthread_mutex_lock(lock);
+        book->co_borrows = NULL;
+        pthread_mutex_unlock(lock);
+        book->status = STATUS_MOVED;
+        library->id_pages[book->id / BOOK_ID_PAGE_SIZE][book->id % BOOK_ID_PAGE_SIZE] = fresh;
+        retire_node(&library->moved_books, book);
+        books[rank - 1] = fresh;
+        moved++;
+    }
+    pthread_mutex_unlock(&library->loans.lock);
+    library_relink(library, books, count);
+
+    // The id table now leads to every moved book, which the other indexes follow
+    if (moved > 0)
+    {
+        pthread_rwlock_wrlock(&library->titles.lock);
+        for (int slot = 0; slot < library->titles.capacity; slot++)
+        {
+            if (library->titles.slots[slot].book)
+            {
+                library->titles.slots[slot].book = book_current(library, library->titles.slots[slot].book);
+            }
+        }
+        pthread_rwlock_unlock(&library->titles.lock);
+        pthread_rwlock_wrlock(&library->authors.lock);
+        for (int a = 0; a < library->authors.count; a++)
+        {
+            Author *author = library->authors.by_id[a];
+            for (int i = 0; i < author->count; i++)
+            {
+                author->books[i] = book_current(library, author->books[i]);
+            }
+        }
+        pthread_rwlock_unlock(&library->authors.lock);
+        pthread_rwlock_wrlock(&library->trigrams.lock);
+        for (int slot = 0; slot < library->trigrams.capacity; slot++)
+        {
+            TrigramPosting *posting = &library->trigrams.slots[slot];
+            for (int i = 0; i < posting->count; i++)
+            {
+                posting->books[i] = book_current(library, posting->books[i]);
+            }
+        }
+        pthread_rwlock_unlock(&library->trigrams.lock);
+    }
+
+    long entry_count = 0, entries_moved = 0;
+    for (GenreShelf *shelf = library->shelves; shelf != NULL; shelf = shelf->next)
+    {
+        ShelfEntry **entries = (ShelfEntry **)malloc((shelf->count + 1) * sizeof(ShelfEntry *));
+        int shelf_count = 0;
+        for (ShelfEntry *entry = shelf->head->forward[0].next; entry != NULL; entry = entry->forward[0].next)
+        {
+            int level = balanced_level(shelf_count + 1);
+            ShelfEntry *kept = entry;
+            if (level != entry->level)
+            {
+                kept = library_shelf_entry(library, level);
+                kept->level = level;
+                for (int i = 0; i <= level; i++)
+                {
+                    kept->forward[i].next = i <= entry->level ? entry->forward[i].next : NULL;
+                    kept->forward[i].span = i <= entry->level ? entry->forward[i].span : 0;
+                }
+                retire_node(&library->retired_entries, entry);
+                entries_moved++;
+            }
+            kept->book = book_current(library, entry->book);
+            entries[shelf_count++] = kept;
+        }
+        shelf_relink(shelf, entries, shelf_count);
+        entry_count += shelf_count;
+        free(entries);
+
+        pthread_mutex_lock(&shelf->top_lock);
+        for (int i = 0; i < shelf->top_count; i++)
+        {
+            shelf->top[i] = book_current(library, shelf->top[i]);
+        }
+        pthread_mutex_unlock(&shelf->top_lock);
+    }
+    free(books);
+    pthread_rwlock_unlock(&library->decay_lock);
+    pthread_mutex_unlock(&library->write_lock);
+    if (report)
+    {
+        fprintf(report, "Levels rebuilt: %d of %d books and %ld of %ld shelf entries moved in %.3f s\n", moved, count,
+                entries_moved, entry_count, monotonic_seconds() - started);
+    }
+}
+
+// Function to return the bit of a genre in book masks, 0 for genres past GENRE_MASK_BITS
+uint64_t shelf_mask(const GenreShelf *shelf)
+{
+    return shelf->id < GENRE_MASK_BITS ? 1ULL << shelf->id : 0;
+}
+
+// Function to check whether a book is on a shelf, with one bit test for genres that have a bit
+int book_on_shelf(const Book *book, const GenreShelf *shelf)
+{
+    uint64_t mask = shelf_mask(shelf);
+    if (mask)
+    {
+        return (book->genre_mask & mask) != 0;
+    }
+    for (int i = 0; i < book->gen_count; i++)
+    {
+        if (book->genre[i] == shelf->genre)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to find the shelf of one of a book's genres. The book's genre bits lead straight to
+// its shelves, and only genres without a bit fall back to the search by name.
+GenreShelf *book_genre_shelf(Library *library, const Book *book, const char *genre)
+{
+    for (uint64_t bits = book->genre_mask; bits != 0; bits &= bits - 1)
+    {
+        GenreShelf *shelf = library->mask_shelves[__builtin_ctzll(bits)];
+        if (shelf->genre == genre)
+        {
+            return shelf;
+        }
+    }
+    return find_genre_shelf(library, genre);
+}
+
+// Function to find the side table page that holds a book id, NULL if there is none
+BookColumns *book_columns(Library *library, int id)
+{
+    if (id <= 0 || id >= BOOK_ID_PAGE_SIZE * BOOK_ID_PAGES)
+    {
+        return NULL;
+    }
+    return library->column_pages[id / BOOK_ID_PAGE_SIZE];
+}
+
+// Function to bring the availability bit of a book's mask in line with its status after a borrow or return.
+// The status is checked again after the write, so a desk that raced with another one never leaves a stale bit.
+void book_mask_sync(Library *library, Book *book)
+{
+    BookColumns *columns = book_columns(library, book->id);
+    if (columns == NULL)
+    {
+        return;
+    }
+    _Atomic uint64_t *mask = &columns->mask[book->id % BOOK_ID_PAGE_SIZE];
+    const char *status;
+    do
+    {
+        status = book->status;
+        if (status == STATUS_AVAILABLE)
+        {
+            atomic_fetch_or(mask, BOOK_MASK_AVAILABLE);
+        }
+        else
+        {
+            atomic_fetch_and(mask, ~BOOK_MASK_AVAILABLE);
+        }
+    } while (book->status != status);
+}
+
+// Function to start a query that matches every book, or every available book
+void genre_query_init(GenreQuery *query, int available_only)
+{
+    query->all = BOOK_MASK_LISTED | (available_only ? BOOK_MASK_AVAILABLE : 0);
+    query->none = 0;
+    query->any = 0;
+    query->any_named = 0;
+    query->impossible = 0;
+}
+
+// Function to add a genre to a query: kind '=' means the book must have it, '-' that it must not,
+// and '+' that it must have at least one of the '+' genres. Returns 0 if the genre has no bit.
+int genre_query_add(Library *library, GenreQuery *query, const char *genre, char kind)
+{
+    GenreShelf *shelf = find_genre_shelf(library, genre);
+    uint64_t mask = shelf ? shelf_mask(shelf) : 0;
+    if (shelf != NULL && mask == 0)
+    {
+        return 0;
+    }
+    if (kind == '=')
+    {
+        query->all |= mask;
+        query->impossible |= shelf == NULL; // No book has the genre
+    }
+    else if (kind == '-')
+    {
+        query->none |= mask;
+    }
+    else
+    {
+        query->any |= mask;
+        query->any_named++;
+    }
+    return 1;
+}
+
+// Function to test one book's mask against a query
+int genre_match(uint64_t mask, const GenreQuery *query)
+{
+    return (mask & query->all) == query->all && (mask & query->none) == 0 && (query->any == 0 || (mask & query->any) != 0);
+}
+
+// Function to test masks one at a time, the portable kernel
+int genre_scan_scalar(const uint64_t *masks, int count, const GenreQuery *query, int *matches)
+{
+    int found = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (genre_match(masks[i], query))
+        {
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+
+// Function to find the matching books that score above threshold one at a time, the portable kernel
+int popularity_scan_scalar(const uint64_t *masks, const double *scores, int count, const GenreQuery *query, double threshold, int *matches)
+{
+    int found = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (scores[i] > threshold && genre_match(masks[i], query))
+        {
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+
+// Function to multiply count scores by factor one at a time, the portable kernel
+void score_scale_scalar(double *scores, int count, double factor)
+{
+    for (int i = 0; i < count; i++)
+    {
+        scores[i] *= factor;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Function to test two masks against a query with SSE2, all ones in each 64-bit lane that matches.
+// SSE2 compares 32-bit lanes only, so a 64-bit lane is zero when both of its halves are.
+static inline __m128i genre_match_sse2(__m128i mask, const GenreQuery *query)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i has_all = _mm_cmpeq_epi32(_mm_andnot_si128(mask, _mm_set1_epi64x(query->all)), zero);
+    __m128i has_none = _mm_cmpeq_epi32(_mm_and_si128(mask, _mm_set1_epi64x(query->none)), zero);
+    __m128i match = _mm_and_si128(has_all, has_none);
+    if (query->any != 0)
+    {
+        __m128i lacking = _mm_cmpeq_epi32(_mm_and_si128(mask, _mm_set1_epi64x(query->any)), zero);
+        lacking = _mm_and_si128(lacking, _mm_shuffle_epi32(lacking, _MM_SHUFFLE(2, 3, 0, 1)));
+        match = _mm_andnot_si128(lacking, match);
+    }
+    return _mm_and_si128(match, _mm_shuffle_epi32(match, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+// Function to test four masks against a query with AVX2, all ones in each 64-bit lane that matches
+__attribute__((target("avx2"))) static inline __m256i genre_match_avx2(__m256i mask, const GenreQuery *query)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i match = _mm256_and_si256(_mm256_cmpeq_epi64(_mm256_andnot_si256(mask, _mm256_set1_epi64x(query->all)), zero),
+                                     _mm256_cmpeq_epi64(_mm256_and_si256(mask, _mm256_set1_epi64x(query->none)), zero));
+    if (query->any != 0)
+    {
+        match = _mm256_andnot_si256(_mm256_cmpeq_epi64(_mm256_and_si256(mask, _mm256_set1_epi64x(query->any)), zero), match);
+    }
+    return match;
+}
+
+// Function to test two masks per instruction with SSE2
+int genre_scan_sse2(const uint64_t *masks, int count, const GenreQuery *query, int *matches)
+{
+    int found = 0;
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128i match = genre_match_sse2(_mm_loadu_si128((const __m128i *)(masks + i)), query);
+        for (int bits = _mm_movemask_pd(_mm_castsi128_pd(match)); bits != 0; bits &= bits - 1)
+        {
+            matches[found++] = i + __builtin_ctz(bits);
+        }
+    }
+    for (; i < count; i++)
+    {
+        if (genre_match(masks[i], query))
+        {
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+
+// Function to test four masks per instruction with AVX2
+__attribute__((target("avx2"))) int genre_scan_avx2(const uint64_t *masks, int count, const GenreQuery *query, int *matches)
+{
+    int found = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i match = genre_match_avx2(_mm256_loadu_si256((const __m256i *)(masks + i)), query);
+        for (int bits = _mm256_movemask_pd(_mm256_castsi256_pd(match)); bits != 0; bits &= bits - 1)
+        {
+            matches[found++] = i + __builtin_ctz(bits);
+        }
+    }
+    for (; i < count; i++)
+    {
+        if (genre_match(masks[i], query))
+        {
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+
+// Function to find the matching books that score above threshold, two per instruction with SSE2
+int popularity_scan_sse2(const uint64_t *masks, const double *scores, int count, const GenreQuery *query, double threshold, int *matches)
+{
+    const __m128d floor = _mm_set1_pd(threshold);
+    int found = 0;
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        // The score test is the most selective once the top list is full, so it goes first
+        int bits = _mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(scores + i), floor));
+        if (bits == 0)
+        {
+            continue;
+        }
+        bits &= _mm_movemask_pd(_mm_castsi128_pd(genre_match_sse2(_mm_loadu_si128((const __m128i *)(masks + i)), query)));
+        for (; bits != 0; bits &= bits - 1)
+        {
+            matches[found++] = i + __builtin_ctz(bits);
+        }
+    }
+    for (; i < count; i++)
+    {
+        if (scores[i] > threshold && genre_match(masks[i], query))
+        {
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+
+// Function to find the matching books that score above threshold, four per instruction with AVX2
+__attribute__((target("avx2"))) int popularity_scan_avx2(const uint64_t *masks, const double *scores, int count, const GenreQuery *query, double threshold, int *matches)
+{
+    const __m256d floor = _mm256_set1_pd(threshold);
+    int found = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        int bits = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(scores + i), floor, _CMP_GT_OQ));
+        if (bits == 0)
+        {
+            continue;
+        }
+        bits &= _mm256_movemask_pd(_mm256_castsi256_pd(genre_match_avx2(_mm256_loadu_si256((const __m256i *)(masks + i)), query)));
+        for (; bits != 0; bits &= bits - 1)
+        {
+            matches[found++] = i + __builtin_ctz(bits);
+        }
+    }
+    for (; i < count; i++)
+    {
+        if (scores[i] > threshold && genre_match(masks[i], query))
+        {
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+
+// Function to multiply count scores by factor, two per instruction with SSE2
+void score_scale_sse2(double *scores, int count, double factor)
+{
+    const __m128d by = _mm_set1_pd(factor);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        _mm_storeu_pd(scores + i, _mm_mul_pd(_mm_loadu_pd(scores + i), by));
+    }
+    score_scale_scalar(scores + i, count - i, factor);
+}
+
+// Function to multiply count scores by factor, four per instruction with AVX2
+__attribute__((target("avx2"))) void score_scale_avx2(double *scores, int count, double factor)
+{
+    const __m256d by = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm256_storeu_pd(scores + i, _mm256_mul_pd(_mm256_loadu_pd(scores + i), by));
+    }
+    score_scale_scalar(scores + i, count - i, factor);
+}
+#endif
+
+// Function to return the widest instruction set the processor runs, one of the SIMD_ levels, and name it
+int simd_level(const char **name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        *name = "avx2";
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        *name = "sse2";
+        return SIMD_SSE2;
+    }
+#endif
+    *name = "scalar";
+    return SIMD_SCALAR;
+}
+
+// Function to pick the widest genre scan kernel the processor runs, and name it
+GenreScan genre_scan_best(const char **name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    GenreScan kernels[] = {genre_scan_scalar, genre_scan_sse2, genre_scan_avx2};
+    return kernels[simd_level(name)];
+#else
+    simd_level(name);
+    return genre_scan_scalar;
+#endif
+}
+
+// Function to pick the widest popularity scan kernel the processor runs, and name it
+PopularityScan popularity_scan_best(const char **name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    PopularityScan kernels[] = {popularity_scan_scalar, popularity_scan_sse2, popularity_scan_avx2};
+    return kernels[simd_level(name)];
+#else
+    simd_level(name);
+    return popularity_scan_scalar;
+#endif
+}
+
+// Function to pick the widest score scaling kernel the processor runs
+ScoreScale score_scale_best()
+{
+    const char *name;
+#if defined(__x86_64__) || defined(__i386__)
+    ScoreScale kernels[] = {score_scale_scalar, score_scale_sse2, score_scale_avx2};
+    return kernels[simd_level(&name)];
+#else
+    simd_level(&name);
+    return score_scale_scalar;
+#endif
+}
+
+// Function to choose how many threads a scan of items books or ids runs on
+int scan_thread_count(long items)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    long threads = items / SCAN_MIN_ITEMS_PER_THREAD + 1;
+    if (threads > cores)
+    {
+        threads = cores > 0 ? cores : 1;
+    }
+    return threads < SCAN_MAX_THREADS ? (int)threads : SCAN_MAX_THREADS;
+}
+
+// Function to cut the library into up to part_count title ranges of about equal size, returns the number of ranges.
+// The cuts are books of the highest level that still has several books per range, found by walking that
+// level alone, and its spans tell how many books lie between them.
+int scan_partition_titles(Library *library, ScanPart *parts, int part_count)
+{
+    int total = library->total_books;
+    int level = library->level;
+    while (level > 0 && (total >> level) < part_count * SCAN_CUTS_PER_PART)
+    {
+        level--;
+    }
+    parts[0].first = library->header->forward[0].next;
+    int made = 1;
+    int position = 0;
+    Book *current = library->header;
+    while (made < part_count && current->forward[level].next != NULL)
+    {
+        position += current->forward[level].span;
+        current = current->forward[level].next;
+        // current is the book at 1-based position, the range it starts must hold a fair share
+        if ((long)(position - 1) * part_count >= (long)total * made)
+        {
+            parts[made - 1].end = current;
+            parts[made++].first = current;
+        }
+    }
+    parts[made - 1].end = NULL;
+    return made;
+}
+
+// Function to cut the side table pages of ids below id_count into up to part_count ranges, returns the number of ranges
+int scan_partition_pages(ScanPart *parts, int part_count, int id_count)
+{
+    int pages = (id_count + BOOK_ID_PAGE_SIZE - 1) / BOOK_ID_PAGE_SIZE;
+    pages = pages < BOOK_ID_PAGES ? pages : BOOK_ID_PAGES;
+    part_count = part_count < pages ? part_count : (pages > 0 ? pages : 1);
+    for (int p = 0; p < part_count; p++)
+    {
+        parts[p].first_page = (int)((long)pages * p / part_count);
+        parts[p].end_page = (int)((long)pages * (p + 1) / part_count);
+    }
+    return part_count;
+}
+
+// Function run by each scan thread
+void *scan_worker(void *arg)
+{
+    ScanPart *part = (ScanPart *)arg;
+    part->task(part);
+    return NULL;
+}
+
+// Function to run a task over parts, one thread per part, the first part on the calling thread
+void scan_run(Library *library, ScanPart *parts, int part_count, void (*task)(ScanPart *part), const void *context)
+{
+    pthread_t threads[SCAN_MAX_THREADS];
+    for (int p = 0; p < part_count; p++)
+    {
+        parts[p].library = library;
+        parts[p].task = task;
+        parts[p].context = context;
+        parts[p].found = 0;
+        parts[p].matched = 0;
+    }
+    for (int p = 1; p < part_count; p++)
+    {
+        pthread_create(&threads[p], NULL, scan_worker, &parts[p]);
+    }
+    task(&parts[0]);
+    for (int p = 1; p < part_count; p++)
+    {
+        pthread_join(threads[p], NULL);
+    }
+}
+
+// Function to count the ids of a page a column scan covers
+int column_scan_count(const ColumnScan *scan, int page)
+{
+    int count = scan->id_count - page * BOOK_ID_PAGE_SIZE;
+    return count < BOOK_ID_PAGE_SIZE ? count : BOOK_ID_PAGE_SIZE;
+}
+
+// Function to scan one part's pages for a genre query, keeping its first limit matches
+void genre_query_part(ScanPart *part)
+{
+    const ColumnScan *scan = (const ColumnScan *)part->context;
+    int *matches = (int *)malloc(BOOK_ID_PAGE_SIZE * sizeof(int));
+    for (int page = part->first_page; page < part->end_page; page++)
+    {
+        // Masks are written with atomic stores, the scan reads them as plain words
+        BookColumns *columns = part->library->column_pages[page];
+        if (columns == NULL)
+        {
+            continue;
+        }
+        int hits = scan->genre_scan((const uint64_t *)columns->mask, column_scan_count(scan, page), scan->query, matches);
+        for (int k = 0; k < hits && part->found < scan->limit; k++)
+        {
+            // A book removed during the scan may still match
+            Book *book = part->library->id_pages[page][matches[k]];
+            if (book != NULL)
+            {
+                part->books[part->found++] = book;
+            }
+        }
+        part->matched += hits;
+    }
+    free(matches);
+}
+
+// Function to find the books matching a genre query in id order, returns the number of matches.
+// The first limit of them go to results. scan may be NULL for the fastest kernel.
+int query_books_by_genres(Library *library, const GenreQuery *query, GenreScan scan, Book **results, int limit)
+{
+    METRIC_START(timer);
+    if (query->impossible || (query->any_named > 0 && query->any == 0))
+    {
+        METRIC_STOP(METRIC_GENRE_QUERY, timer);
+        return 0;
+    }
+    const char *name;
+    ColumnScan context = {query, scan ? scan : genre_scan_best(&name), NULL, NULL, 0, limit, library->next_book_id};
+    ScanPart parts[SCAN_MAX_THREADS];
+    int part_count = scan_partition_pages(parts, scan_thread_count(context.id_count), context.id_count);
+    for (int p = 0; p < part_count; p++)
+    {
+        parts[p].books = (Book **)malloc((limit + 1) * sizeof(Book *));
+    }
+    scan_run(library, parts, part_count, genre_query_part, &context);
+
+    // Parts cover increasing ids, so their matches are joined in part order
+    int found = 0;
+    for (int p = 0; p < part_count; p++)
+    {
+        for (int k = 0; k < parts[p].found && found + k < limit; k++)
+        {
+            results[found + k] = parts[p].books[k];
+        }
+        found += parts[p].matched;
+        free(parts[p].books);
+    }
+    METRIC_STOP(METRIC_GENRE_QUERY, timer);
+    return found;
+}
+
+// Function to read a query such as "Fantasy,Adventure,-Horror,+Mystery,+Romance,available".
+// Plain genres are required, '-' excludes a genre, the '+' genres need at least one match and
+// "available" skips borrowed books. Returns 0 and says why if the query cannot be run.
+int parse_genre_query(Library *library, char *spec, GenreQuery *query)
+{
+    genre_query_init(query, 0);
+    char *saved;
+    for (char *token = strtok_r(spec, ",", &saved); token != NULL; token = strtok_r(NULL, ",", &saved))
+    {
+        while (*token == ' ')
+        {
+            token++;
+        }
+        if (strcmp(token, "available") == 0)
+        {
+            query->all |= BOOK_MASK_AVAILABLE;
+            continue;
+        }
+        char kind = (*token == '-' || *token == '+') ? *token++ : '=';
+        if (*token == '\0')
+        {
+            continue;
+        }
+        if (!genre_query_add(library, query, token, kind))
+        {
+            printf("Only the first %d genres can be combined in a query, %s is not one of them.\n", GENRE_MASK_BITS, token);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to print the books matching a genre query
+void print_books_by_genres(Library *library, char *spec)
+{
+    GenreQuery query;
+    if (!parse_genre_query(library, spec, &query))
+    {
+        return;
+    }
+    Book *results[GENRE_QUERY_LIMIT];
+    int count = query_books_by_genres(library, &query, NULL, results, GENRE_QUERY_LIMIT);
+    for (int i = 0; i < count && i < GENRE_QUERY_LIMIT; i++)
+    {
+        printf("ID: %d, Title: %s, Author: %s, Status: %s\n", results[i]->id, results[i]->title, results[i]->author, results[i]->status);
+    }
+    if (count > GENRE_QUERY_LIMIT)
+    {
+        printf("... and %d more.\n", count - GENRE_QUERY_LIMIT);
+    }
+    printf("%d books match.\n", count);
+}
+
+// Function to place a book in a top list ordered by score, returns the new number of books in it.
+// Books tied with one already listed go after it.
+int top_list_insert(Book **books, double *scores, int found, int limit, Book *book, double score)
+{
+    if (found == limit && score <= scores[limit - 1])
+    {
+        return found;
+    }
+    int index = found < limit ? found++ : limit - 1;
+    while (index > 0 && scores[index - 1] < score)
+    {
+        scores[index] = scores[index - 1];
+        books[index] = books[index - 1];
+        index--;
+    }
+    scores[index] = score;
+    books[index] = book;
+    return found;
+}
+
+// Function to find one part's most popular matching books
+void top_books_part(ScanPart *part)
+{
+    const ColumnScan *scan = (const ColumnScan *)part->context;
+    int *matches = (int *)malloc(POPULARITY_BLOCK * sizeof(int));
+    double threshold = -1; // Scores are never negative
+    for (int page = part->first_page; page < part->end_page; page++)
+    {
+        BookColumns *columns = part->library->column_pages[page];
+        if (columns == NULL)
+        {
+            continue;
+        }
+        int count = column_scan_count(scan, page);
+        const uint64_t *masks = (const uint64_t *)columns->mask;
+        // The kernels read both columns with plain vector loads, like genre scans read the masks.
+        // A score that changes meanwhile only decides whether the book is a candidate, and it is
+        // loaded again before it is ranked.
+        const double *scores = (const double *)columns->score;
+        // Blocks are short so the threshold rises soon and most books are rejected by one compare
+        for (int start = 0; start < count; start += POPULARITY_BLOCK)
+        {
+            int block = count - start < POPULARITY_BLOCK ? count - start : POPULARITY_BLOCK;
+            int hits = scan->popularity_scan(masks + start, scores + start, block, scan->query, threshold, matches);
+            for (int k = 0; k < hits; k++)
+            {
+                int slot = start + matches[k];
+                Book *book = part->library->id_pages[page][slot];
+                if (book != NULL)
+                {
+                    part->found = top_list_insert(part->books, part->scores, part->found, scan->limit, book,
+                                                  atomic_load_explicit(&columns->score[slot], memory_order_relaxed));
+                }
+            }
+            if (part->found == scan->limit)
+            {
+                threshold = part->scores[scan->limit - 1];
+            }
+        }
+    }
+    free(matches);
+}
+
+// Function to find the limit most popular books matching a genre query, most popular first,
+// returns how many were found. Each thread keeps the top list of its own pages, reading only the
+// side table until a book makes the list, and the lists are merged at the end.
+// scan may be NULL for the fastest kernel.
+int top_books_by_genres(Library *library, const GenreQuery *query, PopularityScan scan, Book **results, int limit)
+{
+    METRIC_START(timer);
+    if (query->impossible || (query->any_named > 0 && query->any == 0) || limit <= 0)
+    {
+        METRIC_STOP(METRIC_TOP_BOOKS, timer);
+        return 0;
+    }
+    const char *name;
+    ColumnScan context = {query, NULL, scan ? scan : popularity_scan_best(&name), NULL, 0, limit, library->next_book_id};
+    ScanPart parts[SCAN_MAX_THREADS];
+    int part_count = scan_partition_pages(parts, scan_thread_count(context.id_count), context.id_count);
+    for (int p = 0; p < part_count; p++)
+    {
+        parts[p].books = (Book **)malloc(limit * sizeof(Book *));
+        parts[p].scores = (double *)malloc(limit * sizeof(double));
+    }
+    scan_run(library, parts, part_count, top_books_part, &context);
+
+    // Merging in part order keeps the lower id first among tied books, as one thread would
+    double *scores = (double *)malloc(limit * sizeof(double));
+    int found = 0;
+    for (int p = 0; p < part_count; p++)
+    {
+        for (int k = 0; k < parts[p].found; k++)
+        {
+            found = top_list_insert(results, scores, found, limit, parts[p].books[k], parts[p].scores[k]);
+        }
+        free(parts[p].books);
+        free(parts[p].scores);
+    }
+    free(scores);
+    METRIC_STOP(METRIC_TOP_BOOKS, timer);
+    return found;
+}
+
+// Function to print the limit most popular books matching a genre query, or of the whole library when spec is empty
+void print_top_books(Library *library, int limit, char *spec)
+{
+    GenreQuery query;
+    if (!parse_genre_query(library, spec, &query))
+    {
+        return;
+    }
+    limit = limit > 0 && limit < POPULARITY_LIMIT ? limit : POPULARITY_LIMIT;
+    Book *results[POPULARITY_LIMIT];
+    int found = top_books_by_genres(library, &query, NULL, results, limit);
+    for (int i = 0; i < found; i++)
+    {
+        printf("ID: %d, Title: %s, Author: %s, Borrow Count: %d, Popularity: %.1f\n", results[i]->id, results[i]->title,
+               results[i]->author, results[i]->borrow_count, book_popularity(library, results[i]));
+    }
+    if (found == 0)
+    {
+        printf("No books match.\n");
+    }
+}
+
+// Function to rescale the scores of one part's pages. The score column is scaled first,
+// and the books copy their new scores from it in id order.
+void rescale_part(ScanPart *part)
+{
+    const ColumnScan *scan = (const ColumnScan *)part->context;
+    for (int page = part->first_page; page < part->end_page; page++)
+    {
+        BookColumns *columns = part->library->column_pages[page];
+        if (columns == NULL)
+        {
+            continue;
+        }
+        int count = column_scan_count(scan, page);
+        scan->scale((double *)columns->score, count, scan->factor);
+        Book *_Atomic *books = part->library->id_pages[page];
+        for (int i = 0; i < count; i++)
+        {
+            if (books[i] != NULL)
+            {
+                books[i]->score = atomic_load_explicit(&columns->score[i], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+// Function to multiply every score by factor, on several threads for large libraries.
+// The caller holds the write lock and the decay lock for writing.
+void rescale_scores(Library *library, double factor)
+{
+    ColumnScan context = {NULL, NULL, NULL, score_scale_best(), factor, 0, library->next_book_id};
+    ScanPart parts[SCAN_MAX_THREADS];
+    int part_count = scan_partition_pages(parts, scan_thread_count(context.id_count), context.id_count);
+    scan_run(library, parts, part_count, rescale_part, &context);
+}
+
+// Function to return the score one borrow adds at a given time.
+// Scores are kept relative to the decay epoch, so a newer borrow weighs 1 / DECAY_RATE more per
+// period than an older one and every book decays at the same rate without being touched.
+double borrow_weight(Library *library, time_t now)
+{
+    // Cached per thread, borrows arrive in bursts within the same second
+    static _Thread_local time_t weight_time = -1;
+    static _Thread_local time_t weight_epoch;
+    static _Thread_local double weight;
+    if (now != weight_time || library->decay_epoch != weight_epoch)
+    {
+        weight = pow(DECAY_RATE, -difftime(now, library->decay_epoch) / DECAY_PERIOD);
+        weight_time = now;
+        weight_epoch = library->decay_epoch;
+    }
+    return weight;
+}
+
+// Function to compute the decayed popularity of a book right now
+double book_popularity(Library *library, const Book *book)
+{
+    return book->score / borrow_weight(library, library_now(library));
+}
+
+// Function to decay borrow counts over time.
+// Decay is applied lazily through the scores, so this only moves the decay epoch forward
+// once borrow weights grow large enough to threaten precision, which rescales every score.
+void decay_borrow_counts(Library *library)
+{
+    METRIC_START(timer);
+    time_t current_time = library_now(library);
+    double weight = borrow_weight(library, current_time);
+    if (weight >= DECAY_REBASE_LIMIT)
+    {
+        // Every score shrinks by the same factor, so shelf top lists keep their order
+        pthread_mutex_lock(&library->write_lock);
+        pthread_rwlock_wrlock(&library->decay_lock);
+        rescale_scores(library, 1 / weight);
+        library->decay_epoch = current_time;
+        uint64_t sequence = journal_log_decay(library->journal, current_time);
+        pthread_rwlock_unlock(&library->decay_lock);
+        pthread_mutex_unlock(&library->write_lock);
+        journal_commit(library->journal, sequence);
+    }
+    METRIC_STOP(METRIC_DECAY, timer);
+}
+
+// Function to format one part's books. The first part prints straight to stdout, the others
+// into memory, to be printed after it in order.
+void print_books_part(ScanPart *part)
+{
+    FILE *out = part == part->context ? stdout : open_memstream(&part->output, &part->output_size);
+    for (Book *current = part->first; current != part->end; current = current->forward[0].next)
+    {
+        fprintf(out, "ID: %d, Title: %s, Author: %s, Genres: ", current->id, current->title, current->author);
+        for (int j = 0; j < current->gen_count; j++)
+        {                                                                                       // Changed to use gen_count
+            fprintf(out, "%s%s", current->genre[j], (j < current->gen_count - 1) ? ", " : ""); // Use a conditional to manage commas
+        }
+        fprintf(out, ", Borrow Count: %d\n", current->borrow_count);
+    }
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+}
+
+// Function to print all books in the library. Large libraries are cut into title ranges
+// that are formatted on several threads and printed in order.
+void print_books(Library *library)
+{
+    METRIC_START(timer);
+    printf("Books in Library:\n");
+    ScanPart parts[SCAN_MAX_THREADS];
+    int part_count = scan_partition_titles(library, parts, scan_thread_count(library->total_books));
+    for (int p = 0; p < part_count; p++)
+    {
+        parts[p].output = NULL;
+        parts[p].output_size = 0;
+    }
+    scan_run(library, parts, part_count, print_books_part, &parts[0]);
+    for (int p = 1; p < part_count; p++)
+    {
+        fwrite(parts[p].output, 1, parts[p].output_size, stdout);
+        free(parts[p].output);
+    }
+    METRIC_STOP(METRIC_PRINT_BOOKS, timer);
+}
+
+// Function to start a cursor over the library in title order. Without a key it starts at the
+// first book, otherwise just after the book the key names: the book with id after_id if it still
+// has that title, or else the last book titled after. Only books whose side table mask matches
+// query are returned, every book when query is NULL.
+void book_cursor_open(Library *library, BookCursor *cursor, const char *after, int after_id, const GenreQuery *query)
+{
+    cursor->library = library;
+    cursor->query = query;
+    cursor->next = library->header->forward[0].next;
+    cursor->last = NULL;
+    if (query != NULL && (query->impossible || (query->any_named > 0 && query->any == 0)))
+    {
+        cursor->next = NULL;
+    }
+    else if (after != NULL)
+    {
+        // An id resumes exactly, even among copies with the same title
+        Book *last = after_id ? find_book_by_id(library, after_id) : NULL;
+        if (last != NULL && strcmp(last->title, after) == 0)
+        {
+            cursor->next = last->forward[0].next;
+            return;
+        }
+        Book *book = library_seek(library, after);
+        while (book != NULL && strcmp(book->title, after) == 0)
+        {
+            book = book->forward[0].next;
+        }
+        cursor->next = book;
+    }
+}
+
+// Function to fetch up to limit more books from a cursor, returns how many it found.
+// Like print_books it takes no lock, so books added meanwhile may or may not be seen.
+int book_cursor_next(BookCursor *cursor, Book **books, int limit)
+{
+    int found = 0;
+    Book *book = cursor->next;
+    for (; book != NULL && found < limit; book = book->forward[0].next)
+    {
+        if (cursor->query != NULL)
+        {
+            BookColumns *columns = book_columns(cursor->library, book->id);
+            if (columns == NULL || !genre_match(columns->mask[book->id % BOOK_ID_PAGE_SIZE], cursor->query))
+            {
+                continue;
+            }
+        }
+        books[found++] = book;
+        cursor->last = book;
+    }
+    cursor->next = book;
+    return found;
+}
+
+// Function to write what an export buffer holds to its file
+void export_flush(ExportBuffer *out)
+{
+    if (out->used > 0 && fwrite(out->data, 1, out->used, out->file) != out->used)
+    {
+        out->failed = 1;
+    }
+    out->used = 0;
+}
+
+// Function to copy a string into an export row, returns the end of the row
+char *export_text(char *at, const char *text)
+{
+    size_t length = strlen(text);
+    memcpy(at, text, length);
+    return at + length;
+}
+
+// Function to write a string into an export row as a JSON string, returns the end of the row
+char *export_json_text(char *at, const char *text)
+{
+    *at++ = '"';
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            *at++ = '\\';
+            *at++ = *c;
+        }
+        else if (*c < 0x20)
+        {
+            at += sprintf(at, "\\u%04x", *c);
+        }
+        else
+        {
+            *at++ = *c;
+        }
+    }
+    *at++ = '"';
+    return at;
+}
+
+// Function to write a number into an export row, returns the end of the row
+char *export_number(char *at, long value)
+{
+    char digits[24];
+    int count = 0;
+    unsigned long rest = value < 0 ? -(unsigned long)value : (unsigned long)value;
+    do
+    {
+        digits[count++] = '0' + rest % 10;
+        rest /= 10;
+    } while (rest != 0);
+    if (value < 0)
+    {
+        *at++ = '-';
+    }
+    while (count > 0)
+    {
+        *at++ = digits[--count];
+    }
+    return at;
+}
+
+// Function to add one book to an export as a CSV row, title,author,genres...,borrow count
+// as catalogue files are read, or as a JSON line under the given id
+void export_book(ExportBuffer *out, const Book *book, int id, int format)
+{
+    // Room for every string escaped at its longest, so the row is written without further checks
+    size_t size = 6 * (strlen(book->title) + strlen(book->author)) + 128;
+    for (int i = 0; i < book->gen_count; i++)
+    {
+        size += 6 * strlen(book->genre[i]) + 4;
+    }
+    if (out->used + size > EXPORT_BUFFER)
+    {
+        export_flush(out);
+    }
+    char *at = out->data + out->used;
+    if (format == EXPORT_CSV)
+    {
+        at = export_text(at, book->title);
+        *at++ = ',';
+        at = export_text(at, book->author);
+        for (int i = 0; i < book->gen_count; i++)
+        {
+            *at++ = ',';
+            at = export_text(at, book->genre[i]);
+        }
+        *at++ = ',';
+        at = export_number(at, book->borrow_count);
+    }
+    else
+    {
+        at = export_number(export_text(at, "{\"id\":"), id);
+        at = export_json_text(export_text(at, ",\"title\":"), book->title);
+        at = export_json_text(export_text(at, ",\"author\":"), book->author);
+        at = export_text(at, ",\"genres\":[");
+        for (int i = 0; i < book->gen_count; i++)
+        {
+            at = export_json_text(i > 0 ? export_text(at, ",") : at, book->genre[i]);
+        }
+        at = export_number(export_text(at, "],\"borrow_count\":"), book->borrow_count);
+        at = export_json_text(export_text(at, ",\"status\":"), book->status);
+        *at++ = '}';
+    }
+    *at++ = '\n';
+    out->used = at - out->data;
+}
+
+// Function to stream up to limit books of a cursor to a file, every remaining one when limit is 0.
+// Books are fetched a page at a time and written in large blocks, so memory stays the same whatever
+// the size of the catalogue. Returns the number of books written, or -1 if writing failed.
+long export_books(BookCursor *cursor, FILE *file, int format, long limit)
+{
+    METRIC_START(timer);
+    ExportBuffer out = {file, (char *)malloc(EXPORT_BUFFER), 0, 0};
+    Book *page[EXPORT_PAGE];
+    long written = 0;
+    while (limit == 0 || written < limit)
+    {
+        long wanted = limit == 0 || limit - written > EXPORT_PAGE ? EXPORT_PAGE : limit - written;
+        int found = book_cursor_next(cursor, page, (int)wanted);
+        for (int i = 0; i < found; i++)
+        {
+            // Titles and authors lie wherever the books were loaded, so they are fetched a few books ahead
+            if (i + 8 < found)
+            {
+                __builtin_prefetch(page[i + 8]->title);
+                __builtin_prefetch(page[i + 8]->author);
+            }
+            export_book(&out, page[i], page[i]->id, format);
+        }
+        written += found;
+        if (found < wanted)
+        {
+            break;
+        }
+    }
+    export_flush(&out);
+    free(out.data);
+    METRIC_STOP(METRIC_EXPORT, timer);
+    return out.failed ? -1 : written;
+}
+
+// Function to export the books matching a genre query, or every book when spec is empty,
+// to a file or to stdout when the file name is "-"
+void export_catalogue(Library *library, const char *filename, int format, char *spec)
+{
+    GenreQuery query;
+    if (spec[0] != '\0' && !parse_genre_query(library, spec, &query))
+    {
+        return;
+    }
+    int to_stdout = strcmp(filename, "-") == 0;
+    FILE *file = to_stdout ? stdout : fopen(filename, "w");
+    if (file == NULL)
+    {
+        printf("Error opening file.\n");
+        return;
+    }
+    double started = monotonic_seconds();
+    BookCursor cursor;
+    book_cursor_open(library, &cursor, NULL, 0, spec[0] != '\0' ? &query : NULL);
+    long written = export_books(&cursor, file, format, 0);
+    if (!to_stdout && fclose(file) != 0)
+    {
+        written = -1;
+    }
+    if (written < 0)
+    {
+        printf("Error writing %s.\n", filename);
+    }
+    else if (!to_stdout)
+    {
+        printf("Exported %ld books to %s in %.3f s.\n", written, filename, monotonic_seconds() - started);
+    }
+}
+
+// Function to print one page of books as JSON lines, starting after a key such as "Dune#17"
+// (a title, optionally followed by '#' and the id of the book with that title), then the key
+// that resumes after the page
+void print_books_page(Library *library, int count, char *key, char *spec)
+{
+    GenreQuery query;
+    if (spec != NULL && spec[0] != '\0' && !parse_genre_query(library, spec, &query))
+    {
+        return;
+    }
+    int after_id = 0;
+    char *mark = key ? strrchr(key, '#') : NULL;
+    if (mark != NULL && (after_id = parse_book_id(mark)) != 0)
+    {
+        *mark = '\0';
+    }
+    BookCursor cursor;
+    book_cursor_open(library, &cursor, key != NULL && key[0] != '\0' ? key : NULL, after_id,
+                     spec != NULL && spec[0] != '\0' ? &query : NULL);
+
+    export_books(&cursor, stdout, EXPORT_JSONL, count);
+    if (cursor.last != NULL && cursor.next != NULL)
+    {
+        printf("Next page: %s#%d\n", cursor.last->title, cursor.last->id);
+    }
+    else
+    {
+        printf("End of catalogue.\n");
+    }
+}
+
+// Function to read the clock metrics are timed with, in nanoseconds
+uint64_t metrics_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// Function to compare a title met during a skip list walk with the one sought, counting the comparison
+int walk_compare(SkipWalk *walk, const char *title, const char *sought)
+{
+    walk->compares++;
+    return strcmp(title, sought);
+}
+
+#if LIBRARY_METRICS
+MetricsBlock *metrics_blocks = NULL; // Every thread's block, kept after the thread ends
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t metrics_key;
+pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+_Thread_local MetricsBlock *thread_metrics = NULL;
+
+// Function to hand an ended thread's block to the next new thread, its counts stay in the totals
+void metrics_release_block(void *block)
+{
+    pthread_mutex_lock(&metrics_lock);
+    ((MetricsBlock *)block)->in_use = 0;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Function to create the key that notices when a thread ends
+void metrics_create_key()
+{
+    pthread_key_create(&metrics_key, metrics_release_block);
+}
+
+// Function to return the calling thread's block, claiming a free one or making one on first use
+MetricsBlock *metrics_block()
+{
+    if (thread_metrics != NULL)
+    {
+        return thread_metrics;
+    }
+    pthread_once(&metrics_key_once, metrics_create_key);
+    pthread_mutex_lock(&metrics_lock);
+    MetricsBlock *block = metrics_blocks;
+    while (block != NULL && block->in_use)
+    {
+        block = block->next;
+    }
+    if (block == NULL)
+    {
+        block = (MetricsBlock *)calloc(1, sizeof(MetricsBlock));
+        block->next = metrics_blocks;
+        metrics_blocks = block;
+    }
+    block->in_use = 1;
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_setspecific(metrics_key, block);
+    thread_metrics = block;
+    return block;
+}
+
+// Function to add to a counter only its own thread writes. A plain load and store is enough,
+// readers only need whole values.
+void metrics_add(_Atomic uint64_t *counter, uint64_t amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Function to record one operation's latency
+void metrics_latency(int operation, uint64_t nanoseconds)
+{
+    OperationMetrics *metrics = &metrics_block()->operations[operation];
+    metrics_add(&metrics->count, 1);
+    metrics_add(&metrics->total_ns, nanoseconds);
+    metrics_add(&metrics->buckets[metrics_bucket(nanoseconds)], 1);
+    if (nanoseconds > atomic_load_explicit(&metrics->max_ns, memory_order_relaxed))
+    {
+        atomic_store_explicit(&metrics->max_ns, nanoseconds, memory_order_relaxed);
+    }
+}
+
+// Function to record the hops and comparisons of one skip list walk
+void metrics_walk(int kind, const SkipWalk *walk)
+{
+    WalkMetrics *metrics = &metrics_block()->walks[kind];
+    metrics_add(&metrics->count, 1);
+    metrics_add(&metrics->hops, walk->hops);
+    metrics_add(&metrics->compares, walk->compares);
+    if ((uint64_t)walk->hops > atomic_load_explicit(&metrics->max_hops, memory_order_relaxed))
+    {
+        atomic_store_explicit(&metrics->max_hops, walk->hops, memory_order_relaxed);
+    }
+}
+
+// Function to record one level drawn for a new book
+void metrics_level(int level)
+{
+    metrics_add(&metrics_block()->levels[level], 1);
+}
+#endif
+
+// Function to map a latency to its histogram bucket. Values below 16 ns get a bucket each, and
+// every power of two above gets METRIC_SUB_BUCKETS, so a bucket is within 1/8 of its values.
+int metrics_bucket(uint64_t nanoseconds)
+{
+    if (nanoseconds < 16)
+    {
+        return (int)nanoseconds;
+    }
+    int exponent = 63 - __builtin_clzll(nanoseconds);
+    int sub = (int)(nanoseconds >> (exponent - 3)) & (METRIC_SUB_BUCKETS - 1);
+    return 16 + (exponent - 4) * METRIC_SUB_BUCKETS + sub;
+}
+
+// Function to return the largest latency that falls in a bucket
+uint64_t metrics_bucket_top(int bucket)
+{
+    if (bucket < 16)
+    {
+        return bucket;
+    }
+    int exponent = (bucket - 16) / METRIC_SUB_BUCKETS + 4;
+    uint64_t sub = (bucket - 16) % METRIC_SUB_BUCKETS;
+    return ((METRIC_SUB_BUCKETS + sub + 1) << (exponent - 3)) - 1;
+}
+
+// Function to find the latency below which a share of the recorded operations fall, from their
+// histogram. A bucket stands for its largest value, though never more than the largest recorded.
+uint64_t metrics_percentile(const uint64_t *buckets, uint64_t count, uint64_t max, double share)
+{
+    uint64_t wanted = (uint64_t)(count * share);
+    uint64_t seen = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen > wanted)
+        {
+            uint64_t top = metrics_bucket_top(b);
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+// Function to count the bytes an arena holds and uses
+void arena_usage(const Arena *arena, size_t *reserved, size_t *used)
+{
+    *reserved = arena->allocated;
+    *used = 0;
+    for (const ArenaBlock *block = arena->blocks; block != NULL; block = block->next)
+    {
+        *used += block->used;
+    }
+}
+
+// Function to print the memory the library's books and indexes and the users take
+void print_memory_usage(Library *library, UserStore *users)
+{
+    // Indexes only grow under the write lock, so holding it gives one consistent picture
+    pthread_mutex_lock(&library->write_lock);
+    size_t reserved, used;
+    arena_usage(&library->arena, &reserved, &used);
+    size_t id_tables = 0;
+    for (int page = 0; page < BOOK_ID_PAGES; page++)
+    {
+        if (library->id_pages[page] != NULL)
+        {
+            id_tables += BOOK_ID_PAGE_SIZE * sizeof(Book *) + sizeof(BookColumns);
+        }
+    }
+    size_t titles = library->titles.capacity * sizeof(TitleSlot);
+    size_t authors = library->authors.capacity * sizeof(Author *) + library->authors.count * sizeof(Author *);
+    for (int a = 0; a < library->authors.count; a++)
+    {
+        authors += sizeof(Author) + library->authors.by_id[a]->capacity * sizeof(Book *);
+    }
+    size_t trigrams = library->trigrams.capacity * sizeof(TrigramPosting);
+    for (int t = 0; t < library->trigrams.capacity; t++)
+    {
+        trigrams += library->trigrams.slots[t].capacity * sizeof(Book *);
+    }
+    int book_count = library->total_books;
+    size_t recycled = library->recycled_bytes;
+    int retired = library->retired_books.count;
+    pthread_mutex_unlock(&library->write_lock);
+
+    size_t user_reserved, user_used;
+    arena_usage(&users->arena, &user_reserved, &user_used);
+    size_t user_table = users->capacity * sizeof(User *);
+    int histories = 0;
+    for (int i = 0; i < users->capacity; i++)
+    {
+        histories += users->slots[i] != NULL && users->slots[i]->history != NULL;
+    }
+    printf("Memory:\n");
+    printf("  books: %d books, %.1f MB in books, shelves and strings (%.1f MB reserved)\n", book_count, used / 1048576.0, reserved / 1048576.0);
+    printf("  removed books: %.1f KB of nodes and strings waiting for reuse, %d books not yet reclaimed\n",
+           recycled / 1024.0, retired);
+    printf("  snapshot mapping: %.1f MB\n", library->snapshot_size / 1048576.0);
+    printf("  id table and side table: %.1f MB\n", id_tables / 1048576.0);
+    printf("  title index: %.1f MB, author index: %.1f MB, trigram index: %.1f MB\n",
+           titles / 1048576.0, authors / 1048576.0, trigrams / 1048576.0);
+    printf("  users: %d users, %.1f KB (%.1f KB reserved)\n", users->count, (user_used + user_table) / 1024.0,
+           (user_reserved + user_table) / 1024.0);
+    printf("  co-borrow lists: %ld books, %.1f MB; borrow histories: %d users, %.1f MB\n", (long)library->co_borrow_lists,
+           library->co_borrow_lists * sizeof(CoBorrowList) / 1048576.0, histories,
+           histories * USER_HISTORY_LENGTH * sizeof(int) / 1048576.0);
+    pthread_mutex_lock(&library->loans.lock);
+    printf("  loans: %ld out, %ld overdue, %.1f KB\n", library->loans.count, library->loans.overdue_count,
+           (sizeof(LoanWheel) + library->loans.count * sizeof(Loan)) / 1024.0);
+    pthread_mutex_unlock(&library->loans.lock);
+}
+
+// Function to print operation latencies, skip list walks, level draws and memory use
+void print_metrics(Library *library, UserStore *users)
+{
+#if LIBRARY_METRICS
+    uint64_t (*buckets)[METRIC_BUCKETS] = calloc(METRIC_OPERATIONS, sizeof(*buckets));
+    uint64_t counts[METRIC_OPERATIONS] = {0}, totals[METRIC_OPERATIONS] = {0}, maxima[METRIC_OPERATIONS] = {0};
+    uint64_t walks[WALK_KINDS][4] = {{0}}; // Count, hops, comparisons, most hops
+    uint64_t levels[MAX_LEVEL] = {0};
+    uint64_t level_total = 0;
+
+    pthread_mutex_lock(&metrics_lock);
+    for (MetricsBlock *block = metrics_blocks; block != NULL; block = block->next)
+    {
+        for (int op = 0; op < METRIC_OPERATIONS; op++)
+        {
+            OperationMetrics *metrics = &block->operations[op];
+            counts[op] += metrics->count;
+            totals[op] += metrics->total_ns;
+            maxima[op] = metrics->max_ns > maxima[op] ? metrics->max_ns : maxima[op];
+            for (int b = 0; b < METRIC_BUCKETS; b++)
+            {
+                buckets[op][b] += metrics->buckets[b];
+            }
+        }
+        for (int kind = 0; kind < WALK_KINDS; kind++)
+        {
+            walks[kind][0] += block->walks[kind].count;
+            walks[kind][1] += block->walks[kind].hops;
+            walks[kind][2] += block->walks[kind].compares;
+            walks[kind][3] = block->walks[kind].max_hops > walks[kind][3] ? block->walks[kind].max_hops : walks[kind][3];
+        }
+        for (int level = 0; level < MAX_LEVEL; level++)
+        {
+            levels[level] += block->levels[level];
+            level_total += block->levels[level];
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    printf("Operations (microseconds):\n");
+    printf("  %-22s %10s %10s %10s %10s %10s %10s\n", "operation", "count", "mean", "p50", "p90", "p99", "max");
+    for (int op = 0; op < METRIC_OPERATIONS; op++)
+    {
+        if (counts[op] == 0)
+        {
+            continue;
+        }
+        printf("  %-22s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f\n", METRIC_NAMES[op], (unsigned long long)counts[op],
+               totals[op] / 1e3 / counts[op], metrics_percentile(buckets[op], counts[op], maxima[op], 0.5) / 1e3,
+               metrics_percentile(buckets[op], counts[op], maxima[op], 0.9) / 1e3,
+               metrics_percentile(buckets[op], counts[op], maxima[op], 0.99) / 1e3, maxima[op] / 1e3);
+    }
+    printf("Skip list walks:\n");
+    printf("  %-22s %10s %10s %12s %10s\n", "walk", "count", "hops/walk", "compares/walk", "max hops");
+    for (int kind = 0; kind < WALK_KINDS; kind++)
+    {
+        if (walks[kind][0] == 0)
+        {
+            continue;
+        }
+        printf("  %-22s %10llu %10.1f %12.1f %10llu\n", WALK_NAMES[kind], (unsigned long long)walks[kind][0],
+               (double)walks[kind][1] / walks[kind][0], (double)walks[kind][2] / walks[kind][0], (unsigned long long)walks[kind][3]);
+    }
+    printf("Levels drawn by add_book (library level %d):\n", library->level);
+    for (int level = 0; level < MAX_LEVEL && level_total > 0; level++)
+    {
+        if (levels[level] > 0)
+        {
+            printf("  level %2d: %10llu (%.2f%%)\n", level, (unsigned long long)levels[level], 100.0 * levels[level] / level_total);
+        }
+    }
+    free(buckets);
+#else
+    printf("Operation metrics are compiled out, build with -DLIBRARY_METRICS=1 to collect them.\n");
+#endif
+    print_memory_usage(library, users);
+}
+
+// Function to free memory allocated for the library
+void free_library(Library *library)
+{
+    if (library->journal)
+    {
+        journal_close(library->journal);
+    }
+    for (GenreShelf *shelf = library->shelves; shelf != NULL; shelf = shelf->next)
+    {
+        pthread_mutex_destroy(&shelf->top_lock);
+    }
+    pthread_mutex_destroy(&library->write_lock);
+    pthread_rwlock_destroy(&library->decay_lock);
+    for (int i = 0; i < CO_BORROW_LOCKS; i++)
+    {
+        pthread_mutex_destroy(&library->co_borrow_locks[i]);
+    }
+    loan_wheel_free(&library->loans);
+    free(library->retired_books.nodes);
+    free(library->moved_books.nodes);
+    free(library->retired_entries.nodes);
+    trigram_free(&library->trigrams);
+    author_index_free(&library->authors);
+    book_index_free(library);
+
+    // Books, shelves and strings all live in the arena or the snapshot mapping
+    arena_free(&library->arena);
+    if (library->snapshot)
+    {
+        munmap(library->snapshot, library->snapshot_size);
+    }
+    free(library);
+}
+
+// Counters of one stress-test worker
+typedef struct StressWorker
+{
+    Library *library;
+    int id;
+    unsigned int seed;
+    double deadline;
+    long operations;
+    long borrows; // Successful borrows
+    long returns; // Successful returns
+    long adds;
+    long removes; // Successful removals
+    long rebuilds;
+    long stale_reads;      // Held books that changed under the worker, which read sections rule out
+    long missed_reads;     // Books still in the library that a search did not find
+    const char *bulk_path; // Catalogue the maintenance thread bulk loads now and then
+} StressWorker;
+
+// Thread body that mixes borrows, returns, searches, recommendations, inserts and removals until the
+// deadline. Each batch of operations is one read section, through which the worker holds on to one
+// book, as a desk would, even if the book is removed or moved meanwhile.
+void *stress_worker(void *arg)
+{
+    StressWorker *worker = (StressWorker *)arg;
+    Library *library = worker->library;
+    char genres[MAX_GENRES][MAX_TITLE_LENGTH];
+    Book *results[PREFIX_SEARCH_LIMIT];
+
+    while (monotonic_seconds() < worker->deadline)
+    {
+        reader_enter();
+        Book *held = book_at_rank(library, 1 + rand_r(&worker->seed) % library->total_books);
+        int held_id = held ? held->id : 0;
+        char held_title[MAX_TITLE_LENGTH];
+        strcpy(held_title, held ? held->title : "");
+        for (int batch = 0; batch < 256; batch++)
+        {
+            int choice = rand_r(&worker->seed) % 100;
+            if (choice < 60)
+            {
+                // Random access through the span counts, then a borrow or a return
+                Book *book = book_at_rank(library, 1 + rand_r(&worker->seed) % library->total_books);
+                // Bulk loads and rebuilds relink the levels under the searches, which must still find
+                // every book that stays in the library. Books are filed by id only once fully linked.
+                int listed = book != NULL && find_book_by_id(library, book->id) == book;
+                Book *found = listed ? library_seek(library, book->title) : NULL;
+                if (listed && (found == NULL || strcmp(found->title, book->title) != 0) && book->status != STATUS_REMOVED &&
+                    book->status != STATUS_MOVED)
+                {
+                    worker->missed_reads++;
+                }
+                if (choice < 35)
+                {
+                    worker->borrows += borrow_book(library, book, NULL);
+                }
+                else
+                {
+                    worker->returns += return_book(library, book);
+                }
+            }
+            else if (choice < 90)
+            {
+                char prefix[32];
+                snprintf(prefix, sizeof(prefix), "Stress %03d", rand_r(&worker->seed) % 1000);
+                search_books_by_prefix(library, prefix, (choice & 1) ? "Genre 3" : NULL, choice & 2, results, PREFIX_SEARCH_LIMIT);
+            }
+            else if (choice < 94)
+            {
+                Book *top[RECOMMENDATION_CACHE_SIZE];
+                char genre[MAX_TITLE_LENGTH];
+                snprintf(genre, sizeof(genre), "Genre %d", rand_r(&worker->seed) % 10);
+                shelf_top_books(library, genre, top);
+            }
+            else if (choice < 98)
+            {
+                // Most popular books over the score column, which borrows write meanwhile
+                Book *top[10];
+                GenreQuery query;
+                genre_query_init(&query, choice & 1);
+                if (choice & 2)
+                {
+                    char genre[MAX_TITLE_LENGTH];
+                    snprintf(genre, sizeof(genre), "Genre %d", rand_r(&worker->seed) % 10);
+                    genre_query_add(library, &query, genre, '+');
+                }
+                top_books_by_genres(library, &query, NULL, top, 10);
+            }
+            else if (choice < 99)
+            {
+                char title[MAX_TITLE_LENGTH];
+                snprintf(title, sizeof(title), "Stress %03d added %d-%ld", rand_r(&worker->seed) % 1000, worker->id, worker->adds);
+                snprintf(genres[0], MAX_TITLE_LENGTH, "Genre %d", rand_r(&worker->seed) % 10);
+                add_book(library, title, "Stress Author", genres, 1, 0);
+                worker->adds++;
+            }
+            else
+            {
+                // Weeding, which other desks may still be reading or borrowing the book through
+                Book *book = book_at_rank(library, 1 + rand_r(&worker->seed) % library->total_books);
+                worker->removes += remove_book(library, book);
+            }
+            worker->operations++;
+        }
+        // A node reused for another book while still held would show a different id or title
+        if (held && (held->id != held_id || strcmp(held->title, held_title) != 0))
+        {
+            worker->stale_reads++;
+        }
+
+        reader_exit();
+    }
+    return NULL;
+}
+
+// Thread body that bulk loads a catalogue and rebuilds the levels now and then, and reclaims
+// removed and moved nodes until the deadline, while the workers keep reading through them
+void *stress_maintainer(void *arg)
+{
+    StressWorker *worker = (StressWorker *)arg;
+    while (monotonic_seconds() < worker->deadline)
+    {
+        usleep(2000);
+        if (++worker->operations % 25 == 0)
+        {
+            worker->adds += bulk_load_books_from_file(worker->library, worker->bulk_path, NULL);
+        }
+        if (worker->operations % 50 == 0)
+        {
+            rebuild_levels(worker->library, NULL);
+            worker->rebuilds++;
+        }
+        library_reclaim(worker->library);
+    }
+    return NULL;
+}
+
+// Function to check the skip lists and circulation counters after a stress run, returns 1 if consistent
+int stress_verify(Library *library, long expected_books, long borrows, long returns)
+{
+    long count = 0;
+    long borrow_total = 0;
+    long borrowed_now = 0;
+    long genre_total = 0;
+    int ok = 1;
+    Book *previous = NULL;
+    for (Book *book = library->header->forward[0].next; book != NULL; book = book->forward[0].next)
+    {
+        count++;
+        if (previous && strcmp(previous->title, book->title) > 0)
+        {
+            ok = 0;
+        }
+        if (count % 101 == 0 && book_at_rank(library, count) != book)
+        {
+            ok = 0;
+        }
+        borrow_total += book->borrow_count;
+        borrowed_now += (book->status == STATUS_BORROWED);
+        genre_total += book->gen_count;
+        previous = book;
+    }
+
+    long shelved = 0;
+    for (GenreShelf *shelf = library->shelves; shelf != NULL; shelf = shelf->next)
+    {
+        int shelf_count = 0;
+        for (ShelfEntry *entry = shelf->head->forward[0].next; entry != NULL; entry = entry->forward[0].next)
+        {
+            shelf_count++;
+        }
+        if (shelf_count != shelf->count)
+        {
+            ok = 0;
+        }
+        shelved += shelf_count;
+    }
+
+    if (count != expected_books || count != library->total_books || shelved != genre_total)
+    {
+        ok = 0;
+    }
+    // Removed books take their borrows with them, and their loans end with them
+    if (borrow_total + library->removed_borrows != borrows ||
+        borrowed_now != borrows - returns - library->removed_loans || borrowed_now != library->loans.count)
+    {
+        ok = 0;
+    }
+    return ok;
+}
+
+// Function to hammer one library from 1, 2, 4... threads and check it stays consistent,
+// returns the process exit status. With a journal path every change waits for its record to be synced.
+int run_stress_test(int max_threads, int book_count, double seconds, const char *journal_path)
+{
+    if (max_threads < 1 || max_threads > STRESS_MAX_THREADS)
+    {
+        max_threads = STRESS_MAX_THREADS;
+    }
+
+    Library *library = create_library();
+    char genres[MAX_GENRES][MAX_TITLE_LENGTH];
+    for (int i = 0; i < book_count; i++)
+    {
+        char title[MAX_TITLE_LENGTH];
+        snprintf(title, sizeof(title), "Stress %03d book %d", rand() % 1000, i);
+        snprintf(genres[0], MAX_TITLE_LENGTH, "Genre %d", i % 10);
+        snprintf(genres[1], MAX_TITLE_LENGTH, "Genre %d", (i / 10) % 10);
+        add_book(library, title, "Stress Author", genres, (i % 3 == 0) ? 2 : 1, 0);
+    }
+    if (journal_path)
+    {
+        remove(journal_path);
+        library->journal = journal_open(journal_path, NULL, 1);
+    }
+
+    // A catalogue for the maintenance thread to bulk load into the library while it is searched
+    char bulk_path[] = "/tmp/library-stress-XXXXXX";
+    int fd = mkstemp(bulk_path);
+    FILE *bulk = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (bulk == NULL)
+    {
+        fprintf(stderr, "Error creating stress catalogue.\n");
+        free_library(library);
+        return 1;
+    }
+    for (int i = 0; i < book_count / 10 + 1; i++)
+    {
+        fprintf(bulk, "Stress %03d loaded %d,Stress Author,Genre %d%s,0\n", rand() % 1000, i, i % 10, (i % 3 == 0 && i % 10 != 3) ? ",Genre 3" : "");
+    }
+    fclose(bulk);
+
+    long expected_books = book_count;
+    long borrows = 0;
+    long returns = 0;
+    long removes = 0;
+    int failures = 0;
+    for (int thread_count = 1; thread_count <= max_threads; thread_count *= 2)
+    {
+        StressWorker workers[STRESS_MAX_THREADS];
+        pthread_t threads[STRESS_MAX_THREADS];
+        StressWorker maintainer;
+        pthread_t maintainer_thread;
+        double started = monotonic_seconds();
+        memset(&maintainer, 0, sizeof(StressWorker));
+        maintainer.library = library;
+        maintainer.deadline = started + seconds;
+        maintainer.bulk_path = bulk_path;
+        pthread_create(&maintainer_thread, NULL, stress_maintainer, &maintainer);
+        for (int t = 0; t < thread_count; t++)
+        {
+            memset(&workers[t], 0, sizeof(StressWorker));
+            workers[t].library = library;
+            workers[t].id = t;
+            workers[t].seed = (unsigned int)rand();
+            workers[t].deadline = started + seconds;
+            pthread_create(&threads[t], NULL, stress_worker, &workers[t]);
+        }
+
+        long operations = 0;
+        long stale_reads = 0;
+        long missed_reads = 0;
+        for (int t = 0; t < thread_count; t++)
+        {
+            pthread_join(threads[t], NULL);
+            operations += workers[t].operations;
+            borrows += workers[t].borrows;
+            returns += workers[t].returns;
+            expected_books += workers[t].adds - workers[t].removes;
+            removes += workers[t].removes;
+            stale_reads += workers[t].stale_reads;
+            missed_reads += workers[t].missed_reads;
+        }
+        pthread_join(maintainer_thread, NULL);
+        expected_books += maintainer.adds;
+        double elapsed = monotonic_seconds() - started;
+
+        int ok = stress_verify(library, expected_books, borrows, returns) && stale_reads == 0 && missed_reads == 0;
+        failures += !ok;
+        printf("threads=%d operations=%ld ops_per_sec=%.0f books=%ld removed=%ld rebuilds=%ld %s\n",
+               thread_count, operations, operations / elapsed, expected_books, removes, maintainer.rebuilds, ok ? "ok" : "INCONSISTENT");
+        if (library->journal)
+        {
+            printf("journal records=%ld group_commits=%ld records_per_sync=%.1f\n", library->journal->records,
+                   library->journal->group_commits, (double)library->journal->records / (library->journal->group_commits ? library->journal->group_commits : 1));
+        }
+    }
+
+    unlink(bulk_path);
+    free_library(library);
+    return failures ? 1 : 0;
+}
+
+// Function to create a library of count shards, each an empty library of its own
+ShardedLibrary *create_sharded_library(int count)
+{
+    ShardedLibrary *sharded = (ShardedLibrary *)malloc(sizeof(ShardedLibrary));
+    sharded->count = count < 1 ? 1 : (count > SHARD_MAX ? SHARD_MAX : count);
+    for (int s = 0; s < sharded->count; s++)
+    {
+        sharded->shards[s] = create_library();
+    }
+    return sharded;
+}
+
+// Function to free every shard
+void free_sharded_library(ShardedLibrary *sharded)
+{
+    for (int s = 0; s < sharded->count; s++)
+    {
+        free_library(sharded->shards[s]);
+    }
+    free(sharded);
+}
+
+// Function to find the shard that holds a title. The high bits of the hash pick the shard, so the
+// low bits still spread the shard's titles over its title index. Copies of a title share a shard.
+int shard_of_title(const ShardedLibrary *sharded, const char *title)
+{
+    return (int)(((uint64_t)hash_string(title) * sharded->count) >> 32);
+}
+
+// Function to turn a shard's own book id into the id the sharded library knows the book by
+int sharded_book_id(const ShardedLibrary *sharded, int shard, const Book *book)
+{
+    return (book->id - 1) * sharded->count + shard + 1;
+}
+
+// Function to find a book by its sharded id, also giving its shard. Returns NULL if there is none.
+Book *sharded_find_by_id(ShardedLibrary *sharded, int id, int *shard)
+{
+    if (id <= 0)
+    {
+        return NULL;
+    }
+    *shard = (id - 1) % sharded->count;
+    return find_book_by_id(sharded->shards[*shard], (id - 1) / sharded->count + 1);
+}
+
+// Function to add a book to the shard of its title, returns that shard
+int sharded_add_book(ShardedLibrary *sharded, const char *title, const char *author, const char genres[MAX_GENRES][MAX_TITLE_LENGTH], int genre_count, int borrow_count)
+{
+    int shard = shard_of_title(sharded, title);
+    add_book(sharded->shards[shard], title, author, genres, genre_count, borrow_count);
+    return shard;
+}
+
+// Function run by each shard thread
+void *shard_worker(void *arg)
+{
+    ShardTask *task = (ShardTask *)arg;
+    task->run(task);
+    return NULL;
+}
+
+// Function to run an operation on every shard at once, one thread per shard, the first on the calling thread
+void shard_run(ShardedLibrary *sharded, ShardTask *tasks, void (*run)(ShardTask *task), const void *context)
+{
+    pthread_t threads[SHARD_MAX];
+    for (int s = 0; s < sharded->count; s++)
+    {
+        tasks[s].library = sharded->shards[s];
+        tasks[s].shard = s;
+        tasks[s].run = run;
+        tasks[s].context = context;
+        tasks[s].found = 0;
+        tasks[s].matched = 0;
+    }
+    for (int s = 1; s < sharded->count; s++)
+    {
+        pthread_create(&threads[s], NULL, shard_worker, &tasks[s]);
+    }
+    run(&tasks[0]);
+    for (int s = 1; s < sharded->count; s++)
+    {
+        pthread_join(threads[s], NULL);
+    }
+}
+
+// Function to add one shard's rows of a catalogue file to the shard
+void shard_load_task(ShardTask *task)
+{
+    for (int r = 0; r < task->row_count; r++)
+    {
+        char line[SHARD_ROW_LENGTH];
+        const char *row = task->data + task->rows[r];
+        const char *newline = memchr(row, '\n', task->data_size - task->rows[r]);
+        size_t length = newline ? (size_t)(newline - row) : task->data_size - task->rows[r];
+        length = length < sizeof(line) - 1 ? length : sizeof(line) - 1;
+        memcpy(line, row, length);
+        line[length] = '\0';
+
+        char title[MAX_TITLE_LENGTH], author[MAX_AUTHOR_LENGTH];
+        char genres[MAX_GENRES][MAX_TITLE_LENGTH];
+        int genre_count, borrow_count;
+        if (parse_book_line(line, title, author, genres, &genre_count, &borrow_count))
+        {
+            add_book(task->library, title, author, genres, genre_count, borrow_count);
+            task->found++;
+        }
+    }
+}
+
+// Function to load a catalogue file into a sharded library. Rows are sent to the shards of their
+// titles, then every shard adds its own rows on its own thread, so loading scales with the shards.
+void sharded_load_books(ShardedLibrary *sharded, const char *filename)
+{
+    double started = monotonic_seconds();
+    int fd = open(filename, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        printf("Error opening file.\n");
+        return;
+    }
+    size_t size = info.st_size;
+    const char *data = size > 0 ? (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        printf("Error mapping file.\n");
+        return;
+    }
+
+    ShardTask tasks[SHARD_MAX];
+    int capacity[SHARD_MAX];
+    for (int s = 0; s < sharded->count; s++)
+    {
+        tasks[s].data = data;
+        tasks[s].data_size = size;
+        tasks[s].rows = NULL;
+        tasks[s].row_count = 0;
+        capacity[s] = 0;
+    }
+    int malformed = 0;
+    for (size_t offset = 0; offset < size;)
+    {
+        const char *row = data + offset;
+        const char *newline = memchr(row, '\n', size - offset);
+        size_t length = newline ? (size_t)(newline - row) : size - offset;
+
+        // The title is read the way parse_book_line reads it, so it names the shard the book lands in
+        char line[SHARD_ROW_LENGTH];
+        size_t copied = length < sizeof(line) - 1 ? length : sizeof(line) - 1;
+        memcpy(line, row, copied);
+        line[copied] = '\0';
+        line[strcspn(line, "\r")] = '\0';
+        char *saved;
+        char *token = strtok_r(line, ",", &saved);
+        if (token != NULL && strtok_r(NULL, ",", &saved) != NULL)
+        {
+            char title[MAX_TITLE_LENGTH];
+            strncpy(title, token, MAX_TITLE_LENGTH - 1);
+            title[MAX_TITLE_LENGTH - 1] = '\0';
+            ShardTask *task = &tasks[shard_of_title(sharded, title)];
+            if (task->row_count == capacity[task - tasks])
+            {
+                capacity[task - tasks] = capacity[task - tasks] ? 2 * capacity[task - tasks] : 1024;
+                task->rows = (size_t *)realloc(task->rows, capacity[task - tasks] * sizeof(size_t));
+            }
+            task->rows[task->row_count++] = offset;
+        }
+        else if (length > 0)
+        {
+            malformed++;
+        }
+        offset += length + 1;
+    }
+    shard_run(sharded, tasks, shard_load_task, NULL);
+
+    int loaded = 0;
+    for (int s = 0; s < sharded->count; s++)
+    {
+        loaded += tasks[s].found;
+        malformed += tasks[s].row_count - tasks[s].found;
+        free(tasks[s].rows);
+    }
+    if (data != NULL)
+    {
+        munmap((void *)data, size);
+    }
+    printf("Loaded %d books into %d shards from %s in %.3f s, %d malformed rows skipped.\n", loaded, sharded->count,
+           filename, monotonic_seconds() - started, malformed);
+}
+
+// Function to collect up to limit books whose title starts with prefix from every shard, in title
+// order. Each shard's search is short, so the shards are searched in turn and their lists merged.
+int sharded_search_by_prefix(ShardedLibrary *sharded, const char *prefix, const char *genre, Book **results, int *shards, int limit)
+{
+    Book *found[SHARD_MAX][PREFIX_SEARCH_LIMIT];
+    int counts[SHARD_MAX], next[SHARD_MAX];
+    limit = limit < PREFIX_SEARCH_LIMIT ? limit : PREFIX_SEARCH_LIMIT;
+    for (int s = 0; s < sharded->count; s++)
+    {
+        counts[s] = search_books_by_prefix(sharded->shards[s], prefix, genre, 0, found[s], limit);
+        next[s] = 0;
+    }
+    int count = 0;
+    while (count < limit)
+    {
+        int best = -1;
+        for (int s = 0; s < sharded->count; s++)
+        {
+            if (next[s] < counts[s] && (best < 0 || strcmp(found[s][next[s]]->title, found[best][next[best]]->title) < 0))
+            {
+                best = s;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        shards[count] = best;
+        results[count++] = found[best][next[best]++];
+    }
+    return count;
+}
+
+// Function to find the first book on a genre shelf whose title starts with the given text, like
+// search_book_by_genre_then_title, and the shard that holds it. An exact title sorts before every
+// longer title it starts, so when the title's own shard holds it there is no need to ask the others.
+Book *sharded_search_book_by_genre_then_title(ShardedLibrary *sharded, const char *title, const char *genre, int *shard)
+{
+    *shard = shard_of_title(sharded, title);
+    Book *book = search_book_by_genre_then_title(sharded->shards[*shard], title, genre);
+    if (book != NULL && strcmp(book->title, title) == 0)
+    {
+        return book;
+    }
+    Book *results[1];
+    int shards[1];
+    if (sharded_search_by_prefix(sharded, title, genre, results, shards, 1) == 0)
+    {
+        return NULL;
+    }
+    *shard = shards[0];
+    return results[0];
+}
+
+// Function to parse a genre query once for each shard, as each shard numbers its genres itself.
+// The spec is left as it was. Returns 0 if the query cannot be run.
+int sharded_parse_genre_query(ShardedLibrary *sharded, const char *spec, GenreQuery *queries)
+{
+    for (int s = 0; s < sharded->count; s++)
+    {
+        char copy[SHARD_ROW_LENGTH];
+        snprintf(copy, sizeof(copy), "%s", spec);
+        if (!parse_genre_query(sharded->shards[s], copy, &queries[s]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to run one shard's part of a genre query
+void shard_genre_query_task(ShardTask *task)
+{
+    const ShardQuery *query = (const ShardQuery *)task->context;
+    task->matched = query_books_by_genres(task->library, &query->queries[task->shard], NULL, task->books, query->limit);
+    task->found = task->matched < query->limit ? (int)task->matched : query->limit;
+}
+
+// Function to run one shard's part of a popularity query
+void shard_top_books_task(ShardTask *task)
+{
+    const ShardQuery *query = (const ShardQuery *)task->context;
+    task->found = top_books_by_genres(task->library, &query->queries[task->shard], NULL, task->books, query->limit);
+}
+
+// Function to print the books matching a genre query in every shard, by sharded id
+void sharded_print_books_by_genres(ShardedLibrary *sharded, const char *spec)
+{
+    ShardQuery query;
+    if (!sharded_parse_genre_query(sharded, spec, query.queries))
+    {
+        return;
+    }
+    query.limit = GENRE_QUERY_LIMIT;
+    ShardTask tasks[SHARD_MAX];
+    Book *found[SHARD_MAX][GENRE_QUERY_LIMIT];
+    for (int s = 0; s < sharded->count; s++)
+    {
+        tasks[s].books = found[s];
+    }
+    shard_run(sharded, tasks, shard_genre_query_task, &query);
+
+    // Every shard lists its matches by id, and sharded ids keep that order within a shard
+    long total = 0;
+    int next[SHARD_MAX] = {0};
+    for (int s = 0; s < sharded->count; s++)
+    {
+        total += tasks[s].matched;
+    }
+    for (int printed = 0; printed < GENRE_QUERY_LIMIT; printed++)
+    {
+        int best = -1;
+        for (int s = 0; s < sharded->count; s++)
+        {
+            if (next[s] < tasks[s].found && (best < 0 || sharded_book_id(sharded, s, found[s][next[s]]) < sharded_book_id(sharded, best, found[best][next[best]])))
+            {
+                best = s;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        Book *book = found[best][next[best]++];
+        printf("ID: %d, Title: %s, Author: %s, Status: %s\n", sharded_book_id(sharded, best, book), book->title, book->author, book->status);
+    }
+    if (total > GENRE_QUERY_LIMIT)
+    {
+        printf("... and %ld more.\n", total - GENRE_QUERY_LIMIT);
+    }
+    printf("%ld books match.\n", total);
+}
+
+// Function to merge the most popular books of every shard into one top list. Scores are scaled
+// to each shard's own decay epoch, so the books are compared by their popularity now.
+int sharded_merge_top(ShardedLibrary *sharded, Book *found[][POPULARITY_LIMIT], const int *counts, Book **results, int *shards, double *popularity, int limit)
+{
+    int next[SHARD_MAX] = {0};
+    int count = 0;
+    while (count < limit)
+    {
+        int best = -1;
+        double best_popularity = 0;
+        for (int s = 0; s < sharded->count; s++)
+        {
+            if (next[s] < counts[s])
+            {
+                double candidate = book_popularity(sharded->shards[s], found[s][next[s]]);
+                if (best < 0 || candidate > best_popularity)
+                {
+                    best = s;
+                    best_popularity = candidate;
+                }
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        shards[count] = best;
+        popularity[count] = best_popularity;
+        results[count++] = found[best][next[best]++];
+    }
+    return count;
+}
+
+// Function to find the most popular books matching a genre query across every shard, each shard
+// scanning its own side table on its own thread. Returns the number found, or -1 if the query cannot be run.
+int sharded_top_books(ShardedLibrary *sharded, int limit, const char *spec, Book **results, int *shards, double *popularity)
+{
+    ShardQuery query;
+    if (!sharded_parse_genre_query(sharded, spec, query.queries))
+    {
+        return -1;
+    }
+    query.limit = limit > 0 && limit < POPULARITY_LIMIT ? limit : POPULARITY_LIMIT;
+    ShardTask tasks[SHARD_MAX];
+    Book *found[SHARD_MAX][POPULARITY_LIMIT];
+    int counts[SHARD_MAX];
+    for (int s = 0; s < sharded->count; s++)
+    {
+        tasks[s].books = found[s];
+    }
+    shard_run(sharded, tasks, shard_top_books_task, &query);
+    for (int s = 0; s < sharded->count; s++)
+    {
+        counts[s] = tasks[s].found;
+    }
+    return sharded_merge_top(sharded, found, counts, results, shards, popularity, query.limit);
+}
+
+// Function to print the most popular books matching a genre query across every shard
+void sharded_print_top_books(ShardedLibrary *sharded, int limit, const char *spec)
+{
+    Book *results[POPULARITY_LIMIT];
+    int shards[POPULARITY_LIMIT];
+    double popularity[POPULARITY_LIMIT];
+    int count = sharded_top_books(sharded, limit, spec, results, shards, popularity);
+    for (int i = 0; i < count; i++)
+    {
+        printf("ID: %d, Title: %s, Author: %s, Borrow Count: %d, Popularity: %.1f\n", sharded_book_id(sharded, shards[i], results[i]),
+               results[i]->title, results[i]->author, results[i]->borrow_count, popularity[i]);
+    }
+    if (count == 0)
+    {
+        printf("No books match.\n");
+    }
+}
+
+// Function to recommend the most popular books of a genre across every shard. Each shelf keeps
+// its top books up to date, so the shards' lists are merged without a scan.
+void sharded_recommend_books(ShardedLibrary *sharded, const char *genre)
+{
+    Book *found[SHARD_MAX][POPULARITY_LIMIT];
+    int counts[SHARD_MAX];
+    for (int s = 0; s < sharded->count; s++)
+    {
+        Book *top[RECOMMENDATION_CACHE_SIZE];
+        counts[s] = shelf_top_books(sharded->shards[s], genre, top);
+        counts[s] = counts[s] < POPULARITY_LIMIT ? counts[s] : POPULARITY_LIMIT;
+        memcpy(found[s], top, counts[s] * sizeof(Book *));
+    }
+    Book *results[RECOMMENDATION_COUNT];
+    int shards[RECOMMENDATION_COUNT];
+    double popularity[RECOMMENDATION_COUNT];
+    int count = sharded_merge_top(sharded, found, counts, results, shards, popularity, RECOMMENDATION_COUNT);
+    printf("\nTop Recommended Books in Genre '%s':\n", genre);
+    if (count == 0)
+    {
+        printf("No recommendations available.\n");
+    }
+    for (int i = 0; i < count; i++)
+    {
+        printf("ID: %d, Title: %s, Author: %s, Borrow Count: %d, Popularity: %.1f\n", sharded_book_id(sharded, shards[i], results[i]),
+               results[i]->title, results[i]->author, results[i]->borrow_count, popularity[i]);
+    }
+}
+
+// Function to stream up to limit books of every shard to a file in one title order, all of them
+// when limit is 0. The shards' cursors are merged a book at a time, so memory stays the same
+// whatever the size of the catalogue. Copies of a title share a shard, so no two shards hold
+// equal titles. Gives the last book written with its shard, and whether books are left, and
+// returns the number of books written or -1 if writing failed.
+long sharded_export_books(ShardedLibrary *sharded, BookCursor *cursors, FILE *file, int format, long limit, Book **last, int *last_shard, int *more)
+{
+    ExportBuffer out = {file, (char *)malloc(EXPORT_BUFFER), 0, 0};
+    Book *heads[SHARD_MAX];
+    for (int s = 0; s < sharded->count; s++)
+    {
+        heads[s] = NULL;
+        book_cursor_next(&cursors[s], &heads[s], 1);
+    }
+    long written = 0;
+    while (limit == 0 || written < limit)
+    {
+        int best = -1;
+        for (int s = 0; s < sharded->count; s++)
+        {
+            if (heads[s] != NULL && (best < 0 || strcmp(heads[s]->title, heads[best]->title) < 0))
+            {
+                best = s;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        export_book(&out, heads[best], sharded_book_id(sharded, best, heads[best]), format);
+        *last = heads[best];
+        *last_shard = best;
+        written++;
+        if (book_cursor_next(&cursors[best], &heads[best], 1) == 0)
+        {
+            heads[best] = NULL;
+        }
+    }
+    *more = 0;
+    for (int s = 0; s < sharded->count; s++)
+    {
+        *more |= heads[s] != NULL;
+    }
+    export_flush(&out);
+    free(out.data);
+    return out.failed ? -1 : written;
+}
+
+// Function to open a cursor on every shard, after a key such as "Dune#17" when key is not NULL.
+// The shard holding the key's title resumes right after its book, the others after the title.
+// Returns 0 if the genre query cannot be run.
+int sharded_cursors_open(ShardedLibrary *sharded, BookCursor *cursors, GenreQuery *queries, char *key, const char *spec)
+{
+    int filtered = spec != NULL && spec[0] != '\0';
+    if (filtered && !sharded_parse_genre_query(sharded, spec, queries))
+    {
+        return 0;
+    }
+    int id = 0;
+    char *mark = key ? strrchr(key, '#') : NULL;
+    if (mark != NULL && (id = parse_book_id(mark)) != 0)
+    {
+        *mark = '\0';
+    }
+    int key_shard = key != NULL && key[0] != '\0' ? shard_of_title(sharded, key) : -1;
+    for (int s = 0; s < sharded->count; s++)
+    {
+        int local_id = s == key_shard && id > 0 && (id - 1) % sharded->count == s ? (id - 1) / sharded->count + 1 : 0;
+        book_cursor_open(sharded->shards[s], &cursors[s], key_shard >= 0 ? key : NULL, local_id, filtered ? &queries[s] : NULL);
+    }
+    return 1;
+}
+
+// Function to export every shard's books matching a genre query, or all of them when spec is
+// empty, to a file or to stdout when the file name is "-"
+void sharded_export_catalogue(ShardedLibrary *sharded, const char *filename, int format, const char *spec)
+{
+    BookCursor cursors[SHARD_MAX];
+    GenreQuery queries[SHARD_MAX];
+    if (!sharded_cursors_open(sharded, cursors, queries, NULL, spec))
+    {
+        return;
+    }
+    int to_stdout = strcmp(filename, "-") == 0;
+    FILE *file = to_stdout ? stdout : fopen(filename, "w");
+    if (file == NULL)
+    {
+        printf("Error opening file.\n");
+        return;
+    }
+    double started = monotonic_seconds();
+    Book *last = NULL;
+    int last_shard, more;
+    long written = sharded_export_books(sharded, cursors, file, format, 0, &last, &last_shard, &more);
+    if (!to_stdout && fclose(file) != 0)
+    {
+        written = -1;
+    }
+    if (written < 0)
+    {
+        printf("Error writing %s.\n", filename);
+    }
+    else if (!to_stdout)
+    {
+        printf("Exported %ld books to %s in %.3f s.\n", written, filename, monotonic_seconds() - started);
+    }
+}
+
+// Function to print one page of every shard's books as JSON lines, in title order, then the key
+// that resumes after the page
+void sharded_print_books_page(ShardedLibrary *sharded, int count, char *key, const char *spec)
+{
+    BookCursor cursors[SHARD_MAX];
+    GenreQuery queries[SHARD_MAX];
+    if (!sharded_cursors_open(sharded, cursors, queries, key, spec))
+    {
+        return;
+    }
+    Book *last = NULL;
+    int last_shard, more;
+    sharded_export_books(sharded, cursors, stdout, EXPORT_JSONL, count, &last, &last_shard, &more);
+    if (last != NULL && more)
+    {
+        printf("Next page: %s#%d\n", last->title, sharded_book_id(sharded, last_shard, last));
+    }
+    else
+    {
+        printf("End of catalogue.\n");
+    }
+}
+// Counters of one sharded-test worker
+typedef struct ShardWorker
+{
+    ShardedLibrary *sharded;
+    unsigned int seed;
+    int first;       // Ingest: the worker adds books first, first + step, ... below end
+    int step;
+    int end;
+    int book_count;  // Queries: books already in the library
+    double deadline;
+    long operations;
+} ShardWorker;
+
+// Function to write the title of the sharded test's book number i, spread over the alphabet
+void shard_test_title(char *title, int i)
+{
+    snprintf(title, MAX_TITLE_LENGTH, "Shard %08x book %d", (unsigned int)i * 2654435761u, i);
+}
+
+// Function run by each ingest thread of the sharded test
+void *shard_ingest_worker(void *arg)
+{
+    ShardWorker *worker = (ShardWorker *)arg;
+    char genres[MAX_GENRES][MAX_TITLE_LENGTH];
+    for (int i = worker->first; i < worker->end; i += worker->step)
+    {
+        char title[MAX_TITLE_LENGTH];
+        shard_test_title(title, i);
+        snprintf(genres[0], MAX_TITLE_LENGTH, "Genre %d", i % 10);
+        snprintf(genres[1], MAX_TITLE_LENGTH, "Genre %d", (i / 10) % 10);
+        sharded_add_book(worker->sharded, title, "Shard Author", genres, 2, i % 7);
+        worker->operations++;
+    }
+    return NULL;
+}
+
+// Function run by each query thread of the sharded test: exact title lookups, prefix searches,
+// borrows and returns by id, and a few inserts
+void *shard_query_worker(void *arg)
+{
+    ShardWorker *worker = (ShardWorker *)arg;
+    ShardedLibrary *sharded = worker->sharded;
+    char genres[MAX_GENRES][MAX_TITLE_LENGTH];
+    int added = 0;
+    while (monotonic_seconds() < worker->deadline)
+    {
+        for (int k = 0; k < 64; k++)
+        {
+            int kind = rand_r(&worker->seed) % 100;
+            int i = rand_r(&worker->seed) % worker->book_count;
+            char title[MAX_TITLE_LENGTH];
+            shard_test_title(title, i);
+            if (kind < 70)
+            {
+                find_book_by_title(sharded->shards[shard_of_title(sharded, title)], title);
+            }
+            else if (kind < 80)
+            {
+                Book *results[PREFIX_SEARCH_LIMIT];
+                int shards[PREFIX_SEARCH_LIMIT];
+                title[12] = '\0';
+                sharded_search_by_prefix(sharded, title, NULL, results, shards, 5);
+            }
+            else if (kind < 95)
+            {
+                int shard;
+                Book *book = sharded_find_by_id(sharded, i + 1, &shard);
+                if (book != NULL && !borrow_book(sharded->shards[shard], book, NULL))
+                {
+                    return_book(sharded->shards[shard], book);
+                }
+            }
+            else
+            {
+                snprintf(title, sizeof(title), "Shard added %u-%d", worker->seed, added++);
+                snprintf(genres[0], MAX_TITLE_LENGTH, "Genre %d", i % 10);
+                sharded_add_book(sharded, title, "Shard Author", genres, 1, 0);
+            }
+        }
+        worker->operations += 64;
+    }
+    return NULL;
+}
+
+// Function to measure how ingest and query throughput grow with the number of shards. For 1, 2,
+// 4... shards, as many threads add the books, then run mixed traffic, then whole-catalogue top-10
+// queries fan out over the shards. Returns the exit status.
+int run_shard_test(int max_shards, int book_count, double seconds)
+{
+    max_shards = max_shards < 1 ? 1 : (max_shards > SHARD_MAX ? SHARD_MAX : max_shards);
+    book_count = book_count < 1 ? 1 : book_count;
+    for (int shard_count = 1; shard_count <= max_shards; shard_count *= 2)
+    {
+        ShardedLibrary *sharded = create_sharded_library(shard_count);
+        ShardWorker workers[SHARD_MAX];
+        pthread_t threads[SHARD_MAX];
+
+        double started = monotonic_seconds();
+        for (int t = 0; t < shard_count; t++)
+        {
+            memset(&workers[t], 0, sizeof(ShardWorker));
+            workers[t].sharded = sharded;
+            workers[t].first = t;
+            workers[t].step = shard_count;
+            workers[t].end = book_count;
+            pthread_create(&threads[t], NULL, shard_ingest_worker, &workers[t]);
+        }
+        for (int t = 0; t < shard_count; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+        double ingest_seconds = monotonic_seconds() - started;
+
+        started = monotonic_seconds();
+        for (int t = 0; t < shard_count; t++)
+        {
+            workers[t].seed = (unsigned int)rand();
+            workers[t].book_count = book_count;
+            workers[t].deadline = started + seconds;
+            workers[t].operations = 0;
+            pthread_create(&threads[t], NULL, shard_query_worker, &workers[t]);
+        }
+        long operations = 0;
+        for (int t = 0; t < shard_count; t++)
+        {
+            pthread_join(threads[t], NULL);
+            operations += workers[t].operations;
+        }
+        double query_seconds = monotonic_seconds() - started;
+
+        started = monotonic_seconds();
+        for (int q = 0; q < BENCH_LISTINGS * 10; q++)
+        {
+            Book *results[10];
+            int shards[10];
+            double popularity[10];
+            sharded_top_books(sharded, 10, q % 2 ? "+Genre 1,+Genre 2,available" : "", results, shards, popularity);
+        }
+        double top_seconds = (monotonic_seconds() - started) / (BENCH_LISTINGS * 10);
+
+        long books = 0;
+        for (int s = 0; s < shard_count; s++)
+        {
+            books += sharded->shards[s]->total_books;
+        }
+        printf("shards=%d ingest_per_sec=%.0f ops_per_sec=%.0f top10_ms=%.3f books=%ld\n", shard_count,
+               book_count / ingest_seconds, operations / query_seconds, top_seconds * 1e3, books);
+        free_sharded_library(sharded);
+    }
+    return 0;
+}
+
+// Latency totals of one kind of batch command
+typedef struct BatchCommand
+{
+    const char *name;
+    long count;
+    double total_seconds;
+    double max_seconds;
+} BatchCommand;
+
+// Function to split "first,rest" at the first comma, returns rest or NULL if there is no comma
+char *split_argument(char *arguments)
+{
+    char *comma = strchr(arguments, ',');
+    if (comma == NULL)
+    {
+        return NULL;
+    }
+    *comma = '\0';
+    return comma + 1;
+}
+
+User *batch_patron = NULL; // Patron of the last successful batch login, later borrows are theirs
+
+// Function to run one batch command, returns 0 if the command is unknown or its arguments are missing
+int batch_execute(Library *library, const char *command, char *arguments)
+{
+    if (strcmp(command, "add") == 0)
+    {
+        char title[MAX_TITLE_LENGTH], author[MAX_AUTHOR_LENGTH];
+        char genres[MAX_GENRES][MAX_TITLE_LENGTH];
+        int genre_count, borrow_count;
+        if (!parse_book_line(arguments, title, author, genres, &genre_count, &borrow_count))
+        {
+            return 0;
+        }
+        add_book(library, title, author, genres, genre_count, borrow_count);
+        printf("Book added: %s\n", title);
+    }
+    else if (strcmp(command, "search") == 0)
+    {
+        // search <title prefix>[,<genre>]
+        char *genre = split_argument(arguments);
+        Book *results[PREFIX_SEARCH_LIMIT];
+        int found = search_books_by_prefix(library, arguments, genre, 0, results, PREFIX_SEARCH_LIMIT);
+        for (int i = 0; i < found; i++)
+        {
+            printf("Book found: ID: %d, Title: %s, Author: %s\n", results[i]->id, results[i]->title, results[i]->author);
+        }
+        if (found == 0)
+        {
+            printf("Book not found.\n");
+        }
+    }
+    else if (strcmp(command, "genres") == 0)
+    {
+        // genres <genre>,-<genre>,+<genre>...[,available]
+        print_books_by_genres(library, arguments);
+    }
+    else if (strcmp(command, "top") == 0)
+    {
+        // top <count>[,<genre>,-<genre>,+<genre>...][,available]
+        char *spec = split_argument(arguments);
+        char everything[1] = "";
+        print_top_books(library, atoi(arguments), spec ? spec : everything);
+    }
+    else if (strcmp(command, "lookup") == 0)
+    {
+        // lookup <id> or lookup <exact title>, both O(1)
+        int id = parse_book_id(arguments);
+        Book *book = id ? find_book_by_id(library, id) : find_book_by_title(library, arguments);
+        if (book == NULL)
+        {
+            printf("Book not found.\n");
+        }
+        // Copies with the same title follow the first one
+        while (book != NULL)
+        {
+            printf("ID: %d, Title: %s, Author: %s, Status: %s\n", book->id, book->title, book->author, book->status);
+            Book *next = book->forward[0].next;
+            book = (!id && next != NULL && strcmp(next->title, book->title) == 0) ? next : NULL;
+        }
+    }
+    else if (strcmp(command, "borrow") == 0 || strcmp(command, "return") == 0)
+    {
+        // borrow <id> or borrow <title>,<genre>, and return the same way
+        char *genre = split_argument(arguments);
+        int id = genre ? 0 : parse_book_id(arguments);
+        if (genre == NULL && id == 0)
+        {
+            return 0;
+        }
+        Book *book = id ? find_book_by_id(library, id) : search_book_by_genre_then_title(library, arguments, genre);
+        if (command[0] == 'b')
+        {
+            if (borrow_book(library, book, batch_patron))
+            {
+                char due[32];
+                // The borrow went to the book's current node if a rebuild moved it
+                format_date(book_current(library, book)->last_borrowed + LOAN_PERIOD, due, sizeof(due));
+                printf("You have borrowed: %s by %s, due back on %s\n", book->title, book->author, due);
+            }
+            else
+                printf("Book is not available for borrowing.\n");
+        }
+        else
+        {
+            if (return_book(library, book))
+                printf("You have returned: %s by %s\n", book->title, book->author);
+            else
+                printf("This book was not borrowed or does not exist in the library.\n");
+        }
+    }
+    else if (strcmp(command, "remove") == 0)
+    {
+        // remove <id> or remove <title>,<genre>, for a weeded or lost copy
+        char *genre = split_argument(arguments);
+        int id = genre ? 0 : parse_book_id(arguments);
+        if (genre == NULL && id == 0)
+        {
+            return 0;
+        }
+        Book *book = id ? find_book_by_id(library, id) : search_book_by_genre_then_title(library, arguments, genre);
+        if (remove_book(library, book))
+            printf("Book removed: %s by %s\n", book->title, book->author);
+        else
+            printf("Book not found.\n");
+    }
+    else if (strcmp(command, "rebuild") == 0)
+    {
+        rebuild_levels(library, stdout);
+    }
+    else if (strcmp(command, "fuzzy") == 0)
+    {
+        // fuzzy <words from title or author>[,<genre>]
+        char *genre = split_argument(arguments);
+        Book *results[FUZZY_SEARCH_LIMIT];
+        double scores[FUZZY_SEARCH_LIMIT];
+        int found = fuzzy_search_books(library, arguments, genre, results, scores, FUZZY_SEARCH_LIMIT);
+        for (int i = 0; i < found; i++)
+        {
+            printf("ID: %d, Title: %s, Author: %s, Match: %.0f%%\n", results[i]->id, results[i]->title, results[i]->author, scores[i] * 100);
+        }
+        if (found == 0)
+        {
+            printf("No matching books.\n");
+        }
+    }
+    else if (strcmp(command, "author") == 0)
+    {
+        // author <name>[,title|popularity]
+        char *order = split_argument(arguments);
+        if (order != NULL && strcmp(order, "title") != 0 && strcmp(order, "popularity") != 0)
+        {
+            return 0;
+        }
+        print_books_by_author(library, arguments, order != NULL && strcmp(order, "popularity") == 0);
+    }
+    else if (strcmp(command, "recommend") == 0)
+    {
+        recommend_books(library, arguments);
+    }
+    else if (strcmp(command, "position") == 0)
+    {
+        // position <title>[,<genre>], without a genre the position is in the whole library
+        char *genre = split_argument(arguments);
+        if (genre == NULL)
+        {
+            int position = book_rank(library, arguments);
+            if (position != -1)
+                printf("The book '%s' is located at position %d in the library.\n", arguments, position);
+            else
+                printf("Book not found.\n");
+            return 1;
+        }
+        int position = find_book_position_in_genre(library, arguments, genre);
+        if (position != -1)
+            printf("The book '%s' is located at position %d on the '%s' shelf.\n", arguments, position, genre);
+        else
+            printf("Book not found in the '%s' genre shelf.\n", genre);
+    }
+    else if (strcmp(command, "load") == 0)
+    {
+        bulk_load_books_from_file(library, arguments, stdout);
+    }
+    else if (strcmp(command, "decay") == 0)
+    {
+        decay_borrow_counts(library);
+    }
+    else if (strcmp(command, "print") == 0)
+    {
+        print_books(library);
+    }
+    else if (strcmp(command, "register") == 0)
+    {
+        // register <username>,<password>,<type>, the type is 1 for a visitor or 2 for staff as in patron files
+        char *password = split_argument(arguments);
+        char *type = password ? split_argument(password) : NULL;
+        if (type == NULL || arguments[0] == '\0' || strlen(arguments) >= MAX_USER_NAME ||
+            (strcmp(type, "1") != 0 && strcmp(type, "2") != 0))
+        {
+            return 0;
+        }
+        if (create_user(&user_store, arguments, password, atoi(type)))
+            printf("Registration successful!\n");
+        else
+            printf("Username already taken.\n");
+    }
+    else if (strcmp(command, "login") == 0)
+    {
+        // login <username>,<password>
+        char *password = split_argument(arguments);
+        if (password == NULL)
+        {
+            return 0;
+        }
+        User *user = find_user(&user_store, arguments);
+        if (user != NULL && verify_password(user, password))
+        {
+            batch_patron = user;
+            printf("Login successful!\n");
+        }
+        else
+            printf("Invalid username or password.\n");
+    }
+    else if (strcmp(command, "suggest") == 0)
+    {
+        // suggest [<username>], for the logged in patron when no name is given
+        User *user = arguments[0] ? find_user(&user_store, arguments) : batch_patron;
+        if (user == NULL)
+        {
+            return 0;
+        }
+        print_recommendations_for_user(library, user);
+    }
+    else if (strcmp(command, "also") == 0)
+    {
+        // also <id> or also <exact title>
+        int id = parse_book_id(arguments);
+        Book *book = id ? find_book_by_id(library, id) : find_book_by_title(library, arguments);
+        if (book == NULL)
+        {
+            printf("Book not found.\n");
+        }
+        else
+        {
+            print_co_borrowed_books(library, book);
+        }
+    }
+    else if (strcmp(command, "patrons") == 0)
+    {
+        load_patrons_from_file(&user_store, arguments);
+    }
+    else if (strcmp(command, "save-patrons") == 0)
+    {
+        save_patrons(&user_store, arguments);
+    }
+    else if (strcmp(command, "save-snapshot") == 0)
+    {
+        save_snapshot(library, &user_store, arguments);
+    }
+    else if (strcmp(command, "open-snapshot") == 0)
+    {
+        load_snapshot(library, &user_store, arguments);
+    }
+    else if (strcmp(command, "journal") == 0)
+    {
+        // journal <journal file>[,<snapshot file>], records are group committed without waiting
+        char *base_path = split_argument(arguments);
+        Journal *journal = journal_start(library, arguments, base_path ? base_path : SNAPSHOT_FILE);
+        if (journal)
+        {
+            journal->wait_for_sync = 0;
+        }
+    }
+    else if (strcmp(command, "compact") == 0)
+    {
+        if (library->journal == NULL)
+        {
+            return 0;
+        }
+        save_snapshot(library, &user_store, library->journal->base_path);
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        print_metrics(library, &user_store);
+    }
+    else if (strcmp(command, "export") == 0)
+    {
+        // export csv|jsonl,<file or ->[,<genre>,-<genre>,+<genre>...][,available]
+        char *filename = split_argument(arguments);
+        char *spec = filename ? split_argument(filename) : NULL;
+        char everything[1] = "";
+        int format = strcmp(arguments, "csv") == 0 ? EXPORT_CSV : EXPORT_JSONL;
+        if (filename == NULL || filename[0] == '\0' || (format == EXPORT_JSONL && strcmp(arguments, "jsonl") != 0))
+        {
+            return 0;
+        }
+        export_catalogue(library, filename, format, spec ? spec : everything);
+    }
+    else if (strcmp(command, "page") == 0)
+    {
+        // page <count>[,<title>[#<id>] to start after][,<genre>,-<genre>,+<genre>...][,available]
+        char *key = split_argument(arguments);
+        char *spec = key ? split_argument(key) : NULL;
+        int count = atoi(arguments);
+        if (count <= 0 || count > PAGE_MAX_BOOKS)
+        {
+            return 0;
+        }
+        print_books_page(library, count, key, spec);
+    }
+    else if (strcmp(command, "overdue") == 0)
+    {
+        print_overdue_report(library);
+    }
+    else if (strcmp(command, "clock") == 0)
+    {
+        // clock [<days>], moves the library clock on to try out due dates and reminders
+        library->clock_offset += (time_t)(atof(arguments) * 24 * 60 * 60);
+        char today[32];
+        format_date(library_now(library), today, sizeof(today));
+        printf("Library date: %s\n", today);
+    }
+    else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+// Function to run one batch command on a sharded library, returns 0 if the command is unknown
+// or its arguments are missing. Commands that only touch patrons run as they do unsharded.
+int sharded_batch_execute(ShardedLibrary *sharded, const char *command, char *arguments)
+{
+    if (strcmp(command, "add") == 0)
+    {
+        char title[MAX_TITLE_LENGTH], author[MAX_AUTHOR_LENGTH];
+        char genres[MAX_GENRES][MAX_TITLE_LENGTH];
+        int genre_count, borrow_count;
+        if (!parse_book_line(arguments, title, author, genres, &genre_count, &borrow_count))
+        {
+            return 0;
+        }
+        sharded_add_book(sharded, title, author, genres, genre_count, borrow_count);
+        printf("Book added: %s\n", title);
+    }
+    else if (strcmp(command, "load") == 0)
+    {
+        sharded_load_books(sharded, arguments);
+    }
+    else if (strcmp(command, "search") == 0)
+    {
+        // search <title prefix>[,<genre>]
+        char *genre = split_argument(arguments);
+        Book *results[PREFIX_SEARCH_LIMIT];
+        int shards[PREFIX_SEARCH_LIMIT];
+        int found = sharded_search_by_prefix(sharded, arguments, genre, results, shards, PREFIX_SEARCH_LIMIT);
+        for (int i = 0; i < found; i++)
+        {
+            printf("Book found: ID: %d, Title: %s, Author: %s\n", sharded_book_id(sharded, shards[i], results[i]), results[i]->title, results[i]->author);
+        }
+        if (found == 0)
+        {
+            printf("Book not found.\n");
+        }
+    }
+    else if (strcmp(command, "lookup") == 0)
+    {
+        // lookup <id> or lookup <exact title>, each read from one shard
+        int id = parse_book_id(arguments);
+        int shard = id ? 0 : shard_of_title(sharded, arguments);
+        Book *book = id ? sharded_find_by_id(sharded, id, &shard) : find_book_by_title(sharded->shards[shard], arguments);
+        if (book == NULL)
+        {
+            printf("Book not found.\n");
+        }
+        while (book != NULL)
+        {
+            printf("ID: %d, Title: %s, Author: %s, Status: %s\n", sharded_book_id(sharded, shard, book), book->title, book->author, book->status);
+            Book *next = book->forward[0].next;
+            book = (!id && next != NULL && strcmp(next->title, book->title) == 0) ? next : NULL;
+        }
+    }
+    else if (strcmp(command, "borrow") == 0 || strcmp(command, "return") == 0)
+    {
+        // borrow <id> or borrow <title>,<genre>, and return the same way. Borrow histories hold
+        // one library's ids, so sharded borrows are not recorded for the patron.
+        char *genre = split_argument(arguments);
+        int id = genre ? 0 : parse_book_id(arguments);
+        if (genre == NULL && id == 0)
+        {
+            return 0;
+        }
+        int shard = 0;
+        Book *book = id ? sharded_find_by_id(sharded, id, &shard) : sharded_search_book_by_genre_then_title(sharded, arguments, genre, &shard);
+        if (command[0] == 'b')
+        {
+            if (borrow_book(sharded->shards[shard], book, NULL))
+            {
+                char due[32];
+                format_date(book_current(sharded->shards[shard], book)->last_borrowed + LOAN_PERIOD, due, sizeof(due));
+                printf("You have borrowed: %s by %s, due back on %s\n", book->title, book->author, due);
+            }
+            else
+                printf("Book is not available for borrowing.\n");
+        }
+        else
+        {
+            if (return_book(sharded->shards[shard], book))
+                printf("You have returned: %s by %s\n", book->title, book->author);
+            else
+                printf("This book was not borrowed or does not exist in the library.\n");
+        }
+    }
+    else if (strcmp(command, "remove") == 0)
+    {
+        // remove <id> or remove <title>,<genre>, from the one shard that holds the book
+        char *genre = split_argument(arguments);
+        int id = genre ? 0 : parse_book_id(arguments);
+        if (genre == NULL && id == 0)
+        {
+            return 0;
+        }
+        int shard = 0;
+        Book *book = id ? sharded_find_by_id(sharded, id, &shard) : sharded_search_book_by_genre_then_title(sharded, arguments, genre, &shard);
+        if (remove_book(sharded->shards[shard], book))
+            printf("Book removed: %s by %s\n", book->title, book->author);
+        else
+            printf("Book not found.\n");
+    }
+    else if (strcmp(command, "rebuild") == 0)
+    {
+        for (int s = 0; s < sharded->count; s++)
+        {
+            rebuild_levels(sharded->shards[s], stdout);
+        }
+    }
+    else if (strcmp(command, "genres") == 0)
+    {
+        sharded_print_books_by_genres(sharded, arguments);
+    }
+    else if (strcmp(command, "top") == 0)
+    {
+        char *spec = split_argument(arguments);
+        sharded_print_top_books(sharded, atoi(arguments), spec ? spec : "");
+    }
+    else if (strcmp(command, "recommend") == 0)
+    {
+        sharded_recommend_books(sharded, arguments);
+    }
+    else if (strcmp(command, "export") == 0)
+    {
+        char *filename = split_argument(arguments);
+        char *spec = filename ? split_argument(filename) : NULL;
+        int format = strcmp(arguments, "csv") == 0 ? EXPORT_CSV : EXPORT_JSONL;
+        if (filename == NULL || filename[0] == '\0' || (format == EXPORT_JSONL && strcmp(arguments, "jsonl") != 0))
+        {
+            return 0;
+        }
+        sharded_export_catalogue(sharded, filename, format, spec ? spec : "");
+    }
+    else if (strcmp(command, "page") == 0)
+    {
+        char *key = split_argument(arguments);
+        char *spec = key ? split_argument(key) : NULL;
+        int count = atoi(arguments);
+        if (count <= 0 || count > PAGE_MAX_BOOKS)
+        {
+            return 0;
+        }
+        sharded_print_books_page(sharded, count, key, spec);
+    }
+    else if (strcmp(command, "register") == 0 || strcmp(command, "login") == 0 || strcmp(command, "patrons") == 0 ||
+             strcmp(command, "save-patrons") == 0)
+    {
+        return batch_execute(sharded->shards[0], command, arguments);
+    }
+    else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+// Function to run a stream of commands, one per line, without the menus, on the sharded library
+// when sharded is not NULL. Output is fully buffered, and throughput and latency totals go to stderr at the end.
+int run_batch(Library *library, ShardedLibrary *sharded, FILE *input)
+{
+    BatchCommand commands[] = {
+        {"add", 0, 0, 0}, {"search", 0, 0, 0}, {"fuzzy", 0, 0, 0}, {"author", 0, 0, 0}, {"borrow", 0, 0, 0}, {"return", 0, 0, 0},
+        {"lookup", 0, 0, 0}, {"genres", 0, 0, 0}, {"top", 0, 0, 0}, {"suggest", 0, 0, 0}, {"also", 0, 0, 0}, {"recommend", 0, 0, 0}, {"position", 0, 0, 0}, {"load", 0, 0, 0}, {"decay", 0, 0, 0},
+        {"print", 0, 0, 0}, {"register", 0, 0, 0}, {"login", 0, 0, 0}, {"patrons", 0, 0, 0},
+        {"save-patrons", 0, 0, 0}, {"save-snapshot", 0, 0, 0}, {"open-snapshot", 0, 0, 0},
+        {"journal", 0, 0, 0}, {"compact", 0, 0, 0}, {"stats", 0, 0, 0}, {"overdue", 0, 0, 0}, {"clock", 0, 0, 0},
+        {"export", 0, 0, 0}, {"page", 0, 0, 0}, {"remove", 0, 0, 0}, {"rebuild", 0, 0, 0}};
+    int command_kinds = sizeof(commands) / sizeof(commands[0]);
+    long errors = 0;
+    long total = 0;
+
+    setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+    char *line = NULL;
+    size_t line_capacity = 0;
+    double started = monotonic_seconds();
+    while (getline(&line, &line_capacity, input) != -1)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+
+        // The command word ends at the first space, the rest of the line is its arguments
+        char *arguments = strchr(line, ' ');
+        if (arguments)
+        {
+            *arguments++ = '\0';
+        }
+        else
+        {
+            arguments = line + strlen(line);
+        }
+
+        double command_started = monotonic_seconds();
+        reader_enter();
+        int ok = sharded ? sharded_batch_execute(sharded, line, arguments) : batch_execute(library, line, arguments);
+        reader_exit();
+        journal_maybe_compact(library, &user_store);
+        // Books the command removed or moved can be reused once no read section can reach them
+        library_reclaim(library);
+        for (int s = 0; sharded != NULL && s < sharded->count; s++)
+        {
+            library_reclaim(sharded->shards[s]);
+        }
+        double elapsed = monotonic_seconds() - command_started;
+        // Reminders for loans that came due or fell overdue follow the command's own output
+        loan_advance(library, library_now(library), stdout);
+        for (int s = 0; sharded != NULL && s < sharded->count; s++)
+        {
+            loan_advance(sharded->shards[s], library_now(sharded->shards[s]), stdout);
+        }
+        total++;
+        if (!ok)
+        {
+            printf("Invalid command: %s\n", line);
+            errors++;
+            continue;
+        }
+        for (int i = 0; i < command_kinds; i++)
+        {
+            if (strcmp(commands[i].name, line) == 0)
+            {
+                commands[i].count++;
+                commands[i].total_seconds += elapsed;
+                if (elapsed > commands[i].max_seconds)
+                {
+                    commands[i].max_seconds = elapsed;
+                }
+                break;
+            }
+        }
+    }
+    if (library->journal)
+    {
+        journal_flush(library->journal);
+    }
+    double elapsed = monotonic_seconds() - started;
+    free(line);
+    fflush(stdout);
+    if (library->journal)
+    {
+        fprintf(stderr, "Journal: %ld records in %ld group commits\n", library->journal->records, library->journal->group_commits);
     }
-    else
+
+    fprintf(stderr, "Batch: %ld commands in %.3f s (%.0f commands/sec), %ld invalid\n",
+            total, elapsed, elapsed > 0 ? total / elapsed : 0.0, errors);
+    fprintf(stderr, "%-10s %10s %12s %12s %12s\n", "command", "count", "total_ms", "avg_us", "max_us");
+    for (int i = 0; i < command_kinds; i++)
     {
-        int last_borrow_count = -1;
-        for (int i = 0; i < RECOMMENDATION_COUNT && heap->size > 0; i++)
+        if (commands[i].count > 0)
         {
-            Book *recommended = extract_max(heap);
-            if (recommended)
-            { // Ensure recommended book exists
-                if (recommended->borrow_count != last_borrow_count)
-                {
-                    last_borrow_count = recommended->borrow_count; // Update the last borrow count
-                    printf("Title: %s, Author: %s, Borrow Count: %d\n",
-                           recommended->title, recommended->author, recommended->borrow_count);
-                }
-                // To handle additional books with the same borrow count
-                while (heap->size > 0 && heap->books[0]->borrow_count == last_borrow_count)
-                {
-                    recommended = extract_max(heap);
-                    printf("Title: %s, Author: %s, Borrow Count: %d\n",
-                           recommended->title, recommended->author, recommended->borrow_count);
-                }
-            }
+            fprintf(stderr, "%-10s %10ld %12.3f %12.3f %12.3f\n", commands[i].name, commands[i].count,
+                    commands[i].total_seconds * 1e3, commands[i].total_seconds * 1e6 / commands[i].count,
+                    commands[i].max_seconds * 1e6);
         }
     }
-
-    free(heap->books);
-    free(heap);
+    return errors ? 1 : 0;
 }
 
-// Function to create a new library
-Library *create_library()
+// Latency samples of one benchmarked operation
+typedef struct BenchSamples
 {
-    Library *library = (Library *)malloc(sizeof(Library));
-    library->header = (Book *)malloc(sizeof(Book));
-    strcpy(library->header->title, "");
-    library->header->borrow_count = 0;
-    library->level = 0;
-    library->total_books = 0;
+    long *nanoseconds;
+    long count;
+    long capacity;
+    double total_seconds;
+} BenchSamples;
 
-    for (int i = 0; i < MAX_LEVEL; i++)
+// Function to record one timed operation
+void bench_record(BenchSamples *samples, double seconds)
+{
+    if (samples->count < samples->capacity)
     {
-        library->header->forward[i] = NULL;
+        samples->nanoseconds[samples->count] = (long)(seconds * 1e9);
     }
-    return library;
+    samples->count++;
+    samples->total_seconds += seconds;
 }
 
-// Linked list to store users (both staff and visitors)
-User *user_list = NULL;
-
-// Function to register a new user
-void register_user() {
-    User *new_user = (User *)malloc(sizeof(User));
-    
-    printf("Enter username: ");
-    fgets(new_user->username, MAX_USER_NAME, stdin);
-    new_user->username[strcspn(new_user->username, "\n")] = '\0';  // Remove the newline
-
-    printf("Enter password: ");
-    fgets(new_user->password, MAX_PASSWORD, stdin);
-    new_user->password[strcspn(new_user->password, "\n")] = '\0';  // Remove the newline
-
-    printf("Registering as:\n");
-    printf("1. Visitor\n");
-    printf("2. Staff\n");
-    printf("Enter your choice: ");
-    scanf("%d", &new_user->user_type);
-    getchar();  // To consume the newline after scanf
-    
-    new_user->next = user_list;  // Add to the list of users
-    user_list = new_user;
-
-    printf("Registration successful!\n");
+// Comparison of two latencies for qsort
+int compare_longs(const void *a, const void *b)
+{
+    long left = *(const long *)a;
+    long right = *(const long *)b;
+    return (left > right) - (left < right);
 }
 
-// Function to login a user
-User* login_user() {
-    char username[MAX_USER_NAME], password[MAX_PASSWORD];
-    
-    printf("Enter username: ");
-    fgets(username, MAX_USER_NAME, stdin);
-    username[strcspn(username, "\n")] = '\0';  // Remove the newline
-
-    printf("Enter password: ");
-    fgets(password, MAX_PASSWORD, stdin);
-    password[strcspn(password, "\n")] = '\0';  // Remove the newline
+// Function to write one JSON line of results and reset the samples.
+// Single-shot operations that touch every book report per-book cost through per_op_count.
+void bench_report(FILE *report, const char *operation, long books, BenchSamples *samples, long per_op_count)
+{
+    long stored = samples->count < samples->capacity ? samples->count : samples->capacity;
+    qsort(samples->nanoseconds, stored, sizeof(long), compare_longs);
+    long p50 = stored ? samples->nanoseconds[stored / 2] : 0;
+    long p90 = stored ? samples->nanoseconds[stored * 9 / 10] : 0;
+    long p99 = stored ? samples->nanoseconds[stored * 99 / 100] : 0;
+    long max = stored ? samples->nanoseconds[stored - 1] : 0;
 
-    // Traverse the user list and check credentials
-    User *current = user_list;
-    while (current != NULL) {
-        if (strcmp(current->username, username) == 0 && strcmp(current->password, password) == 0) {
-            printf("Login successful!\n");
-            return current;  // Return the user if found
-        }
-        current = current->next;
-    }
-    
-    printf("Invalid username or password.\n");
-    return NULL;  // Return NULL if login failed
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(report, "{\"op\":\"%s\",\"books\":%ld,\"ops\":%ld,\"total_ms\":%.3f,\"ns_per_op\":%.1f,"
+                    "\"p50_ns\":%ld,\"p90_ns\":%ld,\"p99_ns\":%ld,\"max_ns\":%ld,\"peak_rss_kb\":%ld}\n",
+            operation, books, samples->count, samples->total_seconds * 1e3,
+            samples->total_seconds * 1e9 / (per_op_count > 0 ? per_op_count : 1),
+            p50, p90, p99, max, usage.ru_maxrss);
+    fflush(report);
+    samples->count = 0;
+    samples->total_seconds = 0;
 }
 
-// Function to add a new book to the library
-void add_book(Library *library, const char *title, const char *author, const char genres[MAX_GENRES][MAX_TITLE_LENGTH], int genre_count, int borrow_count)
+// Function to time every core operation on libraries of the given sizes, returns the exit status.
+// Results are written as JSON lines to stdout, the operations' own output is discarded.
+int run_benchmark(long *sizes, int size_count)
 {
-    Book *new_book = (Book *)malloc(sizeof(Book));
-    strcpy(new_book->title, title);
-    strcpy(new_book->author, author);
-
-    for (int i = 0; i < genre_count; i++)
-    {
-        strcpy(new_book->genre[i], genres[i]);
-    }
-    new_book->borrow_count = borrow_count;
-    new_book->gen_count = genre_count;
-    int level = 0;
-    while ((rand() % 2) && (level < MAX_LEVEL - 1))
-    {
-        level++;
-    }
-    if (level > library->level)
+    int report_fd = dup(STDOUT_FILENO);
+    FILE *report = fdopen(report_fd, "w");
+    if (report == NULL || freopen("/dev/null", "w", stdout) == NULL)
     {
-        library->level = level;
+        fprintf(stderr, "Error redirecting output.\n");
+        return 1;
     }
-    strcpy(new_book->status, "available");
-    Book *current = library->header;
-    for (int i = library->level; i >= 0; i--)
+
+    const char *genre_names[] = {"Fiction", "Non-Fiction", "Fantasy", "Science Fiction", "Biography",
+                                 "History", "Mystery", "Romance", "Horror", "Adventure"};
+    int genre_total = sizeof(genre_names) / sizeof(genre_names[0]);
+
+    for (int s = 0; s < size_count; s++)
     {
-        while (current->forward[i] != NULL && strcmp(current->forward[i]->title, title) < 0)
+        long books = sizes[s];
+        BenchSamples samples;
+        samples.capacity = books > BENCH_QUERIES ? books : BENCH_QUERIES;
+        samples.nanoseconds = (long *)malloc(samples.capacity * sizeof(long));
+        samples.count = 0;
+        samples.total_seconds = 0;
+
+        char (*titles)[BENCH_TITLE_LENGTH] = malloc(books * sizeof(*titles));
+        for (long i = 0; i < books; i++)
         {
-            current = current->forward[i];
+            snprintf(titles[i], BENCH_TITLE_LENGTH, "Bench %08x title %ld", (unsigned int)rand(), i);
         }
-        if (i <= level)
+
+        // add_book, one book at a time
+        Library *library = create_library();
+        char genres[MAX_GENRES][MAX_TITLE_LENGTH];
+        for (long i = 0; i < books; i++)
         {
-            new_book->forward[i] = current->forward[i];
-            current->forward[i] = new_book;
+            strcpy(genres[0], genre_names[i % genre_total]);
+            strcpy(genres[1], genre_names[(i / genre_total) % genre_total]);
+            double started = monotonic_seconds();
+            add_book(library, titles[i], "Bench Author", genres, (i % 3 == 0) ? 2 : 1, rand() % 50);
+            bench_record(&samples, monotonic_seconds() - started);
         }
-    }
-
-    library->total_books++;
-}
-
-void read_books_from_file(Library *library, const char *filename)
-{
-    FILE *file = fopen(filename, "r");
-    if (!file)
-    {
-        printf("Error opening file.\n");
-        return;
-    }
+        bench_report(report, "add_book", books, &samples, samples.count);
 
-    char line[256];
-    while (fgets(line, sizeof(line), file))
-    {
-        char title[MAX_TITLE_LENGTH];
-        char author[MAX_AUTHOR_LENGTH];
-        char genres[MAX_GENRES][MAX_TITLE_LENGTH];
-        int borrow_count;
-        int genre_count = 0;
+        for (long q = 0; q < BENCH_QUERIES; q++)
+        {
+            long i = rand() % books;
+            double started = monotonic_seconds();
+            search_book_by_genre_then_title(library, titles[i], genre_names[i % genre_total]);
+            bench_record(&samples, monotonic_seconds() - started);
+        }
+        bench_report(report, "search_hit", books, &samples, samples.count);
 
-        // Remove newline character from the line
-        line[strcspn(line, "\n")] = '\0';
+        for (long q = 0; q < BENCH_QUERIES; q++)
+        {
+            char missing[BENCH_TITLE_LENGTH];
+            snprintf(missing, sizeof(missing), "Bench %08x missing", (unsigned int)rand());
+            double started = monotonic_seconds();
+            search_book_by_genre_then_title(library, missing, genre_names[q % genre_total]);
+            bench_record(&samples, monotonic_seconds() - started);
+        }
+        bench_report(report, "search_miss", books, &samples, samples.count);
 
-        // Parse title
-        char *token = strtok(line, ",");
-        if (token == NULL)
-            continue;
-        strncpy(title, token, MAX_TITLE_LENGTH);
+        for (long q = 0; q < BENCH_QUERIES; q++)
+        {
+            long i = rand() % books;
+            double started = monotonic_seconds();
+            find_book_by_id(library, (int)i + 1);
+            bench_record(&samples, monotonic_seconds() - started);
+        }
+        bench_report(report, "find_book_by_id", books, &samples, samples.count);
 
-        // Parse author
-        token = strtok(NULL, ",");
-        if (token == NULL)
-            continue;
-        strncpy(author, token, MAX_AUTHOR_LENGTH);
+        for (long q = 0; q < BENCH_QUERIES; q++)
+        {
+            long i = rand() % books;
+            double started = monotonic_seconds();
+            find_book_by_title(library, titles[i]);
+            bench_record(&samples, monotonic_seconds() - started);
+        }
+        bench_report(report, "find_book_by_title", books, &samples, samples.count);
 
-        // Parse genres
-        while ((token = strtok(NULL, ",")) != NULL)
+        // Whole-catalogue genre scans, "<genre> and <genre> but not <genre>, available", scalar against SIMD
+        const char *kernel_name;
+        GenreScan best = genre_scan_best(&kernel_name);
+        char best_op[64];
+        snprintf(best_op, sizeof(best_op), "genre_query_%s", kernel_name);
+        GenreScan kernels[2] = {genre_scan_scalar, best};
+        const char *kernel_ops[2] = {"genre_query_scalar", best_op};
+        for (int k = 0; k < 2; k++)
         {
-            // Check if this token is the borrow count (last token)
-            if (sscanf(token, "%d", &borrow_count) == 1)
+            for (long q = 0; q < BENCH_SCANS; q++)
             {
-                break;
+                GenreQuery query;
+                genre_query_init(&query, 1);
+                genre_query_add(library, &query, genre_names[q % genre_total], '=');
+                genre_query_add(library, &query, genre_names[(q + 1) % genre_total], '+');
+                genre_query_add(library, &query, genre_names[(q + 2) % genre_total], '+');
+                genre_query_add(library, &query, genre_names[(q + 3) % genre_total], '-');
+                Book *first;
+                double started = monotonic_seconds();
+                query_books_by_genres(library, &query, kernels[k], &first, 1);
+                bench_record(&samples, monotonic_seconds() - started);
             }
-            // Otherwise, add the genre to the array
-            strncpy(genres[genre_count], token, MAX_TITLE_LENGTH);
-            genre_count++;
+            bench_report(report, kernel_ops[k], books, &samples, samples.count);
         }
 
-        // Add the book to the library
-        add_book(library, title, author, genres, genre_count, borrow_count);
-    }
-
-    fclose(file);
-    printf("Books loaded successfully from file.\n");
-}
-
-Book *search_book_by_genre_then_title(Library *library, const char *title, const char *genre)
-{
+        // Whole-catalogue top 10 of "<genre> or <genre>, available", scalar against SIMD
+        PopularityScan popularity_kernels[2] = {popularity_scan_scalar, popularity_scan_best(&kernel_name)};
+        const char *top_ops[2] = {"top_books_scalar", best_op};
+        snprintf(best_op, sizeof(best_op), "top_books_%s", kernel_name);
+        for (int k = 0; k < 2; k++)
+        {
+            for (long q = 0; q < BENCH_SCANS; q++)
+            {
+                GenreQuery query;
+                genre_query_init(&query, 1);
+                genre_query_add(library, &query, genre_names[q % genre_total], '+');
+                genre_query_add(library, &query, genre_names[(q + 1) % genre_total], '+');
+                Book *top[10];
+                double started = monotonic_seconds();
+                top_books_by_genres(library, &query, popularity_kernels[k], top, 10);
+                bench_record(&samples, monotonic_seconds() - started);
+            }
+            bench_report(report, top_ops[k], books, &samples, samples.count);
+        }
 
-    Book *current = library->header;
+        // The whole-catalogue part of a decay rebase, with a factor that leaves scores as they are
+        for (long q = 0; q < BENCH_SCANS; q++)
+        {
+            double started = monotonic_seconds();
+            rescale_scores(library, 1.0);
+            bench_record(&samples, monotonic_seconds() - started);
+        }
+        bench_report(report, "rescale_scores", books, &samples, samples.count);
 
-    while (current != NULL)
-    {
+        for (long q = 0; q < BENCH_LISTINGS; q++)
+        {
+            double started = monotonic_seconds();
+            print_books(library);
+            bench_record(&samples, monotonic_seconds() - started);
+        }
+        bench_report(report, "print_books", books, &samples, samples.count);
 
-        for (int j = 0; j < current->gen_count; j++)
+        // Streaming dumps, reported per book written
+        const char *export_ops[2] = {"export_csv", "export_jsonl"};
+        for (int format = EXPORT_CSV; format <= EXPORT_JSONL; format++)
         {
-            if (strcmp(current->genre[j], genre) == 0)
+            for (long q = 0; q < BENCH_LISTINGS; q++)
             {
-                if (strncmp(current->title, title, strlen(title)) == 0)
-                {
-                    return current; //  the book with matching title and genre
-                }
+                BookCursor cursor;
+                book_cursor_open(library, &cursor, NULL, 0, NULL);
+                double started = monotonic_seconds();
+                export_books(&cursor, stdout, format, 0);
+                bench_record(&samples, monotonic_seconds() - started);
             }
+            bench_report(report, export_ops[format], books, &samples, samples.count * books);
         }
-        current = current->forward[0]; // Move to next book in the skip list
-    }
 
-    return NULL;
-}
+        for (long q = 0; q < BENCH_QUERIES; q++)
+        {
+            long i = rand() % books;
+            double started = monotonic_seconds();
+            find_book_position_in_genre(library, titles[i], genre_names[i % genre_total]);
+            bench_record(&samples, monotonic_seconds() - started);
+        }
+        bench_report(report, "find_book_position_in_genre", books, &samples, samples.count);
 
-// Structure to represent a genre shelf (sorted list of books)
-typedef struct GenreShelf
-{
-    char genre[MAX_TITLE_LENGTH]; // Genre name
-    Book *head;                   // Head of the list for this genre
-    struct GenreShelf *next;      // Link to the next genre shelf
-} GenreShelf;
+        for (long q = 0; q < BENCH_QUERIES; q++)
+        {
+            double started = monotonic_seconds();
+            recommend_books(library, genre_names[q % genre_total]);
+            bench_record(&samples, monotonic_seconds() - started);
+        }
+        bench_report(report, "recommend_books", books, &samples, samples.count);
 
-int find_book_position_in_genre(Library *library, const char *title, const char *genre)
-{
-    Book *current = library->header;
-    int position = 1;
+        // Patrons borrow and return books, each borrow updating the co-borrow lists
+        UserStore patrons = {NULL, 0, 0, {NULL, 0}};
+        User *patron_table[BENCH_PATRONS];
+        unsigned char salt[USER_SALT_LENGTH] = {0}, password_hash[USER_HASH_LENGTH] = {0};
+        for (int p = 0; p < BENCH_PATRONS; p++)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "patron%d", p);
+            patron_table[p] = store_user(&patrons, name, salt, password_hash, 1);
+        }
+        for (long q = 0; q < (long)BENCH_PATRONS * BENCH_PATRON_BORROWS; q++)
+        {
+            Book *book = find_book_by_id(library, 1 + rand() % books);
+            double started = monotonic_seconds();
+            borrow_book(library, book, patron_table[q % BENCH_PATRONS]);
+            bench_record(&samples, monotonic_seconds() - started);
+            return_book(library, book);
+        }
+        bench_report(report, "borrow_book_with_history", books, &samples, samples.count);
 
-    while (current != NULL)
-    {
+        for (long q = 0; q < BENCH_QUERIES; q++)
+        {
+            Book *results[PERSONAL_RECOMMENDATION_COUNT];
+            int scores[PERSONAL_RECOMMENDATION_COUNT];
+            double started = monotonic_seconds();
+            recommend_for_user(library, patron_table[q % BENCH_PATRONS], results, scores, PERSONAL_RECOMMENDATION_COUNT);
+            bench_record(&samples, monotonic_seconds() - started);
+        }
+        bench_report(report, "recommend_for_user", books, &samples, samples.count);
+        free_user_store(&patrons);
 
-        for (int j = 0; j < current->gen_count; j++)
+        // Weeding: a tenth of the books go and as many copies come back, on the nodes they left
+        for (long q = 0; q < books / 10; q++)
         {
-            if (strcmp(current->genre[j], genre) == 0)
-            {
+            Book *book = find_book_by_id(library, (int)(q * 10 + 1));
+            double started = monotonic_seconds();
+            remove_book(library, book);
+            bench_record(&samples, monotonic_seconds() - started);
+            library_reclaim(library);
+            strcpy(genres[0], genre_names[q % genre_total]);
+            add_book(library, titles[q * 10], "Bench Author", genres, 1, 0);
+        }
+        bench_report(report, "remove_book", books, &samples, samples.count);
 
-                if (strcmp(current->title, title) == 0)
-                {
-                    return position;
-                }
+        double rebuild_started = monotonic_seconds();
+        rebuild_levels(library, NULL);
+        bench_record(&samples, monotonic_seconds() - rebuild_started);
+        library_reclaim(library);
+        bench_report(report, "rebuild_levels", books, &samples, books);
 
-                position++;
+        // The same catalogue as a file, for both loaders
+        char path[] = "/tmp/library-bench-XXXXXX";
+        int fd = mkstemp(path);
+        FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (file == NULL)
+        {
+            fprintf(stderr, "Error creating benchmark file.\n");
+            return 1;
+        }
+        for (Book *book = library->header->forward[0].next; book != NULL; book = book->forward[0].next)
+        {
+            fprintf(file, "%s,%s", book->title, book->author);
+            for (int j = 0; j < book->gen_count; j++)
+            {
+                fprintf(file, ",%s", book->genre[j]);
             }
+            fprintf(file, ",%d\n", book->borrow_count);
         }
+        fclose(file);
+
+        double started = monotonic_seconds();
+        free_library(library);
+        bench_record(&samples, monotonic_seconds() - started);
+        bench_report(report, "free_library", books, &samples, books);
 
-        current = current->forward[0]; // Move to the next book in the skip list
+        library = create_library();
+        started = monotonic_seconds();
+        read_books_from_file(library, path);
+        bench_record(&samples, monotonic_seconds() - started);
+        bench_report(report, "read_books_from_file", books, &samples, books);
+        free_library(library);
+
+        library = create_library();
+        started = monotonic_seconds();
+        bulk_load_books_from_file(library, path, NULL);
+        bench_record(&samples, monotonic_seconds() - started);
+        bench_report(report, "bulk_load_books_from_file", books, &samples, books);
+        free_library(library);
+
+        unlink(path);
+        free(titles);
+        free(samples.nanoseconds);
     }
 
-    return -1;
+    fclose(report);
+    return 0;
 }
 
-// Function to decay borrow counts over time
-void decay_borrow_counts(Library *library)
-{
-    time_t current_time = time(NULL);
-    for (Book *current = library->header->forward[0]; current != NULL; current = current->forward[0])
-    {
-        double decay_factor = difftime(current_time, current->last_borrowed) / (30 * 24 * 60 * 60);
-        current->borrow_count = (int)(current->borrow_count * pow(DECAY_RATE, decay_factor));
+int main(int argc, char *argv[]) {
+    srand(time(NULL));
+
+    // library --stress [threads] [books] [seconds per thread count] [journal file]
+    if (argc > 1 && strcmp(argv[1], "--stress") == 0) {
+        return run_stress_test(argc > 2 ? atoi(argv[2]) : 8,
+                               argc > 3 ? atoi(argv[3]) : 100000,
+                               argc > 4 ? atof(argv[4]) : 2.0,
+                               argc > 5 ? argv[5] : NULL);
     }
-}
 
-// Function to print all books in the library
-void print_books(Library *library)
-{
-    printf("Books in Library:\n");
-    for (Book *current = library->header->forward[0]; current != NULL; current = current->forward[0])
-    {
-        printf("Title: %s, Author: %s, Genres: ", current->title, current->author);
-        for (int j = 0; j < current->gen_count; j++)
-        {                                                                                // Changed to use gen_count
-            printf("%s%s", current->genre[j], (j < current->gen_count - 1) ? ", " : ""); // Use a conditional to manage commas
+    // library --bench [sizes...], sizes default to 1e3, 1e4 and 1e5 books
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        long sizes[BENCH_MAX_SIZES] = {1000, 10000, 100000};
+        int size_count = 3;
+        if (argc > 2) {
+            size_count = 0;
+            for (int i = 2; i < argc && size_count < BENCH_MAX_SIZES; i++) {
+                // Sizes must be whole numbers of books, as the benchmark picks books modulo the size.
+                // Out of range sizes saturate to LONG_MAX, which the INT_MAX check rejects
+                char *end;
+                long size = strtol(argv[i], &end, 10);
+                if (end == argv[i] || *end != '\0' || size <= 0 || size > INT_MAX) {
+                    printf("Usage: %s --bench [sizes...], where each size is a positive number of books\n", argv[0]);
+                    return 1;
+                }
+                sizes[size_count++] = size;
+            }
         }
-        printf(", Borrow Count: %d\n", current->borrow_count);
+        return run_benchmark(sizes, size_count);
     }
-}
 
-// Function to free memory allocated for the library
-void free_library(Library *library)
-{
-    Book *current = library->header;
-    while (current != NULL)
-    {
-        Book *next = current->forward[0];
-        free(current);
-        current = next;
+    // library --shards [most shards] [books] [seconds of traffic per shard count]
+    if (argc > 1 && strcmp(argv[1], "--shards") == 0) {
+        return run_shard_test(argc > 2 ? atoi(argv[2]) : 8,
+                              argc > 3 ? atoi(argv[3]) : 200000,
+                              argc > 4 ? atof(argv[4]) : 2.0);
     }
-    free(library);
-}
 
-int main() {
-    srand(time(NULL));
     Library *library = create_library();
+
+    // library --batch [command file] [shards], commands are read from stdin without a file or with "-"
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        FILE *input = (argc > 2 && strcmp(argv[2], "-") != 0) ? fopen(argv[2], "r") : stdin;
+        if (input == NULL) {
+            printf("Error opening file.\n");
+            free_library(library);
+            return 1;
+        }
+        ShardedLibrary *sharded = argc > 3 && atoi(argv[3]) > 1 ? create_sharded_library(atoi(argv[3])) : NULL;
+        int status = run_batch(library, sharded, input);
+        if (input != stdin) {
+            fclose(input);
+        }
+        if (sharded) {
+            free_sharded_library(sharded);
+        }
+        free_library(library);
+        free_user_store(&user_store);
+        return status;
+    }
+
+    // Restart from the last snapshot instead of re-reading the catalogue,
+    // then replay the changes made since it was saved
+    journal_start(library, JOURNAL_FILE, SNAPSHOT_FILE);
+
     int user_type = 0;
     int choice;
 
@@ -501,6 +9254,13 @@ int main() {
                         printf("4. Borrow a book\n");
                         printf("5. Return a book\n");
                         printf("6. Exit to Main Menu\n");
+                        printf("7. Find titles starting with...\n");
+                        printf("8. Search titles and authors, allowing typos\n");
+                        printf("9. Books by an author\n");
+                        printf("10. Books by several genres\n");
+                        printf("11. Most popular books, optionally by several genres\n");
+                        printf("12. Recommended for you\n");
+                        printf("13. Patrons who borrowed a book also borrowed...\n");
                         printf("Enter your choice: ");
                         scanf("%d", &choice);
                         getchar(); // to consume newline
@@ -517,9 +9277,15 @@ int main() {
 
                             Book *book = search_book_by_genre_then_title(library, title, genre);
                             if (book) {
-                                printf("Book found: Title: %s, Author: %s\n", book->title, book->author);
+                                printf("Book found: ID: %d, Title: %s, Author: %s\n", book->id, book->title, book->author);
                             } else {
                                 printf("Book not found.\n");
+                                Book *results[FUZZY_SEARCH_LIMIT];
+                                double scores[FUZZY_SEARCH_LIMIT];
+                                int found = fuzzy_search_books(library, title, genre[0] ? genre : NULL, results, scores, 3);
+                                for (int i = 0; i < found; i++) {
+                                    printf("Did you mean: Title: %s, Author: %s\n", results[i]->title, results[i]->author);
+                                }
                             }
                         } else if (choice == 2) {
                             print_books(library);
@@ -531,41 +9297,132 @@ int main() {
                             recommend_books(library, genre);
                         } else if (choice == 4) { // Borrow a book
                             char title[MAX_TITLE_LENGTH], genre[MAX_TITLE_LENGTH];
-                            printf("Enter book title to borrow: ");
+                            printf("Enter book ID or title to borrow: ");
                             fgets(title, MAX_TITLE_LENGTH, stdin);
                             title[strcspn(title, "\n")] = '\0';
 
-                            printf("Enter genre: ");
-                            fgets(genre, MAX_TITLE_LENGTH, stdin);
-                            genre[strcspn(genre, "\n")] = '\0';
-
-                            Book *book = search_book_by_genre_then_title(library, title, genre);
-                            if (book && strcmp(book->status, "available") == 0) {
-                                strcpy(book->status, "borrowed");
-                                book->last_borrowed = time(NULL);
-                                book->borrow_count++;
+                            // An id names one copy directly, a title needs its genre
+                            Book *book = find_book_by_id(library, parse_book_id(title));
+                            if (book == NULL) {
+                                printf("Enter genre: ");
+                                fgets(genre, MAX_TITLE_LENGTH, stdin);
+                                genre[strcspn(genre, "\n")] = '\0';
+                                book = search_book_by_genre_then_title(library, title, genre);
+                            }
+                            if (borrow_book(library, book, logged_in_user)) {
+                                char due[32];
+                                format_date(book_current(library, book)->last_borrowed + LOAN_PERIOD, due, sizeof(due));
                                 printf("You have borrowed: %s by %s\n", book->title, book->author);
+                                printf("Due back on %s\n", due);
                             } else {
                                 printf("Book is not available for borrowing.\n");
                             }
                         } else if (choice == 5) { // Return a book
                             char title[MAX_TITLE_LENGTH], genre[MAX_TITLE_LENGTH];
-                            printf("Enter book title to return: ");
+                            printf("Enter book ID or title to return: ");
                             fgets(title, MAX_TITLE_LENGTH, stdin);
                             title[strcspn(title, "\n")] = '\0';
 
-                            printf("Enter genre: ");
+                            // An id names one copy directly, a title needs its genre
+                            Book *book = find_book_by_id(library, parse_book_id(title));
+                            if (book == NULL) {
+                                printf("Enter genre: ");
+                                fgets(genre, MAX_TITLE_LENGTH, stdin);
+                                genre[strcspn(genre, "\n")] = '\0';
+                                book = search_book_by_genre_then_title(library, title, genre);
+                            }
+                            if (return_book(library, book)) {
+                                printf("You have returned: %s by %s\n", book->title, book->author);
+                            } else {
+                                printf("This book was not borrowed or does not exist in the library.\n");
+                            }
+                        } else if (choice == 7) { // Autocomplete-style title lookup
+                            char prefix[MAX_TITLE_LENGTH], genre[MAX_TITLE_LENGTH];
+                            int available_only;
+                            printf("Enter the start of the title: ");
+                            fgets(prefix, MAX_TITLE_LENGTH, stdin);
+                            prefix[strcspn(prefix, "\n")] = '\0';
+
+                            printf("Enter genre (leave empty for all genres): ");
                             fgets(genre, MAX_TITLE_LENGTH, stdin);
                             genre[strcspn(genre, "\n")] = '\0';
 
-                            Book *book = search_book_by_genre_then_title(library, title, genre);
-                            if (book && strcmp(book->status, "borrowed") == 0) {
-                                strcpy(book->status, "available");
-                                printf("You have returned: %s by %s\n", book->title, book->author);
+                            printf("Only available books? (1 = yes, 0 = no): ");
+                            scanf("%d", &available_only);
+                            getchar();
+
+                            Book *results[PREFIX_SEARCH_LIMIT];
+                            int found = search_books_by_prefix(library, prefix, genre[0] ? genre : NULL, available_only, results, PREFIX_SEARCH_LIMIT);
+                            for (int i = 0; i < found; i++) {
+                                printf("ID: %d, Title: %s, Author: %s, Status: %s\n", results[i]->id, results[i]->title, results[i]->author, results[i]->status);
+                            }
+                            if (found == 0) {
+                                printf("No matching books.\n");
+                            }
+                        } else if (choice == 8) { // Typo-tolerant search
+                            char query[MAX_TITLE_LENGTH], genre[MAX_TITLE_LENGTH];
+                            printf("Enter words from the title or author: ");
+                            fgets(query, MAX_TITLE_LENGTH, stdin);
+                            query[strcspn(query, "\n")] = '\0';
+
+                            printf("Enter genre (leave empty for all genres): ");
+                            fgets(genre, MAX_TITLE_LENGTH, stdin);
+                            genre[strcspn(genre, "\n")] = '\0';
+
+                            Book *results[FUZZY_SEARCH_LIMIT];
+                            double scores[FUZZY_SEARCH_LIMIT];
+                            int found = fuzzy_search_books(library, query, genre[0] ? genre : NULL, results, scores, FUZZY_SEARCH_LIMIT);
+                            for (int i = 0; i < found; i++) {
+                                printf("ID: %d, Title: %s, Author: %s, Match: %.0f%%\n", results[i]->id, results[i]->title, results[i]->author, scores[i] * 100);
+                            }
+                            if (found == 0) {
+                                printf("No matching books.\n");
+                            }
+                        } else if (choice == 9) {
+                            char author[MAX_AUTHOR_LENGTH];
+                            int order;
+                            printf("Enter author name: ");
+                            fgets(author, MAX_AUTHOR_LENGTH, stdin);
+                            author[strcspn(author, "\n")] = '\0';
+
+                            printf("Sort by (1 = title, 2 = popularity): ");
+                            scanf("%d", &order);
+                            getchar();
+                            print_books_by_author(library, author, order == 2);
+                        } else if (choice == 10) {
+                            char spec[MAX_GENRES * MAX_TITLE_LENGTH];
+                            printf("Enter genres separated by commas. Put - before a genre to exclude it, + before genres\n");
+                            printf("of which any one will do, and add 'available' to skip borrowed books: ");
+                            fgets(spec, sizeof(spec), stdin);
+                            spec[strcspn(spec, "\n")] = '\0';
+                            print_books_by_genres(library, spec);
+                        } else if (choice == 11) {
+                            char spec[MAX_GENRES * MAX_TITLE_LENGTH];
+                            int count;
+                            printf("How many books? ");
+                            scanf("%d", &count);
+                            getchar();
+                            printf("Enter genres as for option 10, or leave empty for the whole library: ");
+                            fgets(spec, sizeof(spec), stdin);
+                            spec[strcspn(spec, "\n")] = '\0';
+                            print_top_books(library, count, spec);
+                        } else if (choice == 12) {
+                            print_recommendations_for_user(library, logged_in_user);
+                        } else if (choice == 13) {
+                            char title[MAX_TITLE_LENGTH];
+                            printf("Enter book ID or exact title: ");
+                            fgets(title, MAX_TITLE_LENGTH, stdin);
+                            title[strcspn(title, "\n")] = '\0';
+
+                            int id = parse_book_id(title);
+                            Book *book = id ? find_book_by_id(library, id) : find_book_by_title(library, title);
+                            if (book != NULL) {
+                                print_co_borrowed_books(library, book);
                             } else {
-                                printf("This book was not borrowed or does not exist in the library.\n");
+                                printf("Book not found.\n");
                             }
                         }
+                        journal_maybe_compact(library, &user_store);
                     } while (choice != 6); // Exit to Main Menu
                 } else if (user_type == 2) { // Staff options
                     do {
@@ -575,7 +9432,17 @@ int main() {
                         printf("3. Search for a book\n");
                         printf("4. Print all books\n");
                         printf("5. Exit to Main Menu\n");
-                        printf("6. Position of book\n ");
+                        printf("6. Position of book\n");
+                        printf("7. Books on a shelf by position\n");
+                        printf("8. Bulk load a large catalogue file\n");
+                        printf("9. Load patrons from file\n");
+                        printf("10. Save patrons to file\n");
+                        printf("11. Save snapshot\n");
+                        printf("12. Show metrics\n");
+                        printf("13. Overdue report\n");
+                        printf("14. Export catalogue\n");
+                        printf("15. Remove a book\n");
+                        printf("16. Rebuild skip list levels\n");
                         printf("Enter your choice: ");
                         scanf("%d", &choice);
                         getchar(); // to consume newline
@@ -633,17 +9500,95 @@ int main() {
                             fgets(title, MAX_TITLE_LENGTH, stdin);
                             title[strcspn(title, "\n")] = '\0';
 
-                            printf("Enter genre to search: ");
+                            printf("Enter genre to search (empty for the whole library): ");
+                            fgets(genre, MAX_TITLE_LENGTH, stdin);
+                            genre[strcspn(genre, "\n")] = '\0';
+
+                            if (genre[0] == '\0') {
+                                int position = book_rank(library, title);
+                                if (position != -1) {
+                                    printf("The book '%s' is located at position %d in the library.\n", title, position);
+                                } else {
+                                    printf("Book not found.\n");
+                                }
+                            } else {
+                                int position = find_book_position_in_genre(library, title, genre);
+                                if (position != -1) {
+                                    printf("The book '%s' is located at position %d on the '%s' shelf.\n", title, position, genre);
+                                } else {
+                                    printf("Book not found in the '%s' genre shelf.\n", genre);
+                                }
+                            }
+                        } else if (choice == 7) { // Page through a genre shelf by position
+                            char genre[MAX_TITLE_LENGTH];
+                            int first, last;
+                            printf("Enter genre: ");
                             fgets(genre, MAX_TITLE_LENGTH, stdin);
                             genre[strcspn(genre, "\n")] = '\0';
 
-                            int position = find_book_position_in_genre(library, title, genre);
-                            if (position != -1) {
-                                printf("The book '%s' is located at position %d on the '%s' shelf.\n", title, position, genre);
+                            printf("Enter first and last position: ");
+                            scanf("%d %d", &first, &last);
+                            getchar();
+                            print_shelf_page(library, genre, first, last);
+                        } else if (choice == 8) {
+                            char filename[100];
+                            printf("Enter the filename to bulk load books from: ");
+                            fgets(filename, sizeof(filename), stdin);
+                            filename[strcspn(filename, "\n")] = '\0';
+                            bulk_load_books_from_file(library, filename, stdout);
+                        } else if (choice == 9 || choice == 10) {
+                            char filename[100];
+                            printf("Enter the patron filename: ");
+                            fgets(filename, sizeof(filename), stdin);
+                            filename[strcspn(filename, "\n")] = '\0';
+                            if (choice == 9) {
+                                load_patrons_from_file(&user_store, filename);
+                            } else {
+                                save_patrons(&user_store, filename);
+                            }
+                        } else if (choice == 11) {
+                            save_snapshot(library, &user_store, SNAPSHOT_FILE);
+                        } else if (choice == 12) {
+                            print_metrics(library, &user_store);
+                        } else if (choice == 13) {
+                            print_overdue_report(library);
+                        } else if (choice == 14) {
+                            char filename[100], spec[MAX_TITLE_LENGTH * 4];
+                            int format;
+                            printf("Enter 1 for CSV or 2 for JSON lines: ");
+                            scanf("%d", &format);
+                            getchar();
+                            printf("Enter the filename to export to: ");
+                            fgets(filename, sizeof(filename), stdin);
+                            filename[strcspn(filename, "\n")] = '\0';
+                            printf("Enter genres such as Fantasy,-Horror,available (empty for every book): ");
+                            fgets(spec, sizeof(spec), stdin);
+                            spec[strcspn(spec, "\n")] = '\0';
+                            export_catalogue(library, filename, format == 1 ? EXPORT_CSV : EXPORT_JSONL, spec);
+                        } else if (choice == 15) { // Weed out a book
+                            char title[MAX_TITLE_LENGTH], genre[MAX_TITLE_LENGTH];
+                            printf("Enter book ID or title to remove: ");
+                            fgets(title, MAX_TITLE_LENGTH, stdin);
+                            title[strcspn(title, "\n")] = '\0';
+
+                            // An id names one copy directly, a title needs its genre
+                            Book *book = find_book_by_id(library, parse_book_id(title));
+                            if (book == NULL) {
+                                printf("Enter genre: ");
+                                fgets(genre, MAX_TITLE_LENGTH, stdin);
+                                genre[strcspn(genre, "\n")] = '\0';
+                                book = search_book_by_genre_then_title(library, title, genre);
+                            }
+                            if (remove_book(library, book)) {
+                                printf("Book removed: %s by %s\n", book->title, book->author);
                             } else {
-                                printf("Book not found in the '%s' genre shelf.\n", genre);
+                                printf("Book not found.\n");
                             }
+                        } else if (choice == 16) {
+                            rebuild_levels(library, stdout);
                         }
+                        journal_maybe_compact(library, &user_store);
+                        library_reclaim(library);
 
                     } while (choice != 5); // Exit to Main Menu
                 }
@@ -652,5 +9597,6 @@ int main() {
     }
     while (user_type != 3); // Exit the program
     free_library(library);
+    free_user_store(&user_store);
     return 0;
 }